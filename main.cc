@@ -1,16 +1,487 @@
 
-#include "system.hh"
+// Headless benchmark: runs System::setup/advance over a sweep of body counts
+// and thread counts and reports throughput and scaling as CSV or JSON
+//
+//   nbody_bench [--sizes 4096,16384,65536] [--threads 1,2,4] [--steps 10]
+//               [--warmup 1] [--dt 1.0] [--method direct|tiled|symmetric|bh|pm|fmm]
+//               [--rsqrt raw|newton1|newton2|exact] [--scenario NAME | --ic FILE]
+//               [--seed S] [--sort K] [--block-levels L] [--weak] [--json]
+//               [--output PREFIX [--every K] [--queue D] [--compress BITS [--sfc]]]
+//               [--checkpoint PATH [--checkpoint-every K]] [--restart PATH]
+//               [--report rsqrt|fmm]
+//
+// Interactions are counted as N^2 body pairs per force evaluation, at 20 flops
+// each, whatever the force method, so approximate methods report the direct
+// sum rate they replace. Scaling efficiency compares interactions per second
+// per thread against the first thread count of the sweep: with --weak, N is
+// each size multiplied by the thread count instead of fixed (strong scaling).
+// Per-phase times come from System::profile and are zero when the library is
+// built without ENABLE_PROFILING. With --output, every K-th step is written
+// as a snapshot by a background writer with D buffers, and the time the step
+// loop spent waiting for a free buffer is reported as io_stall_ns. --compress
+// writes positions quantized to BITS bits per axis to one compressed stream
+// instead, delta coded in time or, with --sfc, along a space-filling curve.
+// --scenario picks the generated initial conditions (rotating_4, frisbee,
+// plummer, uniform_cube) and --seed their random draws; they are the same for
+// every thread count, so the cases of a sweep start from identical bodies.
+// --ic loads the bodies from a file instead and replaces the size sweep.
+// --sort reorders the bodies along a Morton curve every K steps (the warmup
+// included), and the snapshots then carry body IDs. A compressed stream has
+// no room for them, so --sort and --compress cannot be combined.
+// --block-levels gives every body its own power-of-two step, down to
+// timestep / 2^L; interactions still count N^2 pairs per step, the rate of
+// the shared step the block step replaces.
+// --checkpoint saves the full state of a single case to PATH every K timed
+// steps and once more at the end, from a background thread; a checkpoint
+// still being written when the next one is due makes that one skipped, not
+// waited for. --restart continues a run from such a file: like --ic it
+// replaces the size sweep, and the force method, rsqrt mode, sort interval
+// and block levels are those of the checkpoint. No warmup steps are taken, so the
+// first step is the one the saved run would have taken next.
+// --report prints a diagnostic table for the bodies of the first case before
+// the sweep (to stderr with --json): rsqrt compares the accuracy, force
+// time and energy drift over S steps of every rsqrt mode, fmm the error
+// against the exact direct sum and the force time of every FMM order (the
+// direct sum is O(N^2), so keep the first size small)
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef ENABLE_CUDA
+#include <tbb/global_control.h>
+#endif
+
+#include "system.hh"
+#include "snapshot_writer.hh"
+#include "checkpoint.hh"
+#include "diagnostics.hh"
+
+namespace {
+
+struct BenchOptions {
+	std::vector<int> sizes{4096, 16384, 65536};
+	std::vector<int> threads;
+	int steps{10};
+	int warmup{1};
+	float timestep{1.0f};
+	ForceMethod method{ForceMethod::DirectSum};
+	RsqrtMode rsqrt{RsqrtMode::Raw};
+	std::string scenario{DEFAULT_SCENARIO};
+	std::string ic;     // Initial condition file, empty to generate `scenario`
+	std::uint64_t seed{DEFAULT_SEED};
+	int sort{0};        // Steps between spatial sorts, 0 for none
+	int block_levels{0}; // Finest level of block timesteps, 0 for one shared step
+	bool weak{false};
+	bool json{false};
+	std::string output; // Snapshot prefix, empty for no output
+	int every{1};
+	int queue{2};
+	int compress{0};    // Bits per axis of a compressed stream, 0 for snapshots
+	bool sfc{false};
+	std::string checkpoint; // Checkpoint file, empty for none
+	int checkpoint_every{0}; // Steps between checkpoints, 0 for only the last
+	std::string restart;    // Checkpoint to continue from
+	std::vector<std::string> reports; // Diagnostics to print before the sweep
+};
+
+struct BenchResult {
+	int nbodies;
+	int threads;
+	double step_ns;      // Wall time per advance()
+	double interactions; // Pair interactions per second
+	double gflops;
+	double efficiency;   // Per-thread throughput relative to the first thread count
+	double phase_ns[STEP_PHASES]; // Wall time per step in each phase
+	double stall_ns;              // Wait for a free snapshot buffer per step
+};
+
+constexpr double FLOPS_PER_INTERACTION = 20.0;
+
+std::vector<int> parse_list(const std::string &arg) {
+	std::vector<int> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) values.push_back(std::atoi(item.c_str()));
+	}
+	return values;
+}
+
+bool parse_method(const std::string &name, ForceMethod &method) {
+	const std::pair<const char *, ForceMethod> names[] = {
+		{"direct", ForceMethod::DirectSum},
+		{"tiled", ForceMethod::DirectTiled},
+		{"symmetric", ForceMethod::DirectSymmetric},
+		{"bh", ForceMethod::BarnesHut},
+		{"pm", ForceMethod::ParticleMesh},
+		{"fmm", ForceMethod::FastMultipole},
+	};
+	for (const auto &[key, value] : names) {
+		if (name == key) {
+			method = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool parse_rsqrt(const std::string &name, RsqrtMode &mode) {
+	const std::pair<const char *, RsqrtMode> names[] = {
+		{"raw", RsqrtMode::Raw},
+		{"newton1", RsqrtMode::Newton1},
+		{"newton2", RsqrtMode::Newton2},
+		{"exact", RsqrtMode::Exact},
+	};
+	for (const auto &[key, value] : names) {
+		if (name == key) {
+			mode = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *method_name(ForceMethod method) {
+	switch (method) {
+	case ForceMethod::DirectSum: return "direct";
+	case ForceMethod::DirectTiled: return "tiled";
+	case ForceMethod::DirectSymmetric: return "symmetric";
+	case ForceMethod::BarnesHut: return "bh";
+	case ForceMethod::ParticleMesh: return "pm";
+	case ForceMethod::FastMultipole: return "fmm";
+	}
+	return "unknown";
+}
+
+// Lower-case phase name for column and key names
+std::string phase_key(StepPhase phase) {
+	std::string key = step_phase_name(phase);
+	std::transform(std::begin(key), std::end(key), std::begin(key),
+	               [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	return key;
+}
+
+bool parse_args(int argc, char *argv[], BenchOptions &opt) {
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool has_value = (i + 1 < argc);
+		if (arg == "--weak") {
+			opt.weak = true;
+		} else if (arg == "--json") {
+			opt.json = true;
+		} else if (arg == "--sfc") {
+			opt.sfc = true;
+		} else if (arg == "--sizes" && has_value) {
+			opt.sizes = parse_list(argv[++i]);
+		} else if (arg == "--threads" && has_value) {
+			opt.threads = parse_list(argv[++i]);
+		} else if (arg == "--steps" && has_value) {
+			opt.steps = std::atoi(argv[++i]);
+		} else if (arg == "--warmup" && has_value) {
+			opt.warmup = std::atoi(argv[++i]);
+		} else if (arg == "--dt" && has_value) {
+			opt.timestep = static_cast<float>(std::atof(argv[++i]));
+		} else if (arg == "--output" && has_value) {
+			opt.output = argv[++i];
+		} else if (arg == "--every" && has_value) {
+			opt.every = std::atoi(argv[++i]);
+		} else if (arg == "--queue" && has_value) {
+			opt.queue = std::atoi(argv[++i]);
+		} else if (arg == "--scenario" && has_value) {
+			opt.scenario = argv[++i];
+			if (!find_scenario(opt.scenario)) return false;
+		} else if (arg == "--ic" && has_value) {
+			opt.ic = argv[++i];
+		} else if (arg == "--seed" && has_value) {
+			opt.seed = std::strtoull(argv[++i], nullptr, 10);
+		} else if (arg == "--sort" && has_value) {
+			opt.sort = std::atoi(argv[++i]);
+		} else if (arg == "--block-levels" && has_value) {
+			opt.block_levels = std::atoi(argv[++i]);
+		} else if (arg == "--compress" && has_value) {
+			opt.compress = std::atoi(argv[++i]);
+		} else if (arg == "--method" && has_value) {
+			if (!parse_method(argv[++i], opt.method)) return false;
+		} else if (arg == "--rsqrt" && has_value) {
+			if (!parse_rsqrt(argv[++i], opt.rsqrt)) return false;
+		} else if (arg == "--checkpoint" && has_value) {
+			opt.checkpoint = argv[++i];
+		} else if (arg == "--checkpoint-every" && has_value) {
+			opt.checkpoint_every = std::atoi(argv[++i]);
+		} else if (arg == "--restart" && has_value) {
+			opt.restart = argv[++i];
+		} else if (arg == "--report" && has_value) {
+			opt.reports.push_back(argv[++i]);
+			if (opt.reports.back() != "rsqrt" && opt.reports.back() != "fmm") return false;
+		} else {
+			return false;
+		}
+	}
+	if (opt.threads.empty()) {
+		const int hw = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+		for (int t = 1; t < hw; t *= 2) opt.threads.push_back(t);
+		opt.threads.push_back(hw);
+	}
+	if (!opt.ic.empty() || !opt.restart.empty()) {
+		// One case per thread count, at the size of the file
+		if (opt.weak || (!opt.ic.empty() && !opt.restart.empty())) return false;
+		opt.sizes = {0};
+		if (!opt.restart.empty()) opt.warmup = 0;
+	}
+	// Cases of a sweep would overwrite each other's checkpoints
+	if (!opt.checkpoint.empty() && opt.sizes.size() * opt.threads.size() != 1) return false;
+	// A compressed stream holds no IDs to follow the bodies across sorts
+	if (opt.sort > 0 && opt.compress > 0) return false;
+	const int max_bits = opt.sfc ? STREAM_MAX_SFC_BITS : STREAM_MAX_BITS;
+	return !opt.sizes.empty() && opt.steps > 0 && opt.every > 0 && opt.queue > 0 &&
+	       opt.sort >= 0 && opt.block_levels >= 0 && opt.block_levels <= MAX_BLOCK_LEVEL &&
+	       opt.compress >= 0 && opt.compress <= max_bits &&
+	       opt.checkpoint_every >= 0;
+}
+
+// The bodies of a case with the settings of opt, null if they cannot be
+// set up. With --ic or a restart, nbodies is taken from the file
+std::unique_ptr<System> make_system(const BenchOptions &opt, const Checkpoint *restart,
+                                    int nbodies) {
+	auto system = std::make_unique<System>();
+	if (restart) {
+		if (!system->restore(*restart)) return nullptr;
+	} else if (!opt.ic.empty()) {
+		if (!system->load_initial_conditions(opt.ic)) return nullptr;
+	} else {
+		system->scenario = opt.scenario;
+		system->seed = opt.seed;
+		if (!system->setup(nbodies)) return nullptr;
+	}
+	system->force_method = opt.method;
+	system->rsqrt_mode = opt.rsqrt;
+	system->sort_interval = opt.sort;
+	system->block_timesteps = opt.block_levels > 0;
+	if (opt.block_levels > 0) system->max_level = opt.block_levels;
+	system->track_ids |= opt.sort > 0 && !opt.output.empty();
+	return system;
+}
+
+// Time `steps` calls to advance() after `warmup` untimed ones, including
+// writing out the last queued snapshot
+bool run_case(const BenchOptions &opt, const Checkpoint *restart, int nbodies, int threads,
+              BenchResult &res) {
+
+#ifndef ENABLE_CUDA
+	tbb::global_control limit(tbb::global_control::max_allowed_parallelism,
+	                          static_cast<std::size_t>(threads));
+#endif
+
+	const std::unique_ptr<System> system = make_system(opt, restart, nbodies);
+	if (!system) return false;
+	nbodies = system->num_bodies;
+
+	for (int i = 0; i < opt.warmup; i++) system->advance(opt.timestep);
+#ifdef ENABLE_PROFILING
+	system->profile.reset();
+#endif
+
+	std::unique_ptr<AsyncSnapshotWriter> writer;
+	if (!opt.output.empty()) {
+		const std::string prefix =
+			opt.output + "." + std::to_string(nbodies) + "." + std::to_string(threads);
+		if (opt.compress > 0) {
+			StreamSettings stream;
+			stream.bits = opt.compress;
+			stream.delta = opt.sfc ? StreamDelta::SpaceFillingCurve : StreamDelta::Temporal;
+			writer = std::make_unique<AsyncSnapshotWriter>(prefix, stream, opt.every,
+			                                               static_cast<std::size_t>(opt.queue));
+		} else {
+			writer = std::make_unique<AsyncSnapshotWriter>(prefix, opt.every,
+			                                               static_cast<std::size_t>(opt.queue));
+		}
+	}
+
+	std::unique_ptr<CheckpointWriter> checkpoints;
+	if (!opt.checkpoint.empty()) checkpoints = std::make_unique<CheckpointWriter>(opt.checkpoint);
+
+	const auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < opt.steps; i++) {
+		system->advance(opt.timestep);
+		if (writer) writer->submit(*system, i);
+		if (checkpoints && opt.checkpoint_every > 0 && (i + 1) % opt.checkpoint_every == 0) {
+			checkpoints->submit(*system);
+		}
+	}
+	if (writer) writer->flush();
+	const auto t1 = std::chrono::steady_clock::now();
 
-int main() {
+	// The final state, taken once the last periodic checkpoint is on disk
+	if (checkpoints && !(checkpoints->flush() && checkpoints->submit(*system) &&
+	                     checkpoints->flush())) {
+		std::cerr << "cannot write checkpoint " << opt.checkpoint << "\n";
+	}
 
-auto system = std::make_unique<System>();
+	const double seconds = std::chrono::duration<double>(t1 - t0).count();
+	const double pairs = static_cast<double>(nbodies) * nbodies * opt.steps;
+	res.nbodies = nbodies;
+	res.threads = threads;
+	res.step_ns = 1e9 * seconds / opt.steps;
+	res.interactions = pairs / seconds;
+	res.gflops = FLOPS_PER_INTERACTION * res.interactions * 1e-9;
+	res.efficiency = 1.0;
+	for (std::size_t p = 0; p < STEP_PHASES; p++) {
+#ifdef ENABLE_PROFILING
+		res.phase_ns[p] = 1e9 * system->profile.total.seconds[p] / opt.steps;
+#else
+		res.phase_ns[p] = 0.0;
+#endif
+	}
+	res.stall_ns = writer ? 1e9 * writer->stall_seconds() / opt.steps : 0.0;
+	return true;
+}
 
-system->setup(65536);
+void write_csv(const BenchOptions &opt, const std::vector<BenchResult> &results,
+               std::ostream &os) {
+	os << "method,simd,rsqrt,scaling,nbodies,threads,steps,ns_per_step,ns_per_body_step,"
+	      "interactions_per_s,gflops,efficiency";
+	for (std::size_t p = 0; p < STEP_PHASES; p++) {
+		os << "," << phase_key(static_cast<StepPhase>(p)) << "_ns";
+	}
+	os << ",io_stall_ns\n";
+	for (const BenchResult &r : results) {
+		os << method_name(opt.method) << ","
+		   << simd_level_name(detect_simd_level()) << ","
+		   << rsqrt_mode_name(opt.rsqrt) << ","
+		   << (opt.weak ? "weak" : "strong") << ","
+		   << r.nbodies << "," << r.threads << "," << opt.steps << ","
+		   << std::fixed << std::setprecision(0) << r.step_ns << ","
+		   << std::setprecision(3) << r.step_ns / r.nbodies << ","
+		   << std::scientific << r.interactions << ","
+		   << std::fixed << r.gflops << ","
+		   << r.efficiency << std::setprecision(0);
+		for (double ns : r.phase_ns) os << "," << ns;
+		os << "," << r.stall_ns << "\n" << std::defaultfloat;
+	}
+}
 
-for (int i = 0; i < 100; i++) {
-	system->advance(1.0f);
-	//system->write_points(i);
+void write_json(const BenchOptions &opt, const std::vector<BenchResult> &results,
+                std::ostream &os) {
+	os << "{\n"
+	   << "  \"method\": \"" << method_name(opt.method) << "\",\n"
+	   << "  \"simd\": \"" << simd_level_name(detect_simd_level()) << "\",\n"
+	   << "  \"rsqrt\": \"" << rsqrt_mode_name(opt.rsqrt) << "\",\n"
+	   << "  \"scaling\": \"" << (opt.weak ? "weak" : "strong") << "\",\n"
+	   << "  \"steps\": " << opt.steps << ",\n"
+	   << "  \"results\": [\n";
+	for (std::size_t i = 0; i < results.size(); i++) {
+		const BenchResult &r = results[i];
+		os << "    {\"nbodies\": " << r.nbodies
+		   << ", \"threads\": " << r.threads
+		   << ", \"ns_per_step\": " << std::fixed << std::setprecision(0) << r.step_ns
+		   << ", \"ns_per_body_step\": " << std::setprecision(3) << r.step_ns / r.nbodies
+		   << ", \"interactions_per_s\": " << std::scientific << r.interactions
+		   << ", \"gflops\": " << std::fixed << r.gflops
+		   << ", \"efficiency\": " << r.efficiency
+		   << ", \"phase_ns\": {" << std::setprecision(0);
+		for (std::size_t p = 0; p < STEP_PHASES; p++) {
+			os << (p ? ", " : "") << "\"" << phase_key(static_cast<StepPhase>(p)) << "\": "
+			   << r.phase_ns[p];
+		}
+		os << "}, \"io_stall_ns\": " << r.stall_ns << "}"
+		   << (i + 1 < results.size() ? ",\n" : "\n");
+		os << std::defaultfloat;
+	}
+	os << "  ]\n}\n";
 }
 
-}
\ No newline at end of file
+}; // namespace
+
+
+int main(int argc, char *argv[]) {
+
+	BenchOptions opt;
+	if (!parse_args(argc, argv, opt)) {
+		std::cerr << "usage: " << argv[0]
+		          << " [--sizes N,...] [--threads T,...] [--steps S] [--warmup W] [--dt DT]"
+		             " [--method direct|tiled|symmetric|bh|pm|fmm]"
+		             " [--rsqrt raw|newton1|newton2|exact] [--scenario NAME | --ic FILE]"
+		             " [--seed S] [--sort K] [--block-levels L] [--weak] [--json]"
+		             " [--output PREFIX [--every K] [--queue D] [--compress BITS [--sfc]]]"
+		             " [--checkpoint PATH [--checkpoint-every K]] [--restart PATH]"
+		             " [--report rsqrt|fmm]\n";
+		for (const Scenario &sc : scenarios()) {
+			std::cerr << "  " << sc.name << ": " << sc.description << "\n";
+		}
+		return EXIT_FAILURE;
+	}
+
+	// A restart continues with the settings of the saved run
+	std::unique_ptr<Checkpoint> restart;
+	if (!opt.restart.empty()) {
+		restart = std::make_unique<Checkpoint>();
+		if (!read_checkpoint(opt.restart, *restart)) {
+			std::cerr << "cannot read checkpoint " << opt.restart << "\n";
+			return EXIT_FAILURE;
+		}
+		opt.method = static_cast<ForceMethod>(restart->settings.force_method);
+		opt.rsqrt = static_cast<RsqrtMode>(restart->settings.rsqrt_mode);
+		opt.sort = restart->settings.sort_interval;
+		opt.block_levels = restart->settings.block_timesteps ? restart->settings.max_level : 0;
+		if (opt.sort > 0 && opt.compress > 0) {
+			std::cerr << "checkpoint " << opt.restart << " sorts the bodies, which --compress cannot follow\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!opt.reports.empty()) {
+		const std::unique_ptr<System> system = make_system(opt, restart.get(), opt.sizes.front());
+		if (!system) {
+			std::cerr << "cannot set up the bodies of the report\n";
+			return EXIT_FAILURE;
+		}
+		std::ostream &os = opt.json ? std::cerr : std::cout;
+		for (const std::string &report : opt.reports) {
+			if (report == "rsqrt") report_rsqrt_modes(*system, opt.steps, opt.timestep, os);
+			if (report == "fmm") report_fmm_orders(*system, FMM_MAX_ORDER, os);
+		}
+	}
+
+	std::vector<BenchResult> results;
+	for (int size : opt.sizes) {
+		double baseline = 0.0; // Interactions per second per thread at the first thread count
+		for (int threads : opt.threads) {
+			const int nbodies = opt.weak ? size * threads : size;
+			BenchResult res;
+			if (!run_case(opt, restart.get(), nbodies, threads, res)) {
+				if (restart) {
+					std::cerr << "cannot restore " << opt.restart << "\n";
+					return EXIT_FAILURE;
+				}
+				if (!opt.ic.empty()) {
+					std::cerr << "cannot load " << opt.ic << "\n";
+					return EXIT_FAILURE;
+				}
+				std::cerr << "skipping N = " << nbodies << ": too few bodies for "
+				          << opt.scenario << "\n";
+				continue;
+			}
+			const double per_thread = res.interactions / threads;
+			if (baseline == 0.0) baseline = per_thread;
+			res.efficiency = per_thread / baseline;
+			results.push_back(res);
+		}
+	}
+
+	if (opt.json) {
+		write_json(opt, results, std::cout);
+	} else {
+		write_csv(opt, results, std::cout);
+	}
+	return EXIT_SUCCESS;
+}
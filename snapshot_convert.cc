@@ -0,0 +1,69 @@
+
+// Converts binary snapshots (System::write_snapshot) and compressed streams
+// (SnapshotStreamWriter) to the .3D point format
+//
+//   nbody_convert snapshot.bin [more.bin ...]
+//
+// each input is written next to itself with its extension replaced by .3D;
+// frame F of a stream goes to <name>.F.3D
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "snapshot.hh"
+#include "snapshot_stream.hh"
+
+namespace {
+// Number of frames written, or -1 if the stream cannot be opened
+int stream_to_text(const std::filesystem::path &in) {
+	SnapshotStreamReader reader;
+	if (!reader.open(in.string())) return -1;
+	StreamFrame frame;
+	int frames = 0;
+	for (; reader.next(frame); frames++) {
+		std::string extension = ".";
+		extension += std::to_string(frames);
+		extension += ".3D";
+		std::filesystem::path out = in;
+		out.replace_extension(extension);
+		std::ofstream outfile(out);
+		write_text_points(outfile, frame.x.data(), frame.y.data(), frame.z.data(), frame.x.size());
+		if (!outfile) return -1;
+	}
+	return frames;
+}
+}; // namespace
+
+int main(int argc, char *argv[]) {
+
+	if (argc < 2) {
+		std::cerr << "usage: " << argv[0] << " snapshot [snapshot ...]\n";
+		return EXIT_FAILURE;
+	}
+
+	int status = EXIT_SUCCESS;
+	for (int i = 1; i < argc; i++) {
+		const std::filesystem::path in = argv[i];
+		if (is_snapshot_stream(in.string())) {
+			const int frames = stream_to_text(in);
+			if (frames >= 0) {
+				std::cout << in.string() << " -> " << frames << " frames\n";
+			} else {
+				std::cerr << "failed to convert " << in.string() << "\n";
+				status = EXIT_FAILURE;
+			}
+			continue;
+		}
+		const std::filesystem::path out = std::filesystem::path(in).replace_extension(".3D");
+		if (snapshot_to_text(in.string(), out.string())) {
+			std::cout << in.string() << " -> " << out.string() << "\n";
+		} else {
+			std::cerr << "failed to convert " << in.string() << "\n";
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
@@ -19,6 +19,7 @@
 #include <SDL3/SDL_opengl.h>
 #endif
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -31,6 +32,9 @@
 #include "../libs/emscripten/emscripten_mainloop_stub.h"
 #endif
 
+// Largest particle count accepted by the input box
+constexpr int MAX_BODIES = 1 << 24;
+
 class AppState {
 public:
   AppState();
@@ -248,12 +252,66 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
   // Get input from user
   static int NBODS = 32768;
+  static int SEED = static_cast<int>(DEFAULT_SEED);
+  static int SCENARIO = 0;
+  static char IC_FILE[256] = "";
   static float DTIME = 10.0f;
+  static int METHOD = static_cast<int>(ForceMethod::DirectSum);
+  static float THETA = 0.5f;
+  static int PMGRID = 64;
+  static int FMMORDER = 6;
+  static int FMMLEAF = 128;
+  static int RSQRT = static_cast<int>(RsqrtMode::Raw);
+  static bool BLOCK = false;
+  static int MAXLEVEL = 6;
+  static int SORT = 0;
+  static bool HWCOUNTERS = false;
+  bool RESET_PROFILE = false;
   static Color::ColorType COLOR;
   {
     ImGui::Begin("INPUTS");
+    // Any count works; the system pads its last SIMD chunk itself
     ImGui::InputInt("Number of particles", &NBODS);
+    NBODS = std::clamp(NBODS, MIN_BODIES, MAX_BODIES);
+    // Same seed, same initial bodies
+    ImGui::InputInt("Seed", &SEED);
+    const std::vector<Scenario> &scenario_list = scenarios();
+    if (ImGui::BeginCombo("Scenario", scenario_list[SCENARIO].name.c_str())) {
+      for (int i = 0; i < static_cast<int>(scenario_list.size()); i++) {
+        if (ImGui::Selectable(scenario_list[i].name.c_str(), i == SCENARIO)) SCENARIO = i;
+        if (ImGui::IsItemHovered()) ImGui::SetTooltip("%s", scenario_list[i].description.c_str());
+      }
+      ImGui::EndCombo();
+    }
+    // Loaded instead of the scenario when set (.csv, snapshot, or binary)
+    ImGui::InputText("Initial condition file", IC_FILE, IM_ARRAYSIZE(IC_FILE));
     ImGui::InputFloat("Timestep", &DTIME);
+    // Falls back to glBufferSubData when the GL has no buffer storage
+    ImGui::Checkbox("Persistent mapped buffers", &app->renderer->persistent_mapping);
+
+    const char *methods[] = {"Direct sum", "Direct sum (tiled)", "Direct sum (symmetric)", "Barnes-Hut",
+                             "Particle-mesh", "Fast multipole"};
+    ImGui::Combo("Force method", &METHOD, methods, IM_ARRAYSIZE(methods));
+    if (METHOD == static_cast<int>(ForceMethod::BarnesHut)) {
+      ImGui::SliderFloat("Opening angle", &THETA, 0.1f, 1.5f);
+    }
+    if (METHOD == static_cast<int>(ForceMethod::ParticleMesh)) {
+      const char *grids[] = {"16", "32", "64", "128"};
+      static int GRID_IDX = 2;
+      ImGui::Combo("Mesh cells per axis", &GRID_IDX, grids, IM_ARRAYSIZE(grids));
+      PMGRID = 16 << GRID_IDX;
+    }
+    if (METHOD == static_cast<int>(ForceMethod::FastMultipole)) {
+      ImGui::SliderInt("Expansion order", &FMMORDER, 1, FMM_MAX_ORDER);
+      ImGui::SliderInt("Leaf size", &FMMLEAF, 8, 256);
+    }
+    const char *rsqrt_modes[] = {"Raw", "Newton x1", "Newton x2", "Exact"};
+    ImGui::Combo("Reciprocal sqrt", &RSQRT, rsqrt_modes, IM_ARRAYSIZE(rsqrt_modes));
+    ImGui::Checkbox("Block timesteps", &BLOCK);
+    if (BLOCK) {
+      ImGui::SliderInt("Max level", &MAXLEVEL, 0, 10);
+    }
+    ImGui::SliderInt("Sort bodies every", &SORT, 0, 100, SORT ? "%d steps" : "never");
 
     ImGui::SeparatorText("CONTROLS");
     if (ImGui::Button("INITIALIZE")) {
@@ -268,11 +326,10 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
     }
     ImGui::SameLine();
 
-    //if (ImGui::Button("PAUSE")) {
-    //  app->pause_state = true;
-    //  //app->renderer->simulator->sim_change_pause_state(app->pause_state);
-    //}
-    //ImGui::SameLine();
+    if (ImGui::Button("PAUSE")) {
+      app->pause_state = true;
+    }
+    ImGui::SameLine();
 
     //if (ImGui::Button("RESET")) {
     //  if (app->sim_initialized) {
@@ -296,9 +353,80 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
 
     ImGui::ColorEdit3("Clear color", (float*)&app->clear_color);
+    // Bodies are colored by speed, log scaled between its 1st and 99th percentile
+    const char *colormaps[] = {"Magma", "Blue-orange", "Viridis", "Plasma", "Rainbow"};
+    int colormap = static_cast<int>(COLOR);
+    if (ImGui::Combo("Colormap", &colormap, colormaps, IM_ARRAYSIZE(colormaps))) {
+      COLOR = static_cast<Color::ColorType>(colormap);
+      app->change_color = true;
+    }
+    // Draws a subset of the bodies sized to the camera distance
+    ImGui::Checkbox("Level of detail", &app->renderer->lod);
+    if (app->renderer->lod) {
+      ImGui::InputInt("Vertex budget", &app->renderer->lod_budget, 1 << 16, 1 << 20);
+      app->renderer->lod_budget = std::max(app->renderer->lod_budget, 1);
+    }
+    // Uploads only the bodies of the grid cells in view
+    ImGui::Checkbox("Frustum culling", &app->renderer->culling);
 
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
                 1000.0f / io.Framerate, io.Framerate);
+    ImGui::Text("Force kernels: %s",
+                simd_level_name(app->renderer->simulator->simd_level));
+    if (app->sim_initialized) {
+      // Runs on its own thread, independent of the frame rate
+      ImGui::Text("Simulation: step %llu, %.1f steps/s",
+                  static_cast<unsigned long long>(app->renderer->sim_thread->steps()),
+                  app->renderer->sim_thread->steps_per_second());
+      ImGui::Text("Vertex upload: %s", app->renderer->uses_persistent_mapping()
+                                           ? "persistent mapped ring" : "glBufferSubData");
+      ImGui::Text("Drawing %zu bodies (1 in %d)", app->renderer->drawn_bodies(),
+                  1 << app->renderer->lod_level());
+    }
+
+#ifdef ENABLE_PROFILING
+    if (app->sim_initialized && ImGui::CollapsingHeader("PROFILE")) {
+      const StepProfile profile = app->renderer->sim_thread->profile();
+      const StepStats &last = profile.last;
+      const StepStats &total = profile.total;
+      const double steps = static_cast<double>(std::max<std::uint64_t>(total.steps, 1));
+      if (ImGui::BeginTable("phases", 3)) {
+        ImGui::TableSetupColumn("Phase");
+        ImGui::TableSetupColumn("Last ms");
+        ImGui::TableSetupColumn("Mean ms");
+        ImGui::TableHeadersRow();
+        for (std::size_t p = 0; p < STEP_PHASES; p++) {
+          ImGui::TableNextRow();
+          ImGui::TableNextColumn();
+          ImGui::TextUnformatted(step_phase_name(static_cast<StepPhase>(p)));
+          ImGui::TableNextColumn();
+          ImGui::Text("%.3f", 1e3 * last.seconds[p]);
+          ImGui::TableNextColumn();
+          ImGui::Text("%.3f", 1e3 * total.seconds[p] / steps);
+        }
+        ImGui::EndTable();
+      }
+      const double force_s = last.seconds[static_cast<std::size_t>(StepPhase::Forces)];
+      ImGui::Text("Pair interactions: %.3e (%.2f G/s)",
+                  static_cast<double>(last.pair_interactions),
+                  force_s > 0.0 ? 1e-9 * last.pair_interactions / force_s : 0.0);
+      ImGui::Text("Cell interactions: %.3e", static_cast<double>(last.cell_interactions));
+      ImGui::Checkbox("Hardware counters", &HWCOUNTERS);
+      if (HWCOUNTERS) {
+        if (profile.hw_available) {
+          ImGui::Text("Cycles %.3e  IPC %.2f  LLC misses %.3e",
+                      static_cast<double>(last.hw.cycles),
+                      last.hw.cycles ? static_cast<double>(last.hw.instructions) / last.hw.cycles : 0.0,
+                      static_cast<double>(last.hw.cache_misses));
+        } else {
+          ImGui::TextUnformatted("perf_event_open unavailable");
+        }
+      }
+      if (ImGui::Button("Reset profile")) {
+        RESET_PROFILE = true;
+      }
+    }
+#endif
 
     ImGui::End();
   }
@@ -320,20 +448,40 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
 
   // Initialize renderer, simulation, camera
   if (app->execute_sim_init && !app->sim_initialized) {
-    app->renderer->init(NBODS);
-    app->sim_initialized = true;
+    app->renderer->simulator->seed = static_cast<std::uint32_t>(SEED);
+    app->renderer->simulator->scenario = scenarios()[SCENARIO].name;
+    app->sim_initialized = app->renderer->init(NBODS, IC_FILE);
+    app->execute_sim_init = app->sim_initialized;
   }
 
   // Change color palette if user changes
- // if (app->sim_initialized && app->change_color) {
- //   app->renderer->change_color(COLOR);
- //   app->change_color = false;
- // }
+  if (app->sim_initialized && app->change_color) {
+    app->renderer->change_color(COLOR);
+    app->change_color = false;
+  }
 
   if (app->sim_initialized) {
 
-    // Run simulation and update data buffers
-    app->renderer->update(DTIME);
+    // Hand the settings to the simulation thread, applied at its next step
+    SimSettings settings;
+    settings.paused = app->pause_state;
+    settings.timestep = DTIME;
+    settings.force_method = static_cast<ForceMethod>(METHOD);
+    settings.opening_angle = THETA;
+    settings.pm_grid = PMGRID;
+    settings.fmm_order = FMMORDER;
+    settings.fmm_leaf_size = FMMLEAF;
+    settings.rsqrt_mode = static_cast<RsqrtMode>(RSQRT);
+    settings.block_timesteps = BLOCK;
+    settings.max_level = MAXLEVEL;
+    settings.sort_interval = SORT;
+    settings.hw_counters = HWCOUNTERS;
+    settings.reset_profile = RESET_PROFILE;
+    settings.cull_grid = app->renderer->culling;
+    app->renderer->sim_thread->configure(settings);
+
+    // Upload the newest completed step, if any
+    app->renderer->update();
 
     // Display simulation data
     float aspect_ratio = static_cast<float>(w) / static_cast<float>(h);
@@ -0,0 +1,124 @@
+
+#include "cull_grid.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <limits>
+#include <numeric>
+
+namespace {
+// Bodies a task bins and scatters
+constexpr std::size_t BLOCK = std::size_t{1} << 16;
+
+struct Moments {
+  double sum[3]{};
+  double sum_sq[3]{};
+  float lo[3]{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+              std::numeric_limits<float>::max()};
+  float hi[3]{std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(),
+              std::numeric_limits<float>::lowest()};
+};
+}; // namespace
+
+// A stable counting sort by cell: each block of bodies counts its cells,
+// a scan over cells then blocks turns the counts into offsets, and each
+// block scatters its bodies from there
+void CullGrid::build(const std::vector<float> &positions, std::size_t stride, std::size_t n) {
+
+  const float *axis[3] = {positions.data(), positions.data() + stride,
+                          positions.data() + 2 * stride};
+  const std::size_t num_blocks = (n + BLOCK - 1) / BLOCK;
+  this->blocks.resize(num_blocks);
+  std::iota(std::begin(this->blocks), std::end(this->blocks), 0);
+
+  // Extent of the grid
+  std::vector<Moments> moments(num_blocks);
+  std::for_each(std::execution::par, std::begin(this->blocks), std::end(this->blocks),
+                [&](std::size_t b) {
+    Moments &m = moments[b];
+    for (std::size_t i = b * BLOCK; i < std::min(n, (b + 1) * BLOCK); i++) {
+      for (std::size_t a = 0; a < 3; a++) {
+        const float x = axis[a][i];
+        m.sum[a] += x;
+        m.sum_sq[a] += static_cast<double>(x) * x;
+        m.lo[a] = std::min(m.lo[a], x);
+        m.hi[a] = std::max(m.hi[a], x);
+      }
+    }
+  });
+  float origin[3];
+  float scale[3];
+  float width[3];
+  float lowest[3];
+  float highest[3];
+  for (std::size_t a = 0; a < 3; a++) {
+    Moments total;
+    for (const Moments &m : moments) {
+      total.sum[a] += m.sum[a];
+      total.sum_sq[a] += m.sum_sq[a];
+      total.lo[a] = std::min(total.lo[a], m.lo[a]);
+      total.hi[a] = std::max(total.hi[a], m.hi[a]);
+    }
+    const double mean = total.sum[a] / std::max<std::size_t>(n, 1);
+    const double sigma = std::sqrt(std::max(total.sum_sq[a] / std::max<std::size_t>(n, 1) - mean * mean, 0.0));
+    const double lo = std::max<double>(total.lo[a], mean - 3 * sigma);
+    const double hi = std::min<double>(total.hi[a], mean + 3 * sigma);
+    origin[a] = static_cast<float>(lo);
+    scale[a] = hi > lo ? static_cast<float>(CELLS / (hi - lo)) : 0.0f;
+    width[a] = static_cast<float>((hi - lo) / CELLS);
+    lowest[a] = total.lo[a];
+    highest[a] = total.hi[a];
+  }
+
+  // Cell of each body, counted per block
+  this->cell.resize(n);
+  this->offsets.assign(num_blocks * NUM_CELLS, 0);
+  std::for_each(std::execution::par, std::begin(this->blocks), std::end(this->blocks),
+                [&](std::size_t b) {
+    std::uint32_t *count = this->offsets.data() + b * NUM_CELLS;
+    for (std::size_t i = b * BLOCK; i < std::min(n, (b + 1) * BLOCK); i++) {
+      std::size_t c = 0;
+      for (std::size_t a = 3; a-- > 0;) {
+        const float f = std::clamp((axis[a][i] - origin[a]) * scale[a], 0.0f, static_cast<float>(CELLS - 1));
+        c = c * CELLS + static_cast<unsigned>(f);
+      }
+      this->cell[i] = static_cast<std::uint16_t>(c);
+      count[c]++;
+    }
+  });
+
+  this->start.resize(NUM_CELLS + 1);
+  std::uint32_t first = 0;
+  for (std::size_t c = 0; c < NUM_CELLS; c++) {
+    this->start[c] = first;
+    for (std::size_t b = 0; b < num_blocks; b++) {
+      const std::uint32_t count = this->offsets[b * NUM_CELLS + c];
+      this->offsets[b * NUM_CELLS + c] = first;
+      first += count;
+    }
+  }
+  this->start[NUM_CELLS] = first;
+
+  this->order.resize(n);
+  std::for_each(std::execution::par, std::begin(this->blocks), std::end(this->blocks),
+                [&](std::size_t b) {
+    std::uint32_t *offset = this->offsets.data() + b * NUM_CELLS;
+    for (std::size_t i = b * BLOCK; i < std::min(n, (b + 1) * BLOCK); i++) {
+      this->order[offset[this->cell[i]]++] = static_cast<std::uint32_t>(i);
+    }
+  });
+
+  // Bounds of the cells as laid out, but for the border cells, which reach
+  // out to the outliers clamped into them
+  this->bounds.resize(6 * NUM_CELLS);
+  for (std::size_t c = 0; c < NUM_CELLS; c++) {
+    float *box = this->bounds.data() + 6 * c;
+    std::size_t k = c;
+    for (std::size_t a = 0; a < 3; a++, k /= CELLS) {
+      const std::size_t ka = k % CELLS;
+      box[a] = ka == 0 ? lowest[a] : origin[a] + width[a] * ka;
+      box[3 + a] = ka == CELLS - 1 ? highest[a] : origin[a] + width[a] * (ka + 1);
+    }
+  }
+}
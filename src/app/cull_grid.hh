@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over a frame of positions, for culling on the render thread
+// bodies are bucketed into CELLS^3 cells spanning the bulk of them (mean
+// +- 3 sigma on each axis, with outliers clamped into the border cells).
+// Every cell keeps the indices of its bodies, ascending, and bounds that
+// contain them all, so a cell outside the view holds no body to draw
+class CullGrid {
+public:
+  static constexpr std::size_t CELLS = 16; // Per axis
+  static constexpr std::size_t NUM_CELLS = CELLS * CELLS * CELLS;
+  // positions as SimulationThread publishes them, x, y and z streams of
+  // stride floats; n bodies
+  void build(const std::vector<float> &positions, std::size_t stride, std::size_t n);
+  void clear() { this->start.clear(); }
+  bool empty() const { return this->start.empty(); }
+  std::vector<std::uint32_t> order; // Body indices grouped by cell
+  std::vector<std::uint32_t> start; // Cell c holds order[start[c]] up to order[start[c + 1]]
+  std::vector<float> bounds; // Per cell: min x, y, z, then max x, y, z
+private:
+  std::vector<std::uint16_t> cell; // Of each body
+  std::vector<std::uint32_t> offsets; // Per block and cell
+  std::vector<std::size_t> blocks;
+};
@@ -0,0 +1,493 @@
+
+// Headless movie renderer: runs the simulation with no window or UI, draws
+// every frame with Renderer from a scripted camera path into an offscreen
+// framebuffer of an EGL context (surfaceless on Mesa, no X server needed)
+// and streams the frames out as raw RGB24, top row first
+//
+//   nbody_render --output FILE|-|"|COMMAND" [--frames F] [--steps-per-frame K]
+//                [--dt DT] [--size WxH] [--bodies N] [--scenario NAME | --ic FILE]
+//                [--seed S] [--method direct|tiled|symmetric|bh|pm|fmm]
+//                [--camera PATH] [--colormap magma|blue_orange|viridis|plasma|rainbow]
+//                [--lod BUDGET] [--cull] [--no-mapping]
+//
+// Frame f shows the bodies after f * K steps. The simulation thread takes
+// the steps of the next frame while this one is drawn and read back, and
+// the readback goes through a ring of pixel pack buffers, mapped only
+// frames later, so neither waits on the other. --output - writes to stdout
+// and "|COMMAND" to the standard input of COMMAND, for example
+//
+//   nbody_render --size 1920x1080 --output "|ffmpeg -f rawvideo -pix_fmt rgb24
+//                -s 1920x1080 -r 30 -i - movie.mp4"
+//
+// --camera reads keyframes, one per line: frame, then the eye and the
+// point looked at (x y z each); the camera moves linearly between them and
+// holds before the first and after the last. Blank lines and lines starting
+// with # are skipped. Without it the camera orbits the origin once over
+// the movie, from where the interactive app starts. --no-mapping uploads
+// every frame with glBufferSubData, as on a GL without buffer storage
+
+#define GL_GLEXT_PROTOTYPES 1
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "renderer.hh"
+#include "camera.hh"
+#include "system.hh"
+
+namespace {
+
+constexpr std::size_t PBO_FRAMES = 3;
+constexpr float ORBIT_DISTANCE = 2000000.0f; // The app's initial camera distance
+
+struct RenderOptions {
+  std::string output;
+  int frames{300};
+  int steps_per_frame{1};
+  float timestep{10.0f};
+  int width{1280};
+  int height{720};
+  int bodies{65536};
+  std::string scenario{DEFAULT_SCENARIO};
+  std::string ic;
+  std::uint64_t seed{DEFAULT_SEED};
+  ForceMethod method{ForceMethod::BarnesHut};
+  std::string camera;
+  Color::ColorType colormap{Color::Magma};
+  int lod_budget{0}; // 0 for every body
+  bool cull{false};
+  bool mapping{true}; // Persistently mapped vertex ring, where supported
+};
+
+struct Keyframe {
+  int frame;
+  glm::vec3 eye;
+  glm::vec3 target;
+};
+
+bool parse_method(const std::string &name, ForceMethod &method) {
+  const std::pair<const char *, ForceMethod> names[] = {
+    {"direct", ForceMethod::DirectSum},
+    {"tiled", ForceMethod::DirectTiled},
+    {"symmetric", ForceMethod::DirectSymmetric},
+    {"bh", ForceMethod::BarnesHut},
+    {"pm", ForceMethod::ParticleMesh},
+    {"fmm", ForceMethod::FastMultipole},
+  };
+  for (const auto &[key, value] : names) {
+    if (name == key) {
+      method = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_colormap(const std::string &name, Color::ColorType &color) {
+  const std::pair<const char *, Color::ColorType> names[] = {
+    {"magma", Color::Magma},
+    {"blue_orange", Color::BlueOrange},
+    {"viridis", Color::Viridis},
+    {"plasma", Color::Plasma},
+    {"rainbow", Color::Rainbow},
+  };
+  for (const auto &[key, value] : names) {
+    if (name == key) {
+      color = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_args(int argc, char *argv[], RenderOptions &opt) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = (i + 1 < argc);
+    if (arg == "--cull") {
+      opt.cull = true;
+    } else if (arg == "--no-mapping") {
+      opt.mapping = false;
+    } else if (arg == "--output" && has_value) {
+      opt.output = argv[++i];
+    } else if (arg == "--frames" && has_value) {
+      opt.frames = std::atoi(argv[++i]);
+    } else if (arg == "--steps-per-frame" && has_value) {
+      opt.steps_per_frame = std::atoi(argv[++i]);
+    } else if (arg == "--dt" && has_value) {
+      opt.timestep = static_cast<float>(std::atof(argv[++i]));
+    } else if (arg == "--size" && has_value) {
+      if (std::sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2) return false;
+    } else if (arg == "--bodies" && has_value) {
+      opt.bodies = std::atoi(argv[++i]);
+    } else if (arg == "--scenario" && has_value) {
+      opt.scenario = argv[++i];
+      if (!find_scenario(opt.scenario)) return false;
+    } else if (arg == "--ic" && has_value) {
+      opt.ic = argv[++i];
+    } else if (arg == "--seed" && has_value) {
+      opt.seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--method" && has_value) {
+      if (!parse_method(argv[++i], opt.method)) return false;
+    } else if (arg == "--camera" && has_value) {
+      opt.camera = argv[++i];
+    } else if (arg == "--colormap" && has_value) {
+      if (!parse_colormap(argv[++i], opt.colormap)) return false;
+    } else if (arg == "--lod" && has_value) {
+      opt.lod_budget = std::atoi(argv[++i]);
+    } else {
+      return false;
+    }
+  }
+  return !opt.output.empty() && opt.frames > 0 && opt.steps_per_frame > 0 &&
+         opt.width > 0 && opt.height > 0 && opt.lod_budget >= 0;
+}
+
+bool read_keyframes(const std::string &path, std::vector<Keyframe> &keys) {
+  std::ifstream file(path);
+  if (!file.is_open()) return false;
+  std::string line;
+  while (std::getline(file, line)) {
+    const std::size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') continue;
+    std::istringstream fields(line);
+    Keyframe key;
+    if (!(fields >> key.frame >> key.eye.x >> key.eye.y >> key.eye.z >>
+          key.target.x >> key.target.y >> key.target.z)) {
+      return false;
+    }
+    keys.push_back(key);
+  }
+  std::stable_sort(keys.begin(), keys.end(),
+                   [](const Keyframe &a, const Keyframe &b) { return a.frame < b.frame; });
+  return !keys.empty();
+}
+
+Camera camera_at(const std::vector<Keyframe> &keys, int frame, int frames) {
+  const glm::vec3 up(0.0f, 1.0f, 0.0f);
+  if (keys.empty()) {
+    const float angle = 2.0f * static_cast<float>(M_PI) * frame / frames;
+    const glm::vec3 eye(ORBIT_DISTANCE * std::sin(angle), 0.0f, -ORBIT_DISTANCE * std::cos(angle));
+    return Camera(eye, glm::vec3(0.0f), up);
+  }
+  const auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                     [](int f, const Keyframe &k) { return f < k.frame; });
+  if (next == keys.begin()) return Camera(keys.front().eye, keys.front().target, up);
+  if (next == keys.end()) return Camera(keys.back().eye, keys.back().target, up);
+  const Keyframe &a = *(next - 1);
+  const Keyframe &b = *next;
+  const float t = static_cast<float>(frame - a.frame) / (b.frame - a.frame);
+  return Camera(glm::mix(a.eye, b.eye, t), glm::mix(a.target, b.target, t), up);
+}
+
+// Raw frames to a file, stdout or a command
+class FrameSink {
+public:
+  explicit FrameSink(const std::string &output) {
+    if (output == "-") {
+      this->file = stdout;
+    } else if (output.front() == '|') {
+      this->file = ::popen(output.c_str() + 1, "w");
+      this->piped = true;
+    } else {
+      this->file = std::fopen(output.c_str(), "wb");
+    }
+  }
+  FrameSink(const FrameSink &) = delete;
+  FrameSink &operator=(const FrameSink &) = delete;
+  ~FrameSink() { close(); }
+  bool is_open() const { return this->file != nullptr; }
+  // GL rows are bottom-up, written out top row first
+  bool write(const unsigned char *pixels, int width, int height) {
+    const std::size_t row = 3 * static_cast<std::size_t>(width);
+    for (int y = height - 1; y >= 0; y--) {
+      if (std::fwrite(pixels + y * row, 1, row, this->file) != row) return false;
+    }
+    return true;
+  }
+  bool close() {
+    if (!this->file) return true;
+    bool ok = std::fflush(this->file) == 0;
+    if (this->piped) {
+      ok = ::pclose(this->file) == 0 && ok;
+    } else if (this->file != stdout) {
+      ok = std::fclose(this->file) == 0 && ok;
+    }
+    this->file = nullptr;
+    return ok;
+  }
+private:
+  FILE *file{nullptr};
+  bool piped{false};
+};
+
+// Offscreen framebuffer of color and depth renderbuffers
+class Framebuffer {
+public:
+  Framebuffer(int width, int height) {
+    glGenRenderbuffers(2, this->renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, this->renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, this->renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &this->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
+                              this->renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER,
+                              this->renderbuffers[1]);
+    this->complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  }
+  void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, this->fbo); }
+  Framebuffer(const Framebuffer &) = delete;
+  Framebuffer &operator=(const Framebuffer &) = delete;
+  ~Framebuffer() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &this->fbo);
+    glDeleteRenderbuffers(2, this->renderbuffers);
+  }
+  bool complete{false};
+private:
+  GLuint fbo{0};
+  GLuint renderbuffers[2]{};
+};
+
+// Frames read back through a ring of pixel pack buffers
+// glReadPixels into a bound pack buffer returns before the copy is done; a
+// buffer is mapped PBO_FRAMES - 1 frames later, behind a fence, by which
+// time the copy has long finished
+class Readback {
+public:
+  Readback(int width, int height) : width(width), height(height) {
+    glGenBuffers(PBO_FRAMES, this->pbos);
+    for (GLuint pbo : this->pbos) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+      glBufferData(GL_PIXEL_PACK_BUFFER, bytes(), nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+  Readback(const Readback &) = delete;
+  Readback &operator=(const Readback &) = delete;
+  ~Readback() {
+    for (GLsync &fence : this->fences) {
+      if (fence) glDeleteSync(fence);
+    }
+    glDeleteBuffers(PBO_FRAMES, this->pbos);
+  }
+  // Starts reading the bound framebuffer, after writing out the frame
+  // whose buffer it is about to reuse
+  bool capture(FrameSink &sink) {
+    const std::size_t slot = this->captured % PBO_FRAMES;
+    if (this->captured >= PBO_FRAMES && !write_out(slot, sink)) return false;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, this->width, this->height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    this->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    this->captured++;
+    return true;
+  }
+  // Writes out the frames still in flight, oldest first
+  bool flush(FrameSink &sink) {
+    const std::size_t pending = std::min(this->captured, PBO_FRAMES);
+    for (std::size_t k = this->captured - pending; k < this->captured; k++) {
+      if (!write_out(k % PBO_FRAMES, sink)) return false;
+    }
+    return true;
+  }
+private:
+  GLsizeiptr bytes() const { return static_cast<GLsizeiptr>(3) * this->width * this->height; }
+  bool write_out(std::size_t slot, FrameSink &sink) {
+    GLsync &fence = this->fences[slot];
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[slot]);
+    const auto *pixels = static_cast<const unsigned char *>(
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes(), GL_MAP_READ_BIT));
+    const bool ok = pixels && sink.write(pixels, this->width, this->height);
+    if (pixels) glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return ok;
+  }
+  int width;
+  int height;
+  GLuint pbos[PBO_FRAMES]{};
+  GLsync fences[PBO_FRAMES]{};
+  std::size_t captured{0};
+};
+
+// OpenGL 3.3 core context with no surface, drawing only into framebuffer
+// objects; the surfaceless platform when the EGL has it, which needs no
+// display server at all
+class HeadlessContext {
+public:
+  HeadlessContext() {
+    auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (get_platform_display) {
+      this->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if (this->display == EGL_NO_DISPLAY) this->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (this->display == EGL_NO_DISPLAY || !eglInitialize(this->display, &major, &minor)) {
+      this->display = EGL_NO_DISPLAY;
+      return;
+    }
+    // Surfaceless Mesa offers no configs at all, and takes none
+    // (EGL_KHR_no_config_context); nothing is drawn to a surface anyway
+    const EGLint config_attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    EGLint configs = 0;
+    if (!eglBindAPI(EGL_OPENGL_API)) return;
+    if (!eglChooseConfig(this->display, config_attribs, &config, 1, &configs) || configs == 0) {
+      config = EGL_NO_CONFIG_KHR;
+    }
+    const EGLint context_attribs[] = {
+      EGL_CONTEXT_MAJOR_VERSION, 3,
+      EGL_CONTEXT_MINOR_VERSION, 3,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_NONE,
+    };
+    this->context = eglCreateContext(this->display, config, EGL_NO_CONTEXT, context_attribs);
+    if (this->context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, this->context)) {
+      return;
+    }
+    // GLEW built for GLX loads the GL entry points, then fails to find an X
+    // display for its GLX ones, which are not needed here
+    glewExperimental = GL_TRUE;
+    const GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    this->ready = err == GLEW_OK || err == GLEW_ERROR_NO_GLX_DISPLAY;
+#else
+    this->ready = err == GLEW_OK;
+#endif
+    while (glGetError() != GL_NO_ERROR) {
+    }
+  }
+  HeadlessContext(const HeadlessContext &) = delete;
+  HeadlessContext &operator=(const HeadlessContext &) = delete;
+  ~HeadlessContext() {
+    if (this->display == EGL_NO_DISPLAY) return;
+    eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (this->context != EGL_NO_CONTEXT) eglDestroyContext(this->display, this->context);
+    eglTerminate(this->display);
+  }
+  bool ready{false};
+private:
+  EGLDisplay display{EGL_NO_DISPLAY};
+  EGLContext context{EGL_NO_CONTEXT};
+};
+
+}; // namespace
+
+int main(int argc, char *argv[]) {
+
+  RenderOptions opt;
+  if (!parse_args(argc, argv, opt)) {
+    std::cerr << "usage: " << argv[0]
+              << " --output FILE|-|\"|COMMAND\" [--frames F] [--steps-per-frame K] [--dt DT]"
+                 " [--size WxH] [--bodies N] [--scenario NAME | --ic FILE] [--seed S]"
+                 " [--method direct|tiled|symmetric|bh|pm|fmm] [--camera PATH]"
+                 " [--colormap magma|blue_orange|viridis|plasma|rainbow] [--lod BUDGET] [--cull]"
+                 " [--no-mapping]\n";
+    for (const Scenario &sc : scenarios()) {
+      std::cerr << "  " << sc.name << ": " << sc.description << "\n";
+    }
+    return EXIT_FAILURE;
+  }
+  std::vector<Keyframe> keys;
+  if (!opt.camera.empty() && !read_keyframes(opt.camera, keys)) {
+    std::cerr << "cannot read camera path " << opt.camera << "\n";
+    return EXIT_FAILURE;
+  }
+
+  HeadlessContext context;
+  if (!context.ready) {
+    std::cerr << "cannot create a headless OpenGL 3.3 context\n";
+    return EXIT_FAILURE;
+  }
+  FrameSink sink(opt.output);
+  if (!sink.is_open()) {
+    std::cerr << "cannot open " << opt.output << "\n";
+    return EXIT_FAILURE;
+  }
+
+  bool ok = true;
+  {
+    Framebuffer framebuffer(opt.width, opt.height);
+    Readback readback(opt.width, opt.height);
+    Renderer renderer;
+    renderer.simulator->scenario = opt.scenario;
+    renderer.simulator->seed = opt.seed;
+    renderer.lod = opt.lod_budget > 0;
+    renderer.lod_budget = opt.lod_budget;
+    // Every frame of the movie at the level of its budget
+    renderer.refine_settled = false;
+    renderer.culling = opt.cull;
+    renderer.persistent_mapping = opt.mapping;
+    if (!framebuffer.complete || !renderer.init(opt.bodies, opt.ic)) {
+      std::cerr << (framebuffer.complete ? "cannot set up the bodies" : "incomplete framebuffer")
+                << "\n";
+      return EXIT_FAILURE;
+    }
+    renderer.change_color(opt.colormap);
+
+    SimSettings settings;
+    settings.timestep = opt.timestep;
+    settings.force_method = opt.method;
+    settings.cull_grid = opt.cull;
+    const float aspect_ratio = static_cast<float>(opt.width) / opt.height;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int f = 0; f < opt.frames && ok; f++) {
+      // The bodies of this frame, then on to the steps of the next
+      const std::uint64_t step = static_cast<std::uint64_t>(f) * opt.steps_per_frame;
+      // Uploaded once it is there, not on every poll
+      while (renderer.sim_thread->steps() < step) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      renderer.camera = camera_at(keys, f, opt.frames);
+      renderer.update();
+      if (f + 1 < opt.frames) {
+        settings.paused = false;
+        settings.run_until = step + opt.steps_per_frame;
+        renderer.sim_thread->configure(settings);
+      }
+
+      framebuffer.bind();
+      glViewport(0, 0, opt.width, opt.height);
+      glClearColor(0.45f, 0.55f, 0.60f, 1.0f);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      renderer.display(aspect_ratio);
+      ok = readback.capture(sink);
+    }
+    ok = ok && readback.flush(sink);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << opt.frames << " frames of " << opt.width << "x" << opt.height << " in "
+              << seconds << " s (" << opt.frames / seconds << " frames/s)\n";
+  }
+  ok = sink.close() && ok;
+  if (!ok) std::cerr << "cannot write " << opt.output << "\n";
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
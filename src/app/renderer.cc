@@ -1,6 +1,9 @@
 
 #include "renderer.hh"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
 #include <stdexcept>
@@ -25,11 +28,15 @@ Renderer::Renderer()
   glDepthFunc(GL_LESS);
 }
 
-void Renderer::init(int NBODS) {
+bool Renderer::init(int NBODS, const std::string &ic_path) {
+  this->sim_thread.reset();
+  const bool ok = ic_path.empty() ? this->simulator->setup(NBODS)
+                                  : this->simulator->load_initial_conditions(ic_path);
+  if (!ok) return false;
+  NBODS = this->simulator->num_bodies;
   this->numbods = NBODS;
-
-  this->simulator->setup(NBODS);
-  this->simulator->interleave_data();
+  this->sim_thread = std::make_unique<SimulationThread>(*this->simulator);
+  this->stride = this->sim_thread->stride();
   
   this->camera = Camera(glm::vec3(0.0f, 0.0f, -2000000.0f),
                         glm::vec3(0.0f, 0.0f, 0.0f),
@@ -44,13 +51,58 @@ void Renderer::init(int NBODS) {
   // Bind vertex array
   glBindVertexArray(this->VAO);
   glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  glEnableVertexAttribArray(2);
+  glEnableVertexAttribArray(3);
 
   // Bind vertex buffer and setup data
+  // positions stay in the SoA layout of System, one attribute per axis,
+  // followed by the 16-bit speeds, which color the bodies for a sixth more
+  // bytes per frame. With buffer storage (GL 4.4, or the extension on Mesa's
+  // llvmpipe) the buffer is a persistently mapped ring of frames, written in
+  // place and fenced; otherwise it holds one frame replaced by glBufferSubData
+  // Frames of the ring start 4-byte aligned, for the floats
+  this->frame_bytes = ((3 * sizeof(GLfloat) + sizeof(GLushort)) * this->stride + 3) & ~std::size_t{3};
+  const GLsizeiptr frame_bytes = this->frame_bytes;
   glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * NBODS * 3,
-    this->simulator->flatPos.data(), GL_DYNAMIC_DRAW);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat),
-                        (void *)0);
+  this->mapped = nullptr;
+  this->ring_frames = 1;
+  if (this->persistent_mapping && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)) {
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, frame_bytes * RING_FRAMES, nullptr, flags);
+    this->mapped = static_cast<GLubyte *>(
+        glMapBufferRange(GL_ARRAY_BUFFER, 0, frame_bytes * RING_FRAMES, flags));
+    if (!this->mapped) {
+      // Storage is immutable once set, start over with a fresh buffer
+      glDeleteBuffers(1, &this->VBO);
+      glGenBuffers(1, &this->VBO);
+      glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+    }
+  }
+  this->level = 0;
+  this->last_view = this->camera.get_view_matrix();
+  this->all_visible = true;
+  this->visible_cells.clear();
+  if (this->mapped) {
+    this->ring_frames = RING_FRAMES;
+    write_frame(this->mapped, this->sim_thread->frame());
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, frame_bytes, nullptr, GL_DYNAMIC_DRAW);
+    write_frame(nullptr, this->sim_thread->frame());
+  }
+  this->ring_index = 0;
+  bind_frame(0);
+  this->speed_range[0] = this->sim_thread->frame().log2_speed_min;
+  this->speed_range[1] = this->sim_thread->frame().log2_speed_max;
+
+  // Colormap, sampled by speed
+  if (!glIsTexture(this->texture_color)) glGenTextures(1, &this->texture_color);
+  glBindTexture(GL_TEXTURE_1D, this->texture_color);
+  glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_1D, 0);
+  if (this->color_map.empty()) change_color(Color::Magma);
 
   // Setup uniform buffer
   glBindBuffer(GL_UNIFORM_BUFFER, this->UBO);
@@ -76,30 +128,210 @@ void Renderer::init(int NBODS) {
   GLuint blockIndex = glGetUniformBlockIndex(this->shader_program, "UBO");
   glUniformBlockBinding(this->shader_program, blockIndex,
                         0);
+  this->color_texture_loc = glGetUniformLocation(this->shader_program, "colormap");
+  this->speed_range_loc = glGetUniformLocation(this->shader_program, "speed_range");
+  this->point_size_loc = glGetUniformLocation(this->shader_program, "point_size");
+  glUniform1i(this->color_texture_loc, 0);
+  return true;
 }
 
-void Renderer::update(float DTIME) {
-  //if (!simulator->sim_is_paused()) {
+// Points the three position attributes and the speed attribute at frame
+// `index` of the buffer
+void Renderer::bind_frame(std::size_t index) {
+  const std::size_t first = index * this->frame_bytes;
+  glBindVertexArray(this->VAO);
+  glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+  for (GLuint axis = 0; axis < 3; axis++) {
+    glVertexAttribPointer(axis, 1, GL_FLOAT, GL_FALSE, sizeof(GLfloat),
+                          (void *)(first + sizeof(GLfloat) * axis * this->drawn_stride));
+  }
+  // Normalized, the shader gets code / 65535
+  glVertexAttribPointer(3, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(GLushort),
+                        (void *)(first + sizeof(GLfloat) * 3 * this->drawn_stride));
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindVertexArray(0);
+}
 
-    // Run a timestep if ready
-    this->simulator->advance(DTIME);
-    this->simulator->interleave_data();
+// Copies the bodies in view at the current level of detail to dst in the
+// mapped ring, or with dst null into the bound buffer. Every body goes as
+// is; otherwise the bodies drawn, those whose index (or ID, when the frame
+// has them) is a multiple of 2^level, are gathered into streams of their own
+void Renderer::write_frame(GLubyte *dst, const SimFrame &frame) {
+  const std::size_t step = std::size_t{1} << this->level;
+  const std::size_t n = static_cast<std::size_t>(this->numbods);
+
+  if (step == 1 && this->all_visible) {
+    this->drawn = n;
+    this->drawn_stride = this->stride;
+    const std::size_t position_bytes = sizeof(GLfloat) * frame.positions.size();
+    const std::size_t speed_bytes = sizeof(GLushort) * frame.speeds.size();
+    if (dst) {
+      std::memcpy(dst, frame.positions.data(), position_bytes);
+      std::memcpy(dst + position_bytes, frame.speeds.data(), speed_bytes);
+    } else {
+      glBufferSubData(GL_ARRAY_BUFFER, 0, position_bytes, frame.positions.data());
+      glBufferSubData(GL_ARRAY_BUFFER, position_bytes, speed_bytes, frame.speeds.data());
+    }
+    return;
+  }
 
-    // Bind new position data to VBO
+  // A sort moves the bodies between indices, not IDs
+  const std::uint32_t *ids = frame.ids.empty() ? nullptr : frame.ids.data();
+  this->selected.clear();
+  if (this->all_visible && !ids) {
+    for (std::size_t i = 0; i < n; i += step) this->selected.push_back(static_cast<std::uint32_t>(i));
+  } else if (this->all_visible) {
+    for (std::uint32_t i = 0; i < n; i++) {
+      if ((ids[i] & (step - 1)) == 0) this->selected.push_back(i);
+    }
+  } else {
+    const CullGrid &grid = frame.grid;
+    for (const std::uint32_t c : this->visible_cells) {
+      for (std::uint32_t k = grid.start[c]; k < grid.start[c + 1]; k++) {
+        const std::uint32_t i = grid.order[k];
+        if (((ids ? ids[i] : i) & (step - 1)) == 0) this->selected.push_back(i);
+      }
+    }
+  }
+  this->drawn = this->selected.size();
+  const std::size_t m = this->drawn;
+  this->drawn_stride = m;
+  const std::size_t bytes = (3 * sizeof(GLfloat) + sizeof(GLushort)) * m;
+  if (!dst) this->staging.resize(bytes);
+  GLubyte *out = dst ? dst : this->staging.data();
+  GLfloat *pos = reinterpret_cast<GLfloat *>(out);
+  GLushort *speed = reinterpret_cast<GLushort *>(out + 3 * sizeof(GLfloat) * m);
+  for (std::size_t axis = 0; axis < 3; axis++) {
+    const float *src = frame.positions.data() + axis * this->stride;
+    for (std::size_t i = 0; i < m; i++) pos[axis * m + i] = src[this->selected[i]];
+  }
+  for (std::size_t i = 0; i < m; i++) speed[i] = frame.speeds[this->selected[i]];
+  if (!dst) glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, out);
+}
+
+// Cells of the frame's grid inside the view frustum, tested by their
+// bounds against the six planes of the clip matrix; every body when
+// culling is off, the frame has no grid or all its cells are in view.
+// True if that changed
+bool Renderer::cull(const SimFrame &frame) {
+  this->previous_cells.swap(this->visible_cells);
+  this->visible_cells.clear();
+  const bool was_all = this->all_visible;
+  this->all_visible = true;
+  this->visible_bodies = static_cast<std::size_t>(this->numbods);
+  if (this->culling && !frame.grid.empty()) {
+    const glm::mat4 clip = this->camera.get_projection_matrix(this->aspect) *
+                           this->camera.get_view_matrix();
+    glm::vec4 planes[6];
+    for (int i = 0; i < 3; i++) {
+      const glm::vec4 row(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+      const glm::vec4 w(clip[0][3], clip[1][3], clip[2][3], clip[3][3]);
+      planes[2 * i] = w + row;
+      planes[2 * i + 1] = w - row;
+    }
+    const CullGrid &grid = frame.grid;
+    std::size_t bodies = 0;
+    std::size_t occupied = 0;
+    for (std::uint32_t c = 0; c < CullGrid::NUM_CELLS; c++) {
+      const std::uint32_t count = grid.start[c + 1] - grid.start[c];
+      if (count == 0) continue;
+      occupied++;
+      const float *box = grid.bounds.data() + 6 * c;
+      bool inside = true;
+      for (const glm::vec4 &p : planes) {
+        // The corner furthest along the plane normal
+        const float x = p.x > 0 ? box[3] : box[0];
+        const float y = p.y > 0 ? box[4] : box[1];
+        const float z = p.z > 0 ? box[5] : box[2];
+        if (p.x * x + p.y * y + p.z * z + p.w < 0) {
+          inside = false;
+          break;
+        }
+      }
+      if (!inside) continue;
+      this->visible_cells.push_back(c);
+      bodies += count;
+    }
+    if (this->visible_cells.size() < occupied) {
+      this->all_visible = false;
+      this->visible_bodies = bodies;
+    } else {
+      this->visible_cells.clear();
+    }
+  }
+  return this->all_visible != was_all || this->visible_cells != this->previous_cells;
+}
+
+// Coarsest level whose subset of the bodies in view fits the budget at the
+// camera's distance. The budget follows the area the scene covers on
+// screen. Once the picture settles, no new step and the camera still, it
+// gets one level finer each frame instead, unless refine_settled is off
+int Renderer::select_level(bool settled) {
+  if (!this->lod) return 0;
+  if (settled && this->refine_settled) return std::max(this->level - 1, 0);
+
+  const float distance = glm::distance(this->camera.get_cam_pos(), this->camera.get_LookAt());
+  const float scale = LOD_REFERENCE_DISTANCE / std::max(distance, 1.0f);
+  const double budget = std::max(static_cast<double>(this->lod_budget) * scale * scale,
+                                 static_cast<double>(LOD_MIN_BUDGET));
+  const std::size_t n = this->visible_bodies;
+  int level = 0;
+  while (level < 30 && static_cast<double>((n + (std::size_t{1} << level) - 1) >> level) > budget) {
+    level++;
+  }
+  return level;
+}
+
+void Renderer::update() {
+  // Steps run on the simulation thread; only new frames are uploaded, or
+  // the last one again with other bodies in view or at a new level of detail
+  if (!this->sim_thread) return;
+  const bool fresh = this->sim_thread->update();
+  const glm::mat4 view = this->camera.get_view_matrix();
+  const bool moved = view != this->last_view;
+  this->last_view = view;
+  const SimFrame &frame = this->sim_thread->frame();
+  const bool culled = cull(frame);
+  const int level = select_level(!fresh && !moved);
+  if (!fresh && !culled && level == this->level) return;
+  this->level = level;
+  this->speed_range[0] = frame.log2_speed_min;
+  this->speed_range[1] = frame.log2_speed_max;
+
+  if (!this->mapped) {
+    // Bind new frame data to VBO
     glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * this->numbods * 3,
-                    this->simulator->flatPos.data());
-  //}
+    write_frame(nullptr, frame);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // The streams are packed drawn_stride apart, which follows the level
+    bind_frame(0);
+    return;
+  }
+
+  // Write the next frame of the ring once the GPU is done drawing from it
+  this->ring_index = (this->ring_index + 1) % this->ring_frames;
+  GLsync &fence = this->fences[this->ring_index];
+  if (fence) {
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+  }
+  write_frame(this->mapped + this->ring_index * this->frame_bytes, frame);
+  bind_frame(this->ring_index);
 }
 
 void Renderer::change_color(Color::ColorType color) {
   this->color_map = getColormap(color);
+  glBindTexture(GL_TEXTURE_1D, this->texture_color);
   glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, this->color_map.size(), 0, GL_RGB,
                  GL_FLOAT, this->color_map.data());
+  glBindTexture(GL_TEXTURE_1D, 0);
 }
 
-void Renderer::display(float aspect_ratio) const {
+void Renderer::display(float aspect_ratio) {
 
+  this->aspect = aspect_ratio;
   glUseProgram(this->shader_program);
 
   // Update UBO data
@@ -110,11 +342,25 @@ void Renderer::display(float aspect_ratio) const {
       GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4),
       glm::value_ptr(this->camera.get_projection_matrix(aspect_ratio)));
   glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-  // Bind VAO and draw
+  glUniform2fv(this->speed_range_loc, 1, this->speed_range);
+  // A point drawn stands for 2^level bodies, its area grows as far as it goes
+  glUniform1f(this->point_size_loc,
+              std::min(std::sqrt(static_cast<float>(1 << this->level)), LOD_MAX_POINT_SIZE));
+
+  // Bind VAO and colormap, and draw
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_1D, this->texture_color);
   glBindVertexArray(this->VAO);
-  glDrawArrays(GL_POINTS, 0, this->numbods);
+  glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(this->drawn));
   glBindVertexArray(0);
+  glBindTexture(GL_TEXTURE_1D, 0);
+
+  // The ring frame drawn from may not be written until this draw is done
+  if (this->mapped) {
+    GLsync &fence = this->fences[this->ring_index];
+    if (fence) glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
 }
 
 void Renderer::reset_simulator() {
@@ -123,9 +369,21 @@ void Renderer::reset_simulator() {
 }
 
 Renderer::~Renderer() {
+  this->sim_thread.reset();
+  for (GLsync &fence : this->fences) {
+    if (fence) glDeleteSync(fence);
+  }
+  if (this->mapped) {
+    glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
   if (glIsVertexArray(this->VAO)) {
     glBindVertexArray(this->VAO);
     glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
+    glDisableVertexAttribArray(3);
     glDeleteVertexArrays(1, &this->VAO);
   }
   if (glIsTexture(this->texture_color)) {
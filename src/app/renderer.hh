@@ -4,9 +4,11 @@
 #include "color_palette.hh"
 #include "camera.hh"
 #include "system.hh"
+#include "sim_thread.hh"
 
 #include <fstream>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <GL/glew.h>
@@ -15,22 +17,73 @@ class Renderer {
 public:
   Renderer();
   ~Renderer();
-  void init(int NBODS);
+  // Generates NBODS bodies of the simulator's scenario, or loads ic_path
+  // when it is not empty, and starts the simulation thread on them
+  bool init(int NBODS, const std::string &ic_path = "");
   void change_color(Color::ColorType color);
-  void update(float DTIME);
-  void display(float aspect_ratio) const;
+  // Uploads the newest frame of the simulation thread, if there is one
+  void update();
+  void display(float aspect_ratio);
   void reset_simulator();
   std::unique_ptr<System> simulator;
+  std::unique_ptr<SimulationThread> sim_thread; // Owns simulator while it exists
   Camera camera;
+  // Stream frames through a persistently mapped ring when the GL supports
+  // it; read by init()
+  bool persistent_mapping{true};
+  bool uses_persistent_mapping() const { return this->mapped != nullptr; }
+  // Level of detail: upload and draw every 2^level-th body only, by ID once
+  // the bodies have been sorted so the subset stays the same, the level
+  // chosen so that about lod_budget bodies are drawn with the camera at its
+  // initial distance, fewer farther away and more closer in. Subsets nest,
+  // and while neither the camera nor the bodies move the level is refined by
+  // one per frame down to every body. Each point drawn grows to stand for
+  // the bodies skipped around it
+  bool lod{false};
+  int lod_budget{1 << 20};
+  bool refine_settled{true}; // Off to keep the budget level of a still picture
+  int lod_level() const { return this->level; }
+  // Frustum culling: have the simulation thread publish a CullGrid with
+  // every frame, and upload only the bodies of the cells in view
+  bool culling{false};
+  std::size_t drawn_bodies() const { return this->drawn; }
 private:
+  static constexpr std::size_t RING_FRAMES = 3;
+  static constexpr float LOD_REFERENCE_DISTANCE = 2000000.0f; // Initial camera distance
+  static constexpr std::size_t LOD_MIN_BUDGET = 4096;
+  static constexpr float LOD_MAX_POINT_SIZE = 4.0f;
+  bool cull(const SimFrame &frame);
+  int select_level(bool settled);
+  void bind_frame(std::size_t index);
+  void write_frame(GLubyte *dst, const SimFrame &frame);
   GLuint compile_shader(GLenum type, const char *path);
   GLuint create_shader_program(const char *vertexPath, const char *fragmentPath);
   int numbods;
+  std::size_t stride{0}; // Bodies per attribute stream, ghosts included
+  std::size_t frame_bytes{0}; // Three float position streams and a speed stream
+  int level{0}; // Of detail, of the uploaded frame
+  std::size_t drawn{0}; // Bodies in the uploaded frame
+  std::size_t drawn_stride{0}; // Bodies per attribute stream of the uploaded frame
+  std::vector<GLubyte> staging; // Gathered frame, without a mapping
+  std::vector<std::uint32_t> selected; // Bodies gathered
+  std::vector<std::uint32_t> visible_cells; // Of the grid, unless all_visible
+  std::vector<std::uint32_t> previous_cells;
+  bool all_visible{true};
+  std::size_t visible_bodies{0};
+  float aspect{1.0f}; // Of the last display()
+  glm::mat4 last_view{0.0f};
+  GLubyte *mapped{nullptr}; // Persistent mapping of VBO, ring_frames frames
+  std::size_t ring_frames{1};
+  std::size_t ring_index{0}; // Frame drawn from
+  GLsync fences[RING_FRAMES]{};
   std::vector<glm::vec3> color_map;
   GLuint shader_program;
   GLuint texture_color;
   GLuint VAO;
   GLuint VBO;
   GLuint UBO;
-  GLuint color_texture_loc;
+  GLint color_texture_loc{-1};
+  GLint speed_range_loc{-1};
+  GLint point_size_loc{-1};
+  float speed_range[2]{0.0f, 1.0f}; // log2|v| at the ends of the colormap
 };
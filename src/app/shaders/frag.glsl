@@ -1,9 +1,15 @@
 // fragment_shader.glsl
 #version 330 core
 
+in float vColor;
+
+uniform sampler1D colormap;
+
 out vec4 FragColor;
 
 void main() 
 {
-    FragColor = vec4(1.0f, 0.5f, 0.2f, 1.0f);
+    // From the first texel center to the last, across the whole colormap
+    float texels = float(textureSize(colormap, 0));
+    FragColor = vec4(texture(colormap, (0.5 + vColor * (texels - 1.0)) / texels).rgb, 1.0f);
 }
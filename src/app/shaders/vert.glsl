@@ -1,14 +1,31 @@
 // vertex_shader.glsl
 #version 330 core
 
-layout(location = 0) in vec3 aPos;
+// One stream per axis, as System stores them
+layout(location = 0) in float aPosX;
+layout(location = 1) in float aPosY;
+layout(location = 2) in float aPosZ;
+// encode_speed() / 65535, the float |v|^2 without its sign and low 15 bits
+layout(location = 3) in float aSpeed;
 
 layout(std140) uniform UBO {
     mat4 view;
     mat4 projection;
 };
 
+// log2|v| at the two ends of the colormap
+uniform vec2 speed_range;
+// Pixels, larger when bodies are left out at a coarse level of detail
+uniform float point_size;
+
+out float vColor;
+
 void main()
 {
-    gl_Position = projection * view * vec4(aPos, 1.0);
+    gl_Position = projection * view * vec4(aPosX, aPosY, aPosZ, 1.0);
+    gl_PointSize = point_size;
+    // decode_speed(), log2 of |v|^2 halved; bodies at rest get the slowest color
+    float speed2 = uintBitsToFloat(uint(aSpeed * 65535.0 + 0.5) << 15);
+    float log2_speed = 0.5 * log2(max(speed2, 1.0e-30));
+    vColor = clamp((log2_speed - speed_range.x) / (speed_range.y - speed_range.x), 0.0, 1.0);
 }
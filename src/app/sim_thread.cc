@@ -0,0 +1,185 @@
+
+#include "sim_thread.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <execution>
+#include <utility>
+
+namespace {
+// Histogram bins of the speed codes, 16 codes (1/32 of a power of two) each
+constexpr std::size_t SPEED_BINS = 4096;
+
+// The position arrays of system, one after the other, as they are in memory
+void copy_positions(const System &system, std::vector<float> &frame) {
+  const std::vector<SIMDVec> *axes[3] = {&system.PosX, &system.PosY, &system.PosZ};
+  const std::size_t stride = system.PosX.size() * CHUNK;
+  const std::size_t index[3] = {0, 1, 2};
+  std::for_each(std::execution::par, std::begin(index), std::end(index), [&](std::size_t a) {
+    std::memcpy(frame.data() + a * stride, axes[a]->data(), stride * sizeof(float));
+  });
+}
+
+// Bodies at rest have code 0, kept off -infinity
+float log2_speed(std::size_t code) {
+  return std::log2(decode_speed(static_cast<std::uint16_t>(std::clamp<std::size_t>(code, 1, 0xffff))));
+}
+
+// Speeds of system and the percentiles the colormap spans; a few outliers
+// (or the bodies at rest, as the central masses are) would otherwise wash
+// out the colors of all the others
+void copy_speeds(const System &system, SimFrame &frame) {
+  frame.speeds = system.Speed;
+  std::vector<std::size_t> bins(SPEED_BINS, 0);
+  const std::size_t n = static_cast<std::size_t>(system.num_bodies);
+  for (std::size_t i = 0; i < n; i++) bins[frame.speeds[i] >> 4]++;
+
+  const std::size_t low = n / 100;
+  const std::size_t high = n - 1 - low;
+  std::size_t seen = 0;
+  std::size_t first = 0;
+  std::size_t last = 0;
+  for (std::size_t b = 0; b < SPEED_BINS; b++) {
+    if (seen <= low) first = b;
+    seen += bins[b];
+    last = b;
+    if (seen > high) break;
+  }
+  frame.log2_speed_min = log2_speed(first << 4);
+  frame.log2_speed_max = log2_speed((last + 1) << 4);
+}
+
+SimFrame first_frame(System &system) {
+  SimFrame frame;
+  frame.positions.resize(3 * system.PosX.size() * CHUNK);
+  copy_positions(system, frame.positions);
+  system.update_speeds();
+  copy_speeds(system, frame);
+  frame.ids = system.Id;
+  return frame;
+}
+}; // namespace
+
+SimulationThread::SimulationThread(System &system)
+  : system(system),
+    axis_stride(system.PosX.size() * CHUNK),
+    frames(first_frame(system))
+{
+  // Speeds come with the drift of every step from now on, and sorted
+  // bodies keep their IDs, which the level of detail selects by
+  system.track_speed = true;
+  system.track_ids = true;
+  this->worker = std::thread(&SimulationThread::run, this);
+}
+
+SimulationThread::~SimulationThread() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->wake.notify_one();
+  this->worker.join();
+}
+
+void SimulationThread::configure(const SimSettings &settings) {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    // A reset not yet seen by the thread survives newer settings
+    const bool reset = this->pending && this->settings.reset_profile;
+    this->settings = settings;
+    this->settings.reset_profile |= reset;
+    this->pending = true;
+  }
+  this->wake.notify_one();
+}
+
+std::uint64_t SimulationThread::steps() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->num_steps;
+}
+
+double SimulationThread::steps_per_second() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->step_rate;
+}
+
+StepProfile SimulationThread::profile() const {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->last_profile;
+}
+
+void SimulationThread::publish(bool cull_grid, std::uint64_t step) {
+  SimFrame &frame = this->frames.back();
+  frame.step = step;
+  copy_positions(this->system, frame.positions);
+  copy_speeds(this->system, frame);
+  frame.ids.assign(std::begin(this->system.Id), std::end(this->system.Id));
+  if (cull_grid) {
+    frame.grid.build(frame.positions, this->axis_stride, static_cast<std::size_t>(this->system.num_bodies));
+  } else {
+    frame.grid.clear();
+  }
+  this->frames.publish();
+}
+
+void SimulationThread::run() {
+
+  using clock = std::chrono::steady_clock;
+  SimSettings active;
+  clock::time_point rate_start = clock::now();
+  std::uint64_t rate_steps = 0;
+  std::uint64_t step = 0; // num_steps, without the lock
+
+  std::unique_lock<std::mutex> lock(this->mutex);
+  while (true) {
+    this->wake.wait(lock, [&] { return this->stopping || this->pending || !active.paused; });
+    if (this->stopping) break;
+    const bool changed = std::exchange(this->pending, false);
+    const bool had_grid = active.cull_grid;
+    if (changed) active = this->settings;
+    lock.unlock();
+    if (active.run_until && step >= active.run_until) active.paused = true;
+
+    if (changed) {
+      this->system.force_method = active.force_method;
+      this->system.opening_angle = active.opening_angle;
+      this->system.pm_grid = active.pm_grid;
+      this->system.fmm_order = active.fmm_order;
+      this->system.fmm_leaf_size = active.fmm_leaf_size;
+      this->system.rsqrt_mode = active.rsqrt_mode;
+      this->system.block_timesteps = active.block_timesteps;
+      this->system.max_level = active.max_level;
+      this->system.sort_interval = active.sort_interval;
+#ifdef ENABLE_PROFILING
+      this->system.hw_counters = active.hw_counters;
+      if (active.reset_profile) this->system.profile.reset();
+#endif
+      // A paused frame gains or loses its grid right away
+      if (active.paused && active.cull_grid != had_grid) publish(active.cull_grid, step);
+    }
+    if (!active.paused) {
+      this->system.advance(active.timestep);
+      publish(active.cull_grid, ++step);
+      rate_steps++;
+    } else {
+      rate_steps = 0;
+      rate_start = clock::now();
+    }
+
+    lock.lock();
+    if (!active.paused) this->num_steps++;
+#ifdef ENABLE_PROFILING
+    if (changed || !active.paused) this->last_profile = this->system.profile;
+#endif
+    const double seconds = std::chrono::duration<double>(clock::now() - rate_start).count();
+    if (active.paused) {
+      this->step_rate = 0.0;
+    } else if (seconds >= 0.5) {
+      this->step_rate = rate_steps / seconds;
+      rate_steps = 0;
+      rate_start = clock::now();
+    }
+  }
+}
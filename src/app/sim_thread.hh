@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "system.hh"
+#include "cull_grid.hh"
+#include "triple_buffer.hh"
+
+// Settings the UI may change while the simulation runs
+struct SimSettings {
+  bool paused{true};
+  float timestep{10.0f};
+  ForceMethod force_method{ForceMethod::DirectSum};
+  float opening_angle{0.5f};
+  int pm_grid{64};
+  int fmm_order{6};
+  int fmm_leaf_size{128};
+  RsqrtMode rsqrt_mode{RsqrtMode::Raw};
+  bool block_timesteps{false};
+  int max_level{6};
+  int sort_interval{0}; // Steps between spatial sorts of the bodies, 0 for never
+  bool hw_counters{false};
+  bool reset_profile{false};
+  bool cull_grid{false}; // Publish a CullGrid with every frame
+  std::uint64_t run_until{0}; // Pause by itself once steps() gets there, 0 for never
+};
+
+// One published step
+// positions in the SoA layout of System, PosX then PosY then PosZ, each
+// stride floats including the ghost lanes of the last chunk, and the
+// encode_speed() of every body, ghosts included. log2_speed_min and
+// log2_speed_max bracket the 1st to the 99th percentile of log2|v|. ids is
+// System::Id, empty until the bodies are first sorted. grid is empty unless
+// SimSettings::cull_grid is set
+struct SimFrame {
+  std::uint64_t step{0}; // Steps taken before it was published
+  std::vector<float> positions;
+  std::vector<std::uint16_t> speeds;
+  std::vector<std::uint32_t> ids;
+  float log2_speed_min{0.0f};
+  float log2_speed_max{1.0f};
+  CullGrid grid;
+};
+
+// Runs System::advance() on its own thread, as fast as it goes, and
+// publishes the positions and speeds after every step through a triple
+// buffer, so the render thread never waits on a step. The System belongs to
+// the thread until it is destroyed; settings reach it between steps
+class SimulationThread {
+public:
+  explicit SimulationThread(System &system);
+  SimulationThread(const SimulationThread &) = delete;
+  SimulationThread &operator=(const SimulationThread &) = delete;
+  // Finishes the current step, then stops the thread
+  ~SimulationThread();
+  // Replaces the settings for the next step
+  void configure(const SimSettings &settings);
+  // Render thread: true if a newer frame than the last one is in frame()
+  bool update() { return this->frames.update(); }
+  const SimFrame &frame() const { return this->frames.front(); }
+  std::size_t stride() const { return this->axis_stride; }
+  std::uint64_t steps() const;
+  double steps_per_second() const;
+  StepProfile profile() const; // Copy as of the last step
+private:
+  void run();
+  void publish(bool cull_grid, std::uint64_t step);
+  System &system;
+  std::size_t axis_stride;
+  TripleBuffer<SimFrame> frames;
+  SimSettings settings;
+  bool pending{false};
+  bool stopping{false};
+  std::uint64_t num_steps{0};
+  double step_rate{0.0};
+  StepProfile last_profile;
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  std::thread worker;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free triple buffer between one writer and one reader thread
+// the writer fills back() and publishes it; the reader calls update() and
+// reads front(), the newest published slot. Neither side ever waits: the
+// third slot is the hand-over point, swapped with a single atomic exchange,
+// and a writer that publishes faster than the reader updates just replaces
+// the frame the reader has not taken yet
+template <class T> class TripleBuffer {
+public:
+  explicit TripleBuffer(const T &value = T()) : slots{value, value, value} {}
+  TripleBuffer(const TripleBuffer &) = delete;
+  TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+  // Writer side
+  T &back() { return this->slots[this->back_index]; }
+  void publish() {
+    this->back_index = this->middle.exchange(this->back_index | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Reader side; true if front() changed
+  bool update() {
+    if (!(this->middle.load(std::memory_order_relaxed) & FRESH)) return false;
+    this->front_index = this->middle.exchange(this->front_index, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+  const T &front() const { return this->slots[this->front_index]; }
+
+private:
+  static constexpr std::uint8_t INDEX = 3;
+  static constexpr std::uint8_t FRESH = 4; // Middle slot published, not yet taken
+  T slots[3];
+  std::uint8_t back_index{0};
+  std::uint8_t front_index{1};
+  std::atomic<std::uint8_t> middle{2};
+};
@@ -0,0 +1,126 @@
+
+#include <execution>
+#include <algorithm>
+
+#include "system.hh"
+#include "kernel_common.hh"
+
+// Barnes-Hut force evaluation
+// a cell is accepted as a single monopole when (cell size / distance) < theta,
+// otherwise it is opened; leaves that are opened are summed directly
+// the tree always holds every body, but only bodies of the target chunks walk it
+void System::accumulate_forces_BH(const std::vector<std::size_t> &targets) {
+
+	this->octree.build(this->PosX.data(), this->PosY.data(), this->PosZ.data(),
+	                   this->Mass.data(), this->num_bodies,
+	                   static_cast<std::uint32_t>(this->leaf_size));
+
+	auto const *nd = this->octree.nodes.data();
+	auto const *od = this->octree.order.data();
+	auto const *sx = this->octree.X.data();
+	auto const *sy = this->octree.Y.data();
+	auto const *sz = this->octree.Z.data();
+	auto const *sm = this->octree.M.data();
+	auto *ax = this->AccX.data();
+	auto *ay = this->AccY.data();
+	auto *az = this->AccZ.data();
+
+	const float theta2 = this->opening_angle * this->opening_angle;
+
+	// Chunk mask, only needed when a subset of the chunks is active
+	const bool all = (targets.size() == this->Cidx.size());
+	std::vector<std::uint8_t> active(all ? 0 : this->Cidx.size(), 0);
+	auto *ac = active.data();
+	if (!all) {
+		std::for_each(std::execution::par_unseq, std::begin(targets), std::end(targets),
+		              [=](std::size_t i) { ac[i] = 1; });
+	}
+
+#ifdef ENABLE_PROFILING
+	// Body-body and body-cell interactions of each leaf, summed after the walk
+	std::vector<std::uint64_t> work(2 * this->octree.nodes.size(), 0);
+	auto *wk = work.data();
+#endif
+
+	// Walk the tree once per body, visiting leaves so bodies that are
+	// neighbours in space are processed together
+	dispatch_rsqrt_mode(this->rsqrt_mode, [&](auto mode) {
+		std::for_each(std::execution::par_unseq, std::begin(this->octree.nodes),
+										std::end(this->octree.nodes), [=](const OctreeNode &leaf) {
+			if (leaf.nchild != 0) return;
+			[[maybe_unused]] std::uint64_t pairs = 0;
+			[[maybe_unused]] std::uint64_t cells = 0;
+
+			for (std::uint32_t s = leaf.first; s < leaf.first + leaf.count; s++) {
+				if (!all && !ac[od[s] / CHUNK]) continue;
+				const float p_x = sx[s];
+				const float p_y = sy[s];
+				const float p_z = sz[s];
+				float r_x = 0.0f;
+				float r_y = 0.0f;
+				float r_z = 0.0f;
+
+				// Each opened cell pushes at most 8 children, one cell per level
+				std::uint32_t stack[8 * 24];
+				int top = 0;
+				stack[top++] = 0;
+
+				while (top > 0) {
+					const OctreeNode &node = nd[stack[--top]];
+					float dx = node.com_x - p_x;
+					float dy = node.com_y - p_y;
+					float dz = node.com_z - p_z;
+					float d2 = dx * dx + dy * dy + dz * dz;
+					const float size = 2.0f * node.half;
+
+					if (size * size < theta2 * d2) {
+						d2 += softening2;
+						float inv = inv_sqrt<decltype(mode)::value>(d2);
+						float imp = node.mass * inv * inv * inv;
+						r_x += dx * imp;
+						r_y += dy * imp;
+						r_z += dz * imp;
+						cells++;
+					} else if (node.nchild == 0) {
+						pairs += node.count;
+						for (std::uint32_t t = node.first; t < node.first + node.count; t++) {
+							float ex = sx[t] - p_x;
+							float ey = sy[t] - p_y;
+							float ez = sz[t] - p_z;
+							float e2 = ex * ex + ey * ey + ez * ez;
+							      e2 += softening2;
+							float inv = inv_sqrt<decltype(mode)::value>(e2);
+							float imp = sm[t] * inv * inv * inv;
+							r_x += ex * imp;
+							r_y += ey * imp;
+							r_z += ez * imp;
+						}
+					} else {
+						for (std::uint32_t c = 0; c < node.nchild; c++) {
+							stack[top++] = node.child + c;
+						}
+					}
+				}
+
+				const std::uint32_t b = od[s];
+				ax[b / CHUNK].data[b % CHUNK] = r_x;
+				ay[b / CHUNK].data[b % CHUNK] = r_y;
+				az[b / CHUNK].data[b % CHUNK] = r_z;
+			}
+#ifdef ENABLE_PROFILING
+			wk[2 * (&leaf - nd)] = pairs;
+			wk[2 * (&leaf - nd) + 1] = cells;
+#endif
+		});
+	});
+
+#ifdef ENABLE_PROFILING
+	std::uint64_t pairs = 0;
+	std::uint64_t cells = 0;
+	for (std::size_t n = 0; n < this->octree.nodes.size(); n++) {
+		pairs += work[2 * n];
+		cells += work[2 * n + 1];
+	}
+	PROFILE_INTERACTIONS(this->profile, pairs, cells);
+#endif
+}
@@ -0,0 +1,277 @@
+
+#include <execution>
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.hh"
+#include "system.hh"
+
+namespace {
+constexpr char CHECKPOINT_MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P'};
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// Followed by the arrays (stride floats each), Level (stride bytes), and, with
+// has_ids, Id (stride uint32)
+struct CheckpointHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	std::uint64_t num_bodies;
+	std::uint64_t stride;
+	std::uint64_t seed;
+	float elapsed_time;
+	std::uint32_t chunk;
+	CheckpointSettings settings;
+	std::uint32_t has_ids;
+	std::uint32_t reserved;
+};
+
+bool write_all(int fd, const void *data, std::size_t bytes) {
+	const char *p = static_cast<const char *>(data);
+	while (bytes > 0) {
+		const ssize_t n = ::write(fd, p, bytes);
+		if (n <= 0) return false;
+		p += n;
+		bytes -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+bool read_all(int fd, void *data, std::size_t bytes) {
+	char *p = static_cast<char *>(data);
+	while (bytes > 0) {
+		const ssize_t n = ::read(fd, p, bytes);
+		if (n <= 0) return false;
+		p += n;
+		bytes -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+}; // namespace
+
+
+bool write_checkpoint(const std::string &path, const Checkpoint &ckpt) {
+
+	CheckpointHeader head{};
+	std::memcpy(head.magic, CHECKPOINT_MAGIC, sizeof(head.magic));
+	head.version = CHECKPOINT_VERSION;
+	head.byte_order = BYTE_ORDER_MARK;
+	head.num_bodies = static_cast<std::uint64_t>(ckpt.num_bodies);
+	head.stride = ckpt.arrays[0].size() * CHUNK;
+	head.seed = ckpt.seed;
+	head.elapsed_time = ckpt.elapsed_time;
+	head.chunk = static_cast<std::uint32_t>(CHUNK);
+	head.settings = ckpt.settings;
+	head.has_ids = !ckpt.Id.empty();
+
+	const std::string tmp = path + ".tmp";
+	const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	bool ok = write_all(fd, &head, sizeof(head));
+	for (std::size_t a = 0; ok && a < CHECKPOINT_ARRAYS; a++) {
+		ok = ckpt.arrays[a].size() * CHUNK == head.stride &&
+		     write_all(fd, ckpt.arrays[a].data(), head.stride * sizeof(float));
+	}
+	ok = ok && ckpt.Level.size() == head.stride &&
+	     write_all(fd, ckpt.Level.data(), ckpt.Level.size());
+	if (head.has_ids) {
+		ok = ok && ckpt.Id.size() == head.stride &&
+		     write_all(fd, ckpt.Id.data(), ckpt.Id.size() * sizeof(std::uint32_t));
+	}
+	ok = ok && ::fsync(fd) == 0;
+	ok = (::close(fd) == 0) && ok;
+	if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+bool read_checkpoint(const std::string &path, Checkpoint &ckpt) {
+
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	// The header must describe exactly the file, checked before anything is
+	// allocated, so a truncated or corrupt one is rejected rather than sized by
+	CheckpointHeader head;
+	struct stat st;
+	bool ok = ::fstat(fd, &st) == 0 && read_all(fd, &head, sizeof(head)) &&
+	          std::memcmp(head.magic, CHECKPOINT_MAGIC, sizeof(head.magic)) == 0 &&
+	          head.version == CHECKPOINT_VERSION && head.byte_order == BYTE_ORDER_MARK &&
+	          head.num_bodies <= static_cast<std::uint64_t>(std::numeric_limits<int>::max()) &&
+	          head.stride % CHUNK == 0 && head.stride >= head.num_bodies &&
+	          head.stride - head.num_bodies < CHUNK && head.has_ids <= 1;
+	if (ok) {
+		const std::uint64_t per_body = CHECKPOINT_ARRAYS * sizeof(float) + sizeof(std::uint8_t) +
+		                               head.has_ids * sizeof(std::uint32_t);
+		ok = static_cast<std::uint64_t>(st.st_size) == sizeof(head) + head.stride * per_body;
+	}
+	if (ok) {
+		ckpt.num_bodies = static_cast<int>(head.num_bodies);
+		ckpt.elapsed_time = head.elapsed_time;
+		ckpt.settings = head.settings;
+		ckpt.seed = head.seed;
+		for (std::size_t a = 0; ok && a < CHECKPOINT_ARRAYS; a++) {
+			ckpt.arrays[a].resize(head.stride / CHUNK);
+			ok = read_all(fd, ckpt.arrays[a].data(), head.stride * sizeof(float));
+		}
+		ckpt.Level.resize(head.stride);
+		ok = ok && read_all(fd, ckpt.Level.data(), ckpt.Level.size());
+		ckpt.Id.resize(head.has_ids ? head.stride : 0);
+		ok = ok && read_all(fd, ckpt.Id.data(), ckpt.Id.size() * sizeof(std::uint32_t));
+	}
+	::close(fd);
+	return ok;
+}
+
+
+void System::capture(Checkpoint &ckpt) const {
+
+	ckpt.num_bodies = this->num_bodies;
+	ckpt.elapsed_time = this->elapsed_time;
+	CheckpointSettings &s = ckpt.settings;
+	s.force_method = static_cast<std::int32_t>(this->force_method);
+	s.rsqrt_mode = static_cast<std::int32_t>(this->rsqrt_mode);
+	s.simd_level = static_cast<std::int32_t>(this->simd_level);
+	s.block_timesteps = this->block_timesteps;
+	s.max_level = this->max_level;
+	s.levels_assigned = this->levels_assigned;
+	s.step_accuracy = this->step_accuracy;
+	s.opening_angle = this->opening_angle;
+	s.leaf_size = this->leaf_size;
+	s.pm_grid = this->pm_grid;
+	s.fmm_order = this->fmm_order;
+	s.fmm_leaf_size = this->fmm_leaf_size;
+	s.fmm_theta = this->fmm_theta;
+	s.sort_interval = this->sort_interval;
+	s.sort_countdown = this->sort_countdown;
+	s.track_ids = this->track_ids;
+
+	const std::vector<SIMDVec> *arrays[CHECKPOINT_ARRAYS] = {
+		&this->PosX, &this->PosY, &this->PosZ, &this->VelX, &this->VelY,
+		&this->VelZ, &this->AccX, &this->AccY, &this->AccZ, &this->Mass};
+	std::array<std::size_t, CHECKPOINT_ARRAYS> index;
+	std::iota(std::begin(index), std::end(index), 0);
+	std::for_each(std::execution::par, std::begin(index), std::end(index), [&](std::size_t a) {
+		ckpt.arrays[a].assign(std::begin(*arrays[a]), std::end(*arrays[a]));
+	});
+	ckpt.Level = this->Level;
+	ckpt.Id = this->Id;
+	ckpt.seed = this->seed;
+}
+
+
+bool System::restore(const Checkpoint &ckpt) {
+
+	if (ckpt.num_bodies <= 0) return false;
+	const std::size_t chunks = (static_cast<std::size_t>(ckpt.num_bodies) + CHUNK - 1) / CHUNK;
+	for (const std::vector<SIMDVec> &a : ckpt.arrays) {
+		if (a.size() != chunks) return false;
+	}
+	if (ckpt.Level.size() != chunks * CHUNK) return false;
+	if (!ckpt.Id.empty() && ckpt.Id.size() != chunks * CHUNK) return false;
+
+	allocate(ckpt.num_bodies);
+	this->elapsed_time = ckpt.elapsed_time;
+	const CheckpointSettings &s = ckpt.settings;
+	this->force_method = static_cast<ForceMethod>(s.force_method);
+	this->rsqrt_mode = static_cast<RsqrtMode>(s.rsqrt_mode);
+	this->simd_level = static_cast<SimdLevel>(s.simd_level);
+	this->block_timesteps = s.block_timesteps != 0;
+	this->max_level = s.max_level;
+	this->step_accuracy = s.step_accuracy;
+	this->opening_angle = s.opening_angle;
+	this->leaf_size = s.leaf_size;
+	this->pm_grid = s.pm_grid;
+	this->fmm_order = s.fmm_order;
+	this->fmm_leaf_size = s.fmm_leaf_size;
+	this->fmm_theta = s.fmm_theta;
+	this->sort_interval = s.sort_interval;
+	this->track_ids = s.track_ids != 0;
+
+	std::vector<SIMDVec> *arrays[CHECKPOINT_ARRAYS] = {
+		&this->PosX, &this->PosY, &this->PosZ, &this->VelX, &this->VelY,
+		&this->VelZ, &this->AccX, &this->AccY, &this->AccZ, &this->Mass};
+	for (std::size_t a = 0; a < CHECKPOINT_ARRAYS; a++) *arrays[a] = ckpt.arrays[a];
+	this->Level = ckpt.Level;
+	this->Id = ckpt.Id;
+	this->levels_assigned = s.levels_assigned != 0;
+	this->sort_countdown = s.sort_countdown;
+	this->seed = ckpt.seed;
+	return true;
+}
+
+
+CheckpointWriter::CheckpointWriter(std::string path)
+	: path(std::move(path)) {
+	this->worker = std::thread(&CheckpointWriter::run, this);
+}
+
+
+CheckpointWriter::~CheckpointWriter() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->wake.notify_one();
+	this->worker.join();
+}
+
+
+bool CheckpointWriter::submit(const System &system) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (this->pending) return false;
+	}
+	// Only this thread touches the buffer while no write is pending
+	system.capture(this->buffer);
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->pending = true;
+	}
+	this->wake.notify_one();
+	return true;
+}
+
+
+bool CheckpointWriter::flush() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->done.wait(lock, [this] { return !this->pending; });
+	return this->last_ok;
+}
+
+
+std::uint64_t CheckpointWriter::written() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->num_written;
+}
+
+
+void CheckpointWriter::run() {
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while (true) {
+		this->wake.wait(lock, [this] { return this->stopping || this->pending; });
+		if (!this->pending) break;
+		lock.unlock();
+
+		const bool ok = write_checkpoint(this->path, this->buffer);
+
+		lock.lock();
+		this->last_ok = ok;
+		if (ok) this->num_written++;
+		this->pending = false;
+		this->done.notify_all();
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "simd_vec.hh"
+
+class System;
+
+// Every array of System's state, in this order in the checkpoint file
+constexpr std::size_t CHECKPOINT_ARRAYS = 10; // Pos, Vel, Acc (x, y, z), Mass
+constexpr std::uint32_t CHECKPOINT_VERSION = 3;
+
+// Simulation settings that change the trajectory, restored with the state
+struct CheckpointSettings {
+	std::int32_t force_method;
+	std::int32_t rsqrt_mode;
+	std::int32_t simd_level;
+	std::int32_t block_timesteps;
+	std::int32_t max_level;
+	std::int32_t levels_assigned;
+	float step_accuracy;
+	float opening_angle;
+	std::int32_t leaf_size;
+	std::int32_t pm_grid;
+	std::int32_t fmm_order;
+	std::int32_t fmm_leaf_size;
+	float fmm_theta;
+	std::int32_t sort_interval;
+	std::int32_t sort_countdown;
+	std::int32_t track_ids;
+	std::int32_t reserved;
+};
+
+// Complete state of a System, enough to continue a run bit for bit: the SoA
+// arrays (accelerations included, since the next step starts with a half
+// kick), block timestep levels, body IDs if any, settings, and the initial
+// condition seed
+struct Checkpoint {
+	int num_bodies{0};
+	float elapsed_time{0.0f};
+	CheckpointSettings settings{};
+	std::vector<SIMDVec> arrays[CHECKPOINT_ARRAYS];
+	std::vector<std::uint8_t> Level;
+	std::vector<std::uint32_t> Id; // Empty if the bodies are not numbered
+	std::uint64_t seed{0};
+};
+
+// Writes to <path>.tmp, syncs, then renames over path, so a crash during the
+// write leaves the previous checkpoint intact
+bool write_checkpoint(const std::string &path, const Checkpoint &ckpt);
+bool read_checkpoint(const std::string &path, Checkpoint &ckpt);
+
+// Checkpoints written by a background thread
+// submit() captures the state into the writer's buffer, a memory copy, and
+// returns while the file is written. A checkpoint is only taken when the
+// previous one is on disk; otherwise submit() returns false right away, so
+// the step loop never waits on the disk
+class CheckpointWriter {
+public:
+	explicit CheckpointWriter(std::string path);
+	CheckpointWriter(const CheckpointWriter &) = delete;
+	CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+	// Finishes a pending write, then stops the thread
+	~CheckpointWriter();
+	bool submit(const System &system);
+	// Wait until a pending checkpoint is on disk; false if it failed
+	bool flush();
+	std::uint64_t written() const;
+private:
+	void run();
+	std::string path;
+	Checkpoint buffer;
+	bool pending{false};
+	bool stopping{false};
+	bool last_ok{true};
+	std::uint64_t num_written{0};
+	mutable std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::thread worker;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11)
+// a sample is a pure function of (seed, stream, index): there is no state to
+// share between threads, so any body can be generated independently and the
+// result does not depend on the order or the number of threads
+
+using Philox4x32 = std::array<std::uint32_t, 4>;
+
+inline Philox4x32 philox4x32(Philox4x32 ctr, std::uint32_t k0, std::uint32_t k1) {
+  constexpr std::uint64_t M0 = 0xD2511F53;
+  constexpr std::uint64_t M1 = 0xCD9E8D57;
+  for (int round = 0; round < 10; round++) {
+    const std::uint64_t p0 = M0 * ctr[0];
+    const std::uint64_t p1 = M1 * ctr[2];
+    ctr = {static_cast<std::uint32_t>(p1 >> 32) ^ ctr[1] ^ k0, static_cast<std::uint32_t>(p1),
+           static_cast<std::uint32_t>(p0 >> 32) ^ ctr[3] ^ k1, static_cast<std::uint32_t>(p0)};
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+  return ctr;
+}
+
+// Four independent 32 bit words for sample `index` of `stream`; `draw` gives
+// further words for the same sample, e.g. for rejection sampling
+inline Philox4x32 random_words(std::uint64_t seed, std::uint32_t stream, std::uint64_t index,
+                               std::uint32_t draw = 0) {
+  return philox4x32({static_cast<std::uint32_t>(index), static_cast<std::uint32_t>(index >> 32),
+                     stream, draw},
+                    static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32));
+}
+
+// Uniform in [0, 1), from the top 24 bits
+inline float unit_float(std::uint32_t word) {
+  return static_cast<float>(word >> 8) * 0x1.0p-24f;
+}
+
+// Uniform in [-1, 1)
+inline float signed_unit_float(std::uint32_t word) {
+  return 2.0f * unit_float(word) - 1.0f;
+}
+
+// Standard normal from two words (Box-Muller)
+inline float normal_float(std::uint32_t w0, std::uint32_t w1) {
+  const float u = static_cast<float>((w0 >> 8) + 1) * 0x1.0p-24f; // (0, 1]
+  const float theta = 6.2831853f * unit_float(w1);
+  return std::sqrt(-2.0f * std::log(u)) * std::cos(theta);
+}
@@ -0,0 +1,179 @@
+
+#include <execution>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+
+#include "diagnostics.hh"
+#include "kernel_common.hh"
+
+double total_energy(const System &system) {
+
+	auto const *px = system.PosX.data();
+	auto const *py = system.PosY.data();
+	auto const *pz = system.PosZ.data();
+	auto const *vx = system.VelX.data();
+	auto const *vy = system.VelY.data();
+	auto const *vz = system.VelZ.data();
+	auto const *ms = system.Mass.data();
+
+	const std::size_t n = system.num_bodies;
+	return std::transform_reduce(std::execution::par_unseq, std::begin(system.Cidx),
+		std::end(system.Cidx), 0.0, std::plus<>(), [=](std::size_t i) {
+		double e = 0.0;
+		const std::size_t lanes = std::min(CHUNK, n - i * CHUNK);
+		for (std::size_t a = 0; a < lanes; a++) {
+			const double m = ms[i].data[a];
+			const double v2 = double(vx[i].data[a]) * vx[i].data[a] +
+			                  double(vy[i].data[a]) * vy[i].data[a] +
+			                  double(vz[i].data[a]) * vz[i].data[a];
+			e += 0.5 * m * v2;
+
+			// Each pair is seen from both sides, so take half of the potential
+			double phi = 0.0;
+			for (std::size_t b = 0; b < n; b++) {
+				if (b == i * CHUNK + a) continue;
+				const double dx = double(px[b / CHUNK].data[b % CHUNK]) - px[i].data[a];
+				const double dy = double(py[b / CHUNK].data[b % CHUNK]) - py[i].data[a];
+				const double dz = double(pz[b / CHUNK].data[b % CHUNK]) - pz[i].data[a];
+				phi -= ms[b / CHUNK].data[b % CHUNK] /
+				       std::sqrt(dx * dx + dy * dy + dz * dz + softening2);
+			}
+			e += 0.5 * m * phi;
+		}
+		return e;
+	});
+}
+
+
+namespace {
+// Timed force evaluations per mode, after an untimed one
+constexpr int FORCE_REPEATS = 5;
+
+// Mean and maximum relative acceleration error of trial against reference,
+// over the bodies with a nonzero reference acceleration
+void acceleration_error(const System &trial, const System &reference,
+                        double &mean_err, double &max_err) {
+	mean_err = 0.0;
+	max_err = 0.0;
+	std::size_t compared = 0;
+	for (std::size_t b = 0; b < static_cast<std::size_t>(reference.num_bodies); b++) {
+		const std::size_t i = b / CHUNK;
+		const std::size_t a = b % CHUNK;
+		const double rx = reference.AccX[i].data[a];
+		const double ry = reference.AccY[i].data[a];
+		const double rz = reference.AccZ[i].data[a];
+		const double ex = trial.AccX[i].data[a] - rx;
+		const double ey = trial.AccY[i].data[a] - ry;
+		const double ez = trial.AccZ[i].data[a] - rz;
+		const double norm = std::sqrt(rx * rx + ry * ry + rz * rz);
+		if (norm == 0.0) continue;
+		const double err = std::sqrt(ex * ex + ey * ey + ez * ez) / norm;
+		mean_err += err;
+		max_err = std::max(max_err, err);
+		compared++;
+	}
+	mean_err /= static_cast<double>(std::max<std::size_t>(compared, 1));
+}
+}; // namespace
+
+
+void report_rsqrt_modes(const System &system, int steps, float timestep,
+                        std::ostream &os) {
+
+	// Reference accelerations at the current positions, with the bodies in
+	// the order of every trial
+	System reference = system;
+	reference.rsqrt_mode = RsqrtMode::Exact;
+	reference.sort_interval = 0;
+	reference.update_forces();
+
+	os << "# rsqrt precision report: N = " << system.num_bodies
+	   << ", kernels = " << simd_level_name(system.simd_level)
+	   << ", " << steps << " steps of dt = " << timestep << "\n";
+	os << std::left << std::setw(12) << "mode"
+	   << std::right << std::setw(14) << "mean_rel_err"
+	   << std::setw(14) << "max_rel_err"
+	   << std::setw(14) << "force_ms"
+	   << std::setw(16) << "energy_drift" << "\n";
+
+	for (std::size_t m = 0; m < RSQRT_MODES; m++) {
+		System trial = system;
+		trial.rsqrt_mode = static_cast<RsqrtMode>(m);
+		trial.sort_interval = 0;
+		const double e0 = total_energy(trial);
+
+		// The force evaluation alone, once to warm up, then the mean of repeats
+		trial.update_forces();
+		const auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < FORCE_REPEATS; r++) trial.update_forces();
+		const auto t1 = std::chrono::steady_clock::now();
+
+		double mean_err, max_err;
+		acceleration_error(trial, reference, mean_err, max_err);
+
+		for (int s = 0; s < steps; s++) trial.advance(timestep);
+		const double e1 = total_energy(trial);
+
+		os << std::left << std::setw(12) << rsqrt_mode_name(trial.rsqrt_mode)
+		   << std::right << std::scientific << std::setprecision(3)
+		   << std::setw(14) << mean_err
+		   << std::setw(14) << max_err
+		   << std::fixed << std::setprecision(3)
+		   << std::setw(14) << std::chrono::duration<double, std::milli>(t1 - t0).count() / FORCE_REPEATS
+		   << std::scientific
+		   << std::setw(16) << std::abs((e1 - e0) / e0) << "\n";
+		os << std::defaultfloat;
+	}
+}
+
+
+void report_fmm_orders(const System &system, int max_order, std::ostream &os) {
+
+	// Exact direct sum, the same arithmetic as the scalar reference kernel
+	System reference = system;
+	reference.force_method = ForceMethod::DirectSum;
+	reference.rsqrt_mode = RsqrtMode::Exact;
+	reference.sort_interval = 0;
+	const auto t0 = std::chrono::steady_clock::now();
+	reference.update_forces();
+	const auto t1 = std::chrono::steady_clock::now();
+
+	os << "# FMM accuracy report: N = " << system.num_bodies
+	   << ", leaf size = " << system.fmm_leaf_size
+	   << ", theta = " << system.fmm_theta
+	   << ", direct sum " << std::fixed << std::setprecision(3)
+	   << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms\n";
+	os << std::defaultfloat;
+	os << std::left << std::setw(8) << "order"
+	   << std::right << std::setw(14) << "mean_rel_err"
+	   << std::setw(14) << "max_rel_err"
+	   << std::setw(14) << "force_ms" << "\n";
+
+	for (int order = 1; order <= std::min(max_order, FMM_MAX_ORDER); order++) {
+		System trial = system;
+		trial.force_method = ForceMethod::FastMultipole;
+		trial.rsqrt_mode = RsqrtMode::Exact;
+		trial.fmm_order = order;
+		trial.sort_interval = 0;
+
+		trial.update_forces();
+		const auto t2 = std::chrono::steady_clock::now();
+		for (int r = 0; r < FORCE_REPEATS; r++) trial.update_forces();
+		const auto t3 = std::chrono::steady_clock::now();
+
+		double mean_err, max_err;
+		acceleration_error(trial, reference, mean_err, max_err);
+
+		os << std::left << std::setw(8) << order
+		   << std::right << std::scientific << std::setprecision(3)
+		   << std::setw(14) << mean_err
+		   << std::setw(14) << max_err
+		   << std::fixed << std::setprecision(3)
+		   << std::setw(14) << std::chrono::duration<double, std::milli>(t3 - t2).count() / FORCE_REPEATS
+		   << "\n";
+		os << std::defaultfloat;
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <ostream>
+
+#include "system.hh"
+
+// Total (kinetic + potential) energy in double precision, O(N^2)
+double total_energy(const System &system);
+
+// Accuracy and throughput of every RsqrtMode with the current force method:
+// acceleration error against Exact, mean time of a force evaluation, and the
+// relative energy drift over `steps` steps, each run on a copy of system
+void report_rsqrt_modes(const System &system, int steps, float timestep,
+                        std::ostream &os);
+
+// Accuracy and cost of the fast multipole method for orders 1..max_order,
+// against the exact direct sum at the current positions
+void report_fmm_orders(const System &system, int max_order, std::ostream &os);
@@ -0,0 +1,44 @@
+
+#include <execution>
+#include <algorithm>
+
+#include "system.hh"
+
+// Fast multipole force evaluation on the Barnes-Hut octree
+// the expansions always cover every body, but only the target chunks are
+// evaluated at the leaves
+void System::accumulate_forces_FMM(const std::vector<std::size_t> &targets) {
+
+	this->octree.build(this->PosX.data(), this->PosY.data(), this->PosZ.data(),
+	                   this->Mass.data(), this->num_bodies,
+	                   static_cast<std::uint32_t>(this->fmm_leaf_size));
+
+	const bool all = (targets.size() == this->Cidx.size());
+	std::vector<std::uint8_t> active(all ? 0 : this->Cidx.size(), 0);
+	auto *ac = active.data();
+	if (!all) {
+		std::for_each(std::execution::par_unseq, std::begin(targets), std::end(targets),
+		              [=](std::size_t i) { ac[i] = 1; });
+	}
+
+	this->fmm.evaluate(this->octree, this->fmm_order, this->fmm_theta, this->rsqrt_mode,
+	                   all ? nullptr : ac);
+	PROFILE_INTERACTIONS(this->profile, this->fmm.pair_count, this->fmm.m2l_count);
+
+	// Back from sorted to body order
+	auto const *od = this->octree.order.data();
+	auto const *fx = this->fmm.AX.data();
+	auto const *fy = this->fmm.AY.data();
+	auto const *fz = this->fmm.AZ.data();
+	auto *ax = this->AccX.data();
+	auto *ay = this->AccY.data();
+	auto *az = this->AccZ.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->octree.order),
+	              std::end(this->octree.order), [=](const std::uint32_t &b) {
+		if (!all && !ac[b / CHUNK]) return;
+		const std::size_t s = &b - od;
+		ax[b / CHUNK].data[b % CHUNK] = fx[s];
+		ay[b / CHUNK].data[b % CHUNK] = fy[s];
+		az[b / CHUNK].data[b % CHUNK] = fz[s];
+	});
+}
@@ -0,0 +1,85 @@
+
+#include <execution>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+#include "fft.hh"
+
+void FFT::plan(std::size_t n) {
+
+	if (n == this->n) return;
+	this->n = n;
+
+	this->twiddle.resize(n / 2);
+	for (std::size_t k = 0; k < n / 2; k++) {
+		const double a = -2.0 * M_PI * static_cast<double>(k) / static_cast<double>(n);
+		this->twiddle[k] = std::complex<float>(std::cos(a), std::sin(a));
+	}
+
+	int bits = 0;
+	while ((std::size_t{1} << bits) < n) bits++;
+	this->bitrev.resize(n);
+	for (std::size_t i = 0; i < n; i++) {
+		std::uint32_t r = 0;
+		for (int b = 0; b < bits; b++) {
+			r |= ((i >> b) & 1u) << (bits - 1 - b);
+		}
+		this->bitrev[i] = r;
+	}
+}
+
+
+// Iterative decimation-in-time transform of one contiguous line
+// the inverse is unscaled
+void FFT::transform_line(std::complex<float> *line, bool inverse) const {
+
+	const std::size_t n = this->n;
+	for (std::size_t i = 0; i < n; i++) {
+		const std::size_t r = this->bitrev[i];
+		if (i < r) std::swap(line[i], line[r]);
+	}
+
+	for (std::size_t len = 2; len <= n; len <<= 1) {
+		const std::size_t half = len / 2;
+		const std::size_t stride = n / len;
+		for (std::size_t s = 0; s < n; s += len) {
+			for (std::size_t k = 0; k < half; k++) {
+				std::complex<float> w = this->twiddle[k * stride];
+				if (inverse) w = std::conj(w);
+				const std::complex<float> a = line[s + k];
+				const std::complex<float> b = line[s + k + half] * w;
+				line[s + k] = a + b;
+				line[s + k + half] = a - b;
+			}
+		}
+	}
+}
+
+
+void FFT::transform_axis(std::complex<float> *data, int axis, bool inverse,
+                         std::size_t lim_u, std::size_t lim_v) const {
+
+	const std::size_t n = this->n;
+	// Strides of the transformed axis and of the two line coordinates
+	const std::size_t strides[3] = {1, n, n * n};
+	const std::size_t s = strides[axis];
+	const std::size_t su = strides[axis == 0 ? 1 : 0];
+	const std::size_t sv = strides[axis == 2 ? 1 : 2];
+
+	std::vector<std::size_t> lines(lim_u * lim_v);
+	std::iota(std::begin(lines), std::end(lines), 0);
+
+	std::for_each(std::execution::par_unseq, std::begin(lines),
+									std::end(lines), [=, this](std::size_t l) {
+		std::complex<float> *base = data + (l % lim_u) * su + (l / lim_u) * sv;
+		if (s == 1) {
+			transform_line(base, inverse);
+			return;
+		}
+		std::complex<float> buf[MAX_SIZE];
+		for (std::size_t k = 0; k < n; k++) buf[k] = base[k * s];
+		transform_line(buf, inverse);
+		for (std::size_t k = 0; k < n; k++) base[k * s] = buf[k];
+	});
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+// Radix-2 complex FFT on cubic n^3 grids (x fastest, then y, then z)
+// lines along an axis are transformed in parallel; a line set can be limited
+// to the lines whose other two coordinates lie below given bounds, so that
+// the zero-padded parts of a grid can be skipped
+class FFT {
+public:
+	FFT() = default;
+	void plan(std::size_t n); // n must be a power of two
+	std::size_t size() const { return n; }
+	// Transform along axis (0 = x, 1 = y, 2 = z); lines are selected by their
+	// remaining coordinates (u, v) in axis order, u < lim_u and v < lim_v
+	void transform_axis(std::complex<float> *data, int axis, bool inverse,
+	                    std::size_t lim_u, std::size_t lim_v) const;
+	static constexpr std::size_t MAX_SIZE = 1024;
+private:
+	void transform_line(std::complex<float> *line, bool inverse) const;
+	std::size_t n{0};
+	std::vector<std::complex<float>> twiddle; // exp(-2 pi i k / n), k < n/2
+	std::vector<std::uint32_t> bitrev;
+};
@@ -0,0 +1,380 @@
+
+#include <execution>
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <cmath>
+
+#include "fmm.hh"
+#include "kernel_common.hh"
+
+namespace {
+// Multi-indices up to degree FMM_MAX_ORDER
+constexpr std::size_t MAX_COEF = (FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) *
+                                 (FMM_MAX_ORDER + 3) / 6;
+
+// Number of multi-indices with |n| <= d
+std::size_t terms_up_to(int d) {
+	return static_cast<std::size_t>((d + 1) * (d + 2) * (d + 3) / 6);
+}
+
+// Pair of cells far enough apart for an M2L, given the radii of the
+// spheres about their expansion centers that hold all of their bodies
+bool well_separated(const OctreeNode &a, float ra, const OctreeNode &b, float rb,
+                    float theta) {
+	const float dx = a.com_x - b.com_x;
+	const float dy = a.com_y - b.com_y;
+	const float dz = a.com_z - b.com_z;
+	const float r = ra + rb;
+	return r * r < theta * theta * (dx * dx + dy * dy + dz * dz);
+}
+}; // namespace
+
+
+void FmmPlan::build(int order) {
+
+	if (order == this->order) return;
+	this->order = order;
+	const int P = order;
+	this->ncoef = terms_up_to(order);
+
+	// Numbering by degree, then t and u descending
+	std::vector<int> table((P + 1) * (P + 1) * (P + 1), -1);
+	std::vector<std::array<int, 3>> n;
+	for (int d = 0; d <= P; d++) {
+		for (int t = d; t >= 0; t--) {
+			for (int u = d - t; u >= 0; u--) {
+				table[(t * (P + 1) + u) * (P + 1) + (d - t - u)] = static_cast<int>(n.size());
+				n.push_back({t, u, d - t - u});
+			}
+		}
+	}
+	const auto index = [&](int t, int u, int v) {
+		return table[(t * (P + 1) + u) * (P + 1) + v];
+	};
+
+	this->axis.assign(this->ncoef, 0);
+	this->count.assign(this->ncoef, 0);
+	this->prev1.assign(this->ncoef, -1);
+	this->prev2.assign(this->ncoef, -1);
+	for (std::size_t i = 1; i < this->ncoef; i++) {
+		const int k = n[i][0] > 0 ? 0 : (n[i][1] > 0 ? 1 : 2);
+		std::array<int, 3> m = n[i];
+		this->axis[i] = static_cast<std::uint8_t>(k);
+		this->count[i] = static_cast<std::uint8_t>(m[k]);
+		m[k] -= 1;
+		this->prev1[i] = index(m[0], m[1], m[2]);
+		if (m[k] > 0) {
+			m[k] -= 1;
+			this->prev2[i] = index(m[0], m[1], m[2]);
+		}
+	}
+
+	const auto degree = [&](std::size_t i) { return n[i][0] + n[i][1] + n[i][2]; };
+	this->m2m.clear();
+	this->m2l.clear();
+	this->l2l.clear();
+	this->l2p.clear();
+	for (std::size_t a = 0; a < this->ncoef; a++) {
+		for (std::size_t b = 0; b < this->ncoef; b++) {
+			const int dt = n[a][0] - n[b][0];
+			const int du = n[a][1] - n[b][1];
+			const int dv = n[a][2] - n[b][2];
+			if (dt >= 0 && du >= 0 && dv >= 0) {
+				this->m2m.push_back({std::uint32_t(a), std::uint32_t(b), std::uint32_t(index(dt, du, dv))});
+			}
+			if (dt <= 0 && du <= 0 && dv <= 0) {
+				this->l2l.push_back({std::uint32_t(a), std::uint32_t(b), std::uint32_t(index(-dt, -du, -dv))});
+			}
+			if (degree(a) + degree(b) <= order) {
+				this->m2l.push_back({std::uint32_t(a), std::uint32_t(b),
+					std::uint32_t(index(n[a][0] + n[b][0], n[a][1] + n[b][1], n[a][2] + n[b][2]))});
+			}
+		}
+	}
+	for (std::uint32_t k = 0; k < 3; k++) {
+		for (std::size_t c = 0; c < terms_up_to(order - 1); c++) {
+			std::array<int, 3> m = n[c];
+			m[k] += 1;
+			this->l2p.push_back({k, std::uint32_t(index(m[0], m[1], m[2])), std::uint32_t(c)});
+		}
+	}
+}
+
+
+void FmmPlan::monomials(double x, double y, double z, double *out) const {
+	const double xyz[3] = {x, y, z};
+	out[0] = 1.0;
+	for (std::size_t i = 1; i < this->ncoef; i++) {
+		out[i] = out[this->prev1[i]] * xyz[this->axis[i]] / this->count[i];
+	}
+}
+
+
+// Hermite recurrence: with f_n = (1/r d/dr)^n (1/r) = (-1)^n (2n-1)!! / r^(2n+1),
+// R^n_000 = f_n and R^n_(m+e_k) = m_k R^(n+1)_(m-e_k) + x_k R^(n+1)_m,
+// so D_m = R^0_m is built from degree p down to 0
+void FmmPlan::derivatives(double x, double y, double z, double *out) const {
+	const int P = this->order;
+	const double xyz[3] = {x, y, z};
+	const double inv_r2 = 1.0 / (x * x + y * y + z * z);
+
+	double f[FMM_MAX_ORDER + 1];
+	f[0] = std::sqrt(inv_r2);
+	for (int k = 0; k < P; k++) f[k + 1] = -(2 * k + 1) * f[k] * inv_r2;
+
+	double buf[MAX_COEF];
+	double *cur = (P % 2 == 0) ? out : buf;
+	double *next = (P % 2 == 0) ? buf : out;
+	cur[0] = f[P];
+	for (int level = P - 1; level >= 0; level--) {
+		std::swap(cur, next);
+		cur[0] = f[level];
+		const std::size_t end = terms_up_to(P - level);
+		for (std::size_t i = 1; i < end; i++) {
+			double r = xyz[this->axis[i]] * next[this->prev1[i]];
+			if (this->prev2[i] >= 0) r += (this->count[i] - 1) * next[this->prev2[i]];
+			cur[i] = r;
+		}
+	}
+}
+
+
+void Fmm::evaluate(const Octree &tree, int order, float theta, RsqrtMode mode,
+                   const std::uint8_t *active_chunks) {
+
+	this->plan.build(std::clamp(order, 1, FMM_MAX_ORDER));
+
+	const std::size_t nodes = tree.nodes.size();
+	const std::size_t ncoef = this->plan.ncoef;
+	this->multipoles.assign(nodes * ncoef, 0.0);
+	this->locals.assign(nodes * ncoef, 0.0);
+	this->radius.resize(nodes);
+	this->near.resize(nodes);
+	this->AX.resize(tree.X.size());
+	this->AY.resize(tree.X.size());
+	this->AZ.resize(tree.X.size());
+
+#ifdef ENABLE_PROFILING
+	this->work.assign(2 * nodes, 0);
+#endif
+
+	upward(tree);
+	downward(tree, theta);
+	leaves(tree, theta, mode, active_chunks);
+
+#ifdef ENABLE_PROFILING
+	this->pair_count = 0;
+	this->m2l_count = 0;
+	for (std::size_t n = 0; n < nodes; n++) {
+		this->pair_count += this->work[2 * n];
+		this->m2l_count += this->work[2 * n + 1];
+	}
+#endif
+}
+
+
+// P2M at the leaves and M2M into every parent, deepest level first;
+// expansions are about the centers of mass, so a cell dominated by one heavy
+// body stays close to a monopole, and each cell records the radius about its
+// center that holds all of its bodies
+void Fmm::upward(const Octree &tree) {
+
+	const FmmPlan *plan = &this->plan;
+	const std::size_t ncoef = plan->ncoef;
+	const OctreeNode *nd = tree.nodes.data();
+	auto const *sx = tree.X.data();
+	auto const *sy = tree.Y.data();
+	auto const *sz = tree.Z.data();
+	auto const *sm = tree.M.data();
+	double *mp = this->multipoles.data();
+	float *rad = this->radius.data();
+
+	for (std::size_t level = tree.level_offset.size() - 1; level-- > 0;) {
+		std::for_each(std::execution::par_unseq,
+			std::begin(tree.nodes) + tree.level_offset[level],
+			std::begin(tree.nodes) + tree.level_offset[level + 1], [=](const OctreeNode &node) {
+			const std::size_t n = &node - nd;
+			double *m = mp + n * ncoef;
+			double mono[MAX_COEF];
+			if (node.nchild == 0) {
+				double r2 = 0.0;
+				for (std::uint32_t s = node.first; s < node.first + node.count; s++) {
+					const double dx = double(node.com_x) - sx[s];
+					const double dy = double(node.com_y) - sy[s];
+					const double dz = double(node.com_z) - sz[s];
+					plan->monomials(dx, dy, dz, mono);
+					for (std::size_t a = 0; a < ncoef; a++) m[a] += sm[s] * mono[a];
+					r2 = std::max(r2, dx * dx + dy * dy + dz * dz);
+				}
+				rad[n] = static_cast<float>(std::sqrt(r2));
+				return;
+			}
+			double r = 0.0;
+			for (std::uint32_t c = node.child; c < node.child + node.nchild; c++) {
+				const double dx = double(node.com_x) - nd[c].com_x;
+				const double dy = double(node.com_y) - nd[c].com_y;
+				const double dz = double(node.com_z) - nd[c].com_z;
+				plan->monomials(dx, dy, dz, mono);
+				const double *mc = mp + c * ncoef;
+				for (const FmmPlan::Term &t : plan->m2m) m[t.a] += mc[t.b] * mono[t.c];
+				r = std::max(r, std::sqrt(dx * dx + dy * dy + dz * dz) + rad[c]);
+			}
+			rad[n] = static_cast<float>(r);
+		});
+	}
+}
+
+
+namespace {
+// L[target] += M2L of the multipole of source
+void m2l(const FmmPlan &plan, const OctreeNode &target, const OctreeNode &source,
+         const double *m, double *l) {
+	double d[MAX_COEF];
+	plan.derivatives(double(target.com_x) - source.com_x, double(target.com_y) - source.com_y,
+	                 double(target.com_z) - source.com_z, d);
+	for (const FmmPlan::Term &t : plan.m2l) l[t.a] -= m[t.b] * d[t.c];
+}
+}; // namespace
+
+
+// Top-down: every node of a level hands its children their near lists, their
+// M2L contributions, and its own local expansion shifted to their centers
+void Fmm::downward(const Octree &tree, float theta) {
+
+	const FmmPlan *plan = &this->plan;
+	const std::size_t ncoef = plan->ncoef;
+	const OctreeNode *nd = tree.nodes.data();
+	const double *mp = this->multipoles.data();
+	const float *rad = this->radius.data();
+	double *lc = this->locals.data();
+	auto *nr = this->near.data();
+	[[maybe_unused]] std::uint64_t *wk = this->work.data();
+
+	nr[0].assign(1, 0);
+	for (std::size_t level = 0; level + 1 < tree.level_offset.size(); level++) {
+		std::for_each(std::execution::par,
+			std::begin(tree.nodes) + tree.level_offset[level],
+			std::begin(tree.nodes) + tree.level_offset[level + 1], [=](const OctreeNode &node) {
+			if (node.nchild == 0) return;
+			const std::size_t p = &node - nd;
+			double shift[MAX_COEF];
+			for (std::uint32_t c = node.child; c < node.child + node.nchild; c++) {
+				const OctreeNode &kid = nd[c];
+				double *l = lc + c * ncoef;
+
+				// Leaves in the parent's near field stay candidates as they are
+				nr[c].clear();
+				for (std::uint32_t s : nr[p]) {
+					const std::uint32_t first = nd[s].nchild ? nd[s].child : s;
+					const std::uint32_t last = nd[s].nchild ? nd[s].child + nd[s].nchild : s + 1;
+					for (std::uint32_t q = first; q < last; q++) {
+						if (well_separated(kid, rad[c], nd[q], rad[q], theta)) {
+							m2l(*plan, kid, nd[q], mp + q * ncoef, l);
+#ifdef ENABLE_PROFILING
+							wk[2 * c + 1]++;
+#endif
+						} else {
+							nr[c].push_back(q);
+						}
+					}
+				}
+
+				plan->monomials(double(kid.com_x) - node.com_x, double(kid.com_y) - node.com_y,
+				                double(kid.com_z) - node.com_z, shift);
+				const double *lp = lc + p * ncoef;
+				for (const FmmPlan::Term &t : plan->l2l) l[t.a] += lp[t.b] * shift[t.c];
+			}
+			nr[p].clear();
+			nr[p].shrink_to_fit();
+		});
+	}
+}
+
+
+// Leaves resolve what is left of their near field: cells that become well
+// separated further down are added to the local expansion, leaves are
+// summed directly; then L2P and P2P for each body
+void Fmm::leaves(const Octree &tree, float theta, RsqrtMode mode,
+                 const std::uint8_t *active_chunks) {
+
+	const FmmPlan *plan = &this->plan;
+	const std::size_t ncoef = plan->ncoef;
+	const OctreeNode *nd = tree.nodes.data();
+	const double *mp = this->multipoles.data();
+	const float *rad = this->radius.data();
+	const double *lc = this->locals.data();
+	const auto *nr = this->near.data();
+	auto const *od = tree.order.data();
+	auto const *sx = tree.X.data();
+	auto const *sy = tree.Y.data();
+	auto const *sz = tree.Z.data();
+	auto const *sm = tree.M.data();
+	float *ax = this->AX.data();
+	float *ay = this->AY.data();
+	float *az = this->AZ.data();
+	[[maybe_unused]] std::uint64_t *wk = this->work.data();
+
+	dispatch_rsqrt_mode(mode, [&](auto mode) {
+		std::for_each(std::execution::par, std::begin(tree.nodes),
+										std::end(tree.nodes), [=](const OctreeNode &leaf) {
+			if (leaf.nchild != 0) return;
+			const std::size_t t = &leaf - nd;
+
+			double l[MAX_COEF];
+			std::copy(lc + t * ncoef, lc + (t + 1) * ncoef, l);
+			std::vector<std::uint32_t> direct;
+			std::vector<std::uint32_t> stack(std::begin(nr[t]), std::end(nr[t]));
+			while (!stack.empty()) {
+				const std::uint32_t s = stack.back();
+				stack.pop_back();
+				if (well_separated(leaf, rad[t], nd[s], rad[s], theta)) {
+					m2l(*plan, leaf, nd[s], mp + s * ncoef, l);
+#ifdef ENABLE_PROFILING
+					wk[2 * t + 1]++;
+#endif
+				} else if (nd[s].nchild == 0) {
+					direct.push_back(s);
+				} else {
+					for (std::uint32_t c = nd[s].child; c < nd[s].child + nd[s].nchild; c++) {
+						stack.push_back(c);
+					}
+				}
+			}
+
+			double e[MAX_COEF];
+			for (std::uint32_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+				if (active_chunks && !active_chunks[od[i] / CHUNK]) continue;
+
+				plan->monomials(double(sx[i]) - leaf.com_x, double(sy[i]) - leaf.com_y,
+				                double(sz[i]) - leaf.com_z, e);
+				double acc[3] = {0.0, 0.0, 0.0};
+				for (const FmmPlan::Term &term : plan->l2p) acc[term.a] -= l[term.b] * e[term.c];
+
+				float r_x = 0.0f;
+				float r_y = 0.0f;
+				float r_z = 0.0f;
+#ifdef ENABLE_PROFILING
+				for (std::uint32_t s : direct) wk[2 * t] += nd[s].count;
+#endif
+				for (std::uint32_t s : direct) {
+					for (std::uint32_t j = nd[s].first; j < nd[s].first + nd[s].count; j++) {
+						float dx = sx[j] - sx[i];
+						float dy = sy[j] - sy[i];
+						float dz = sz[j] - sz[i];
+						float d2 = dx * dx + dy * dy + dz * dz;
+						      d2 += softening2;
+						float inv = inv_sqrt<decltype(mode)::value>(d2);
+						float imp = sm[j] * inv * inv * inv;
+						r_x += dx * imp;
+						r_y += dy * imp;
+						r_z += dz * imp;
+					}
+				}
+				ax[i] = static_cast<float>(acc[0]) + r_x;
+				ay[i] = static_cast<float>(acc[1]) + r_y;
+				az[i] = static_cast<float>(acc[2]) + r_z;
+			}
+		});
+	});
+}
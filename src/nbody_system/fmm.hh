@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "octree.hh"
+#include "force_kernels.hh"
+
+// Highest supported expansion order
+constexpr int FMM_MAX_ORDER = 10;
+
+// Multi-index tables and operator term lists for Cartesian Taylor expansions
+// of order p. Multi-indices n = (t, u, v) with |n| <= p are numbered by
+// degree, so those of degree <= d always come first. M2L keeps only terms
+// with |a| + |b| <= p, so derivatives of 1/r are needed up to degree p; they
+// are built with the McMurchie-Davidson (Hermite) recurrence
+struct FmmPlan {
+	struct Term {
+		std::uint32_t a, b, c;
+	};
+	int order{-1};
+	std::size_t ncoef{0}; // Multi-indices with |n| <= p
+	std::vector<std::uint8_t> axis;  // First nonzero component of n
+	std::vector<std::uint8_t> count; // Value of that component
+	std::vector<std::int32_t> prev1; // Index of n - e_axis
+	std::vector<std::int32_t> prev2; // Index of n - 2 e_axis, or -1
+	std::vector<Term> m2m; // M[a] += M_child[b] t^c / c!, c = a - b
+	std::vector<Term> m2l; // L[a] -= M[b] D[c],          c = a + b
+	std::vector<Term> l2l; // L_child[a] += L[b] s^c / c!, c = b - a
+	std::vector<Term> l2p; // acc[a] -= L[b] e^c / c!,     b = c + e_a
+	void build(int order);
+	// x^n / n! for every |n| <= p
+	void monomials(double x, double y, double z, double *out) const;
+	// d^n (1/r) / dx^n at (x, y, z) for every |n| <= p
+	void derivatives(double x, double y, double z, double *out) const;
+};
+
+// Fast multipole evaluation over an Octree
+// multipoles (P2M, M2M) are built bottom-up and local expansions (M2L, L2L)
+// top-down, one level at a time with the nodes of a level in parallel. Each
+// node's interaction list comes from the near list of its parent: a cell
+// pair is well separated when (r_a + r_b) < theta * distance, with r the
+// radius of the cell about its center of mass. Leaves finish with L2P and
+// the direct (P2P) sum over the leaves in their near field
+class Fmm {
+public:
+	Fmm() = default;
+	// Accelerations in sorted body order; when active_chunks is given, only
+	// bodies of chunks marked there are evaluated
+	void evaluate(const Octree &tree, int order, float theta, RsqrtMode mode,
+	              const std::uint8_t *active_chunks);
+	std::vector<float> AX;
+	std::vector<float> AY;
+	std::vector<float> AZ;
+	std::uint64_t pair_count{0}; // P2P and M2L operations of the last evaluation,
+	std::uint64_t m2l_count{0};  // counted when built with ENABLE_PROFILING
+private:
+	FmmPlan plan;
+	std::vector<double> multipoles; // ncoef per node
+	std::vector<double> locals;
+	std::vector<float> radius; // Bounding radius of each node about its center of mass
+	std::vector<std::vector<std::uint32_t>> near; // Cells not well separated from each node
+	std::vector<std::uint64_t> work; // P2P pairs and M2L count per node
+	void upward(const Octree &tree);
+	void downward(const Octree &tree, float theta);
+	void leaves(const Octree &tree, float theta, RsqrtMode mode,
+	            const std::uint8_t *active_chunks);
+};
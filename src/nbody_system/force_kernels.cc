@@ -0,0 +1,110 @@
+
+#include "force_kernels.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Kernel tables, one per instruction-set translation unit that was built
+extern const ForceKernels scalar_force_kernels;
+#ifdef ENABLE_SSE_KERNELS
+extern const ForceKernels sse_force_kernels;
+#endif
+#ifdef ENABLE_AVX2_KERNELS
+extern const ForceKernels avx2_force_kernels;
+#endif
+#ifdef ENABLE_AVX512_KERNELS
+extern const ForceKernels avx512_force_kernels;
+#endif
+
+namespace {
+#if defined(__x86_64__) || defined(__i386__)
+// Register state the OS saves on context switch (XCR0)
+unsigned long long xgetbv0() {
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (static_cast<unsigned long long>(edx) << 32) | eax;
+}
+
+// Query cpuid for the widest level usable by the running CPU and OS
+SimdLevel cpu_simd_level() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return SimdLevel::Scalar;
+
+	const bool sse2 = edx & bit_SSE2;
+	const bool osxsave = ecx & bit_OSXSAVE;
+	const bool avx = ecx & bit_AVX;
+	const bool fma = ecx & bit_FMA;
+	if (!sse2) return SimdLevel::Scalar;
+	if (!(osxsave && avx)) return SimdLevel::SSE;
+
+	// The OS must save the ymm (and for AVX-512, the opmask and zmm) state
+	const unsigned long long xcr0 = xgetbv0();
+	if ((xcr0 & 0x6) != 0x6) return SimdLevel::SSE;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return SimdLevel::SSE;
+	const bool avx2 = ebx & bit_AVX2;
+	const bool avx512f = ebx & bit_AVX512F;
+
+	if (avx512f && (xcr0 & 0xe6) == 0xe6) return SimdLevel::AVX512;
+	if (avx2 && fma) return SimdLevel::AVX2;
+	return SimdLevel::SSE;
+}
+#else
+SimdLevel cpu_simd_level() { return SimdLevel::Scalar; }
+#endif
+}; // namespace
+
+
+SimdLevel detect_simd_level() {
+	return get_force_kernels(SimdLevel::AVX512).level;
+}
+
+
+const ForceKernels &get_force_kernels(SimdLevel level) {
+	static const SimdLevel cpu = cpu_simd_level();
+	if (level > cpu) level = cpu;
+
+	switch (level) {
+	case SimdLevel::AVX512:
+#ifdef ENABLE_AVX512_KERNELS
+		return avx512_force_kernels;
+#endif
+		[[fallthrough]];
+	case SimdLevel::AVX2:
+#ifdef ENABLE_AVX2_KERNELS
+		return avx2_force_kernels;
+#endif
+		[[fallthrough]];
+	case SimdLevel::SSE:
+#ifdef ENABLE_SSE_KERNELS
+		return sse_force_kernels;
+#endif
+		[[fallthrough]];
+	case SimdLevel::Scalar:
+	default:
+		return scalar_force_kernels;
+	}
+}
+
+
+const char *simd_level_name(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::AVX512: return "AVX-512";
+	case SimdLevel::AVX2: return "AVX2";
+	case SimdLevel::SSE: return "SSE";
+	case SimdLevel::Scalar:
+	default: return "Scalar";
+	}
+}
+
+
+const char *rsqrt_mode_name(RsqrtMode mode) {
+	switch (mode) {
+	case RsqrtMode::Raw: return "Raw";
+	case RsqrtMode::Newton1: return "Newton x1";
+	case RsqrtMode::Newton2: return "Newton x2";
+	case RsqrtMode::Exact:
+	default: return "Exact";
+	}
+}
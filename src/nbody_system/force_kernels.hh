@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+
+// Instruction sets with a direct-sum kernel, ordered from narrowest to widest
+enum class SimdLevel {
+	Scalar,
+	SSE,    // 4 lanes
+	AVX2,   // 8 lanes
+	AVX512, // 16 lanes
+};
+
+// Precision of the reciprocal square root in the force kernels
+enum class RsqrtMode {
+	Raw,     // Hardware estimate (12 bits, 14 bits on AVX-512)
+	Newton1, // Estimate plus one Newton-Raphson step
+	Newton2, // Estimate plus two Newton-Raphson steps
+	Exact,   // 1 / sqrt(x)
+};
+constexpr std::size_t RSQRT_MODES = 4;
+
+// Flat views of the SoA arrays (CHUNK floats per SIMDVec, no padding)
+struct ForceData {
+	const float *x;
+	const float *y;
+	const float *z;
+	const float *m;
+	float *ax;
+	float *ay;
+	float *az;
+};
+
+using RangeKernel = void (*)(const ForceData &d, std::size_t i_begin, std::size_t i_end,
+                             std::size_t j_begin, std::size_t j_end);
+
+// Kernel table for one instruction set, indexed by RsqrtMode
+// body ranges start on a chunk and both kernels add into the accelerations.
+// accumulate takes any range end: the last i-vector is masked, so bodies past
+// i_end are neither read nor written. symmetric needs whole chunks
+struct ForceKernels {
+	SimdLevel level;
+	const char *name;
+	// Accelerations of bodies [i_begin, i_end) due to bodies [j_begin, j_end)
+	RangeKernel accumulate[RSQRT_MODES];
+	// Pairs between [i_begin, i_end) and [j_begin, j_end) applied to both sides,
+	// or every pair within the range once when i_begin == j_begin
+	RangeKernel symmetric[RSQRT_MODES];
+};
+
+// Widest instruction set supported by both this build and the running CPU
+SimdLevel detect_simd_level();
+
+// Kernels for the requested level, or the widest available level below it
+const ForceKernels &get_force_kernels(SimdLevel level);
+
+const char *simd_level_name(SimdLevel level);
+const char *rsqrt_mode_name(RsqrtMode mode);
@@ -0,0 +1,49 @@
+
+#include <cmath>
+#include <immintrin.h>
+
+#include "force_kernels.hh"
+#include "kernel_common.hh"
+#include "simd_vec.hh"
+
+namespace {
+struct Avx2Ops {
+	using V = __m256;
+	static constexpr std::size_t W = 8;
+	static constexpr std::size_t REG_BLOCK = 2;
+	static constexpr std::size_t SYM_ROTATIONS = W;
+	static V load(const float *p) { return _mm256_load_ps(p); }
+	static void store(float *p, V v) { _mm256_store_ps(p, v); }
+	static __m256i lane_mask(std::size_t n) {
+		return _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(n)),
+		                          _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	}
+	static V load_partial(const float *p, std::size_t n) {
+		return _mm256_maskload_ps(p, lane_mask(n));
+	}
+	static void store_partial(float *p, V v, std::size_t n) {
+		_mm256_maskstore_ps(p, lane_mask(n), v);
+	}
+	static V set1(float a) { return _mm256_set1_ps(a); }
+	static V zero() { return _mm256_setzero_ps(); }
+	static V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+	static V rsqrt(V a) { return _mm256_rsqrt_ps(a); }
+	static float first(V v) { return _mm256_cvtss_f32(v); }
+	static V rotate_by(V v, std::size_t r) {
+		const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i idx = _mm256_and_si256(
+			_mm256_add_epi32(lanes, _mm256_set1_epi32(static_cast<int>(r))),
+			_mm256_set1_epi32(W - 1));
+		return _mm256_permutevar8x32_ps(v, idx);
+	}
+};
+
+#include "force_kernels_impl.hh"
+}; // namespace
+
+extern const ForceKernels avx2_force_kernels =
+	make_force_kernels<Avx2Ops>(SimdLevel::AVX2, "AVX2");
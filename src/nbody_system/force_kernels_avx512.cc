@@ -0,0 +1,52 @@
+
+#include <cmath>
+#include <immintrin.h>
+
+#include "force_kernels.hh"
+#include "kernel_common.hh"
+#include "simd_vec.hh"
+
+namespace {
+struct Avx512Ops {
+	using V = __m512;
+	static constexpr std::size_t W = 16;
+	static constexpr std::size_t REG_BLOCK = 2;
+	// All 16 rotations and their sums would spill out of the 32 registers
+	static constexpr std::size_t SYM_ROTATIONS = 4;
+	static V load(const float *p) { return _mm512_load_ps(p); }
+	static void store(float *p, V v) { _mm512_store_ps(p, v); }
+	static V load_partial(const float *p, std::size_t n) {
+		return _mm512_maskz_loadu_ps(static_cast<__mmask16>((1u << n) - 1), p);
+	}
+	static void store_partial(float *p, V v, std::size_t n) {
+		_mm512_mask_storeu_ps(p, static_cast<__mmask16>((1u << n) - 1), v);
+	}
+	static V set1(float a) { return _mm512_set1_ps(a); }
+	static V zero() { return _mm512_setzero_ps(); }
+	static V add(V a, V b) { return _mm512_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm512_div_ps(a, b); }
+	// The unmasked sqrt, rsqrt14 and permutexvar pass _mm512_undefined_ps()
+	// through, which GCC 12 warns about as uninitialized wherever they are
+	// inlined; with every lane selected the masked forms are the same
+	// instructions
+	static constexpr __mmask16 ALL = 0xffff;
+	static V sqrt(V a) { return _mm512_mask_sqrt_ps(a, ALL, a); }
+	static V rsqrt(V a) { return _mm512_mask_rsqrt14_ps(a, ALL, a); }
+	static float first(V v) { return _mm512_cvtss_f32(v); }
+	static V rotate_by(V v, std::size_t r) {
+		const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+		                                        8, 9, 10, 11, 12, 13, 14, 15);
+		const __m512i idx = _mm512_and_si512(
+			_mm512_add_epi32(lanes, _mm512_set1_epi32(static_cast<int>(r))),
+			_mm512_set1_epi32(W - 1));
+		return _mm512_mask_permutexvar_ps(v, ALL, idx, v);
+	}
+};
+
+#include "force_kernels_impl.hh"
+}; // namespace
+
+extern const ForceKernels avx512_force_kernels =
+	make_force_kernels<Avx512Ops>(SimdLevel::AVX512, "AVX-512");
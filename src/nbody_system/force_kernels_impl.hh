@@ -0,0 +1,251 @@
+#pragma once
+
+// Direct-sum kernels written once against a small vector interface (Ops) and
+// instantiated by each force_kernels_<isa>.cc with that instruction set
+// enabled. Only include this inside an anonymous namespace so that no
+// instantiation compiled for a wide instruction set can be shared with
+// (and executed by) code running on a narrower CPU.
+//
+// Ops provides:
+//   V, W            vector type and its number of float lanes
+//   REG_BLOCK       i-vectors kept in registers per j broadcast
+//   SYM_ROTATIONS   i-vector rotations kept in registers per pass over j in
+//                   the symmetric kernel, a divisor of W
+//   load, store, set1, zero, add, sub, mul, div, sqrt
+//   load_partial(p, n)      first n lanes from p, zeros above
+//   store_partial(p, v, n)  first n lanes of v to p, memory above untouched
+//   rsqrt           hardware reciprocal square root estimate
+//   first(v)        lane 0 as a float
+//   rotate_by(v, r) lane k <- lane (k + r) % W
+
+// 1/sqrt(x) at the precision selected by Mode
+template <class Ops, RsqrtMode Mode>
+inline typename Ops::V inv_sqrt_v(typename Ops::V x) {
+	using V = typename Ops::V;
+	if constexpr (Mode == RsqrtMode::Exact) {
+		return Ops::div(Ops::set1(1.0f), Ops::sqrt(x));
+	} else {
+		const V half_x = Ops::mul(Ops::set1(0.5f), x);
+		const V three_halves = Ops::set1(1.5f);
+		V y = Ops::rsqrt(x);
+		// Newton-Raphson: y' = y * (1.5 - 0.5 * x * y^2)
+		if constexpr (Mode == RsqrtMode::Newton1 || Mode == RsqrtMode::Newton2) {
+			y = Ops::mul(y, Ops::sub(three_halves, Ops::mul(half_x, Ops::mul(y, y))));
+		}
+		if constexpr (Mode == RsqrtMode::Newton2) {
+			y = Ops::mul(y, Ops::sub(three_halves, Ops::mul(half_x, Ops::mul(y, y))));
+		}
+		return y;
+	}
+}
+
+// RB full i-vectors at body i, or with Partial a single vector of which
+// only the first `lanes` bodies are loaded and stored (the tail of the range)
+template <class Ops, RsqrtMode Mode, std::size_t RB, bool Partial = false>
+inline void accumulate_vectors(const ForceData &d, std::size_t i,
+                               std::size_t j_begin, std::size_t j_end,
+                               std::size_t lanes = Ops::W) {
+	using V = typename Ops::V;
+	constexpr std::size_t W = Ops::W;
+	auto load = [=](const float *p) {
+		if constexpr (Partial) return Ops::load_partial(p, lanes);
+		else return Ops::load(p);
+	};
+
+	V p_xi[RB], p_yi[RB], p_zi[RB];
+	V result_x[RB], result_y[RB], result_z[RB];
+	for (std::size_t b = 0; b < RB; b++) {
+		p_xi[b] = load(d.x + i + b * W);
+		p_yi[b] = load(d.y + i + b * W);
+		p_zi[b] = load(d.z + i + b * W);
+		result_x[b] = load(d.ax + i + b * W);
+		result_y[b] = load(d.ay + i + b * W);
+		result_z[b] = load(d.az + i + b * W);
+	}
+	const V eps = Ops::set1(softening2);
+
+	for (std::size_t j = j_begin; j < j_end; j++) {
+		// One broadcast of body j feeds all RB i-vectors
+		const V p_xj = Ops::set1(d.x[j]);
+		const V p_yj = Ops::set1(d.y[j]);
+		const V p_zj = Ops::set1(d.z[j]);
+		const V mass = Ops::set1(d.m[j]);
+
+		for (std::size_t b = 0; b < RB; b++) {
+			V d_x = Ops::sub(p_xj, p_xi[b]);
+			V d_y = Ops::sub(p_yj, p_yi[b]);
+			V d_z = Ops::sub(p_zj, p_zi[b]);
+			V d_sqrd = Ops::add(Ops::add(Ops::mul(d_x, d_x), Ops::mul(d_y, d_y)),
+			                    Ops::mul(d_z, d_z));
+			d_sqrd = Ops::add(d_sqrd, eps);
+			V inv_d = inv_sqrt_v<Ops, Mode>(d_sqrd);
+			V impulse = Ops::mul(mass, Ops::mul(inv_d, Ops::mul(inv_d, inv_d)));
+			result_x[b] = Ops::add(result_x[b], Ops::mul(d_x, impulse));
+			result_y[b] = Ops::add(result_y[b], Ops::mul(d_y, impulse));
+			result_z[b] = Ops::add(result_z[b], Ops::mul(d_z, impulse));
+		}
+	}
+	for (std::size_t b = 0; b < RB; b++) {
+		if constexpr (Partial) {
+			Ops::store_partial(d.ax + i + b * W, result_x[b], lanes);
+			Ops::store_partial(d.ay + i + b * W, result_y[b], lanes);
+			Ops::store_partial(d.az + i + b * W, result_z[b], lanes);
+		} else {
+			Ops::store(d.ax + i + b * W, result_x[b]);
+			Ops::store(d.ay + i + b * W, result_y[b]);
+			Ops::store(d.az + i + b * W, result_z[b]);
+		}
+	}
+}
+
+template <class Ops, RsqrtMode Mode>
+void accumulate(const ForceData &d, std::size_t i_begin, std::size_t i_end,
+                std::size_t j_begin, std::size_t j_end) {
+	constexpr std::size_t W = Ops::W;
+	constexpr std::size_t RB = Ops::REG_BLOCK;
+	std::size_t i = i_begin;
+	for (; i + RB * W <= i_end; i += RB * W) {
+		accumulate_vectors<Ops, Mode, RB>(d, i, j_begin, j_end);
+	}
+	for (; i + W <= i_end; i += W) {
+		accumulate_vectors<Ops, Mode, 1>(d, i, j_begin, j_end);
+	}
+	if (i < i_end) {
+		accumulate_vectors<Ops, Mode, 1, true>(d, i, j_begin, j_end, i_end - i);
+	}
+}
+
+
+// Interaction between bodies a and b applied to both
+template <class Ops, RsqrtMode Mode>
+inline void body_pair_symmetric(const ForceData &d, std::size_t a, std::size_t b) {
+	float dx = d.x[b] - d.x[a];
+	float dy = d.y[b] - d.y[a];
+	float dz = d.z[b] - d.z[a];
+	float d2 = dx * dx + dy * dy + dz * dz;
+	      d2 += softening2;
+	float inv = Ops::first(inv_sqrt_v<Ops, Mode>(Ops::set1(d2)));
+	float inv3 = inv * inv * inv;
+	float imp_a = d.m[b] * inv3;
+	float imp_b = d.m[a] * inv3;
+	d.ax[a] += dx * imp_a;
+	d.ay[a] += dy * imp_a;
+	d.az[a] += dz * imp_a;
+	d.ax[b] -= dx * imp_b;
+	d.ay[b] -= dy * imp_b;
+	d.az[b] -= dz * imp_b;
+}
+
+// Interactions between the i-vector at body i and bodies [j_begin, j_end),
+// applied to both sides. Every j-vector meets each of the W lane rotations
+// of the i-vector, without shuffles in the inner loop: SYM_ROTATIONS of them
+// are built per pass over j and kept in registers with their partial sums,
+// which are rotated back at the end of the pass. The accelerations of j go
+// through memory between passes, in the same order of operations as a
+// single pass
+template <class Ops, RsqrtMode Mode>
+inline void row_symmetric(const ForceData &d, std::size_t i,
+                          std::size_t j_begin, std::size_t j_end) {
+	using V = typename Ops::V;
+	constexpr std::size_t W = Ops::W;
+	constexpr std::size_t R = Ops::SYM_ROTATIONS;
+	static_assert(W % R == 0, "SYM_ROTATIONS must divide W");
+
+	const V p_x0 = Ops::load(d.x + i);
+	const V p_y0 = Ops::load(d.y + i);
+	const V p_z0 = Ops::load(d.z + i);
+	const V m_0 = Ops::load(d.m + i);
+	V result_x = Ops::load(d.ax + i);
+	V result_y = Ops::load(d.ay + i);
+	V result_z = Ops::load(d.az + i);
+	const V eps = Ops::set1(softening2);
+
+	for (std::size_t pass = 0; pass < W; pass += R) {
+		V p_xi[R], p_yi[R], p_zi[R], m_i[R];
+		V result_xi[R], result_yi[R], result_zi[R];
+		for (std::size_t r = 0; r < R; r++) {
+			p_xi[r] = Ops::rotate_by(p_x0, pass + r);
+			p_yi[r] = Ops::rotate_by(p_y0, pass + r);
+			p_zi[r] = Ops::rotate_by(p_z0, pass + r);
+			m_i[r] = Ops::rotate_by(m_0, pass + r);
+			result_xi[r] = Ops::zero();
+			result_yi[r] = Ops::zero();
+			result_zi[r] = Ops::zero();
+		}
+
+		for (std::size_t j = j_begin; j < j_end; j += W) {
+			const V p_xj = Ops::load(d.x + j);
+			const V p_yj = Ops::load(d.y + j);
+			const V p_zj = Ops::load(d.z + j);
+			const V m_j = Ops::load(d.m + j);
+			V result_xj = Ops::load(d.ax + j);
+			V result_yj = Ops::load(d.ay + j);
+			V result_zj = Ops::load(d.az + j);
+
+			for (std::size_t r = 0; r < R; r++) {
+				V d_x = Ops::sub(p_xj, p_xi[r]);
+				V d_y = Ops::sub(p_yj, p_yi[r]);
+				V d_z = Ops::sub(p_zj, p_zi[r]);
+				V d_sqrd = Ops::add(Ops::add(Ops::mul(d_x, d_x), Ops::mul(d_y, d_y)),
+				                    Ops::mul(d_z, d_z));
+				d_sqrd = Ops::add(d_sqrd, eps);
+				V inv_d = inv_sqrt_v<Ops, Mode>(d_sqrd);
+				V inv_d_cubed = Ops::mul(inv_d, Ops::mul(inv_d, inv_d));
+
+				// Equal and opposite: i is pulled by m_j, j is pulled by m_i
+				V impulse_i = Ops::mul(m_j, inv_d_cubed);
+				V impulse_j = Ops::mul(m_i[r], inv_d_cubed);
+				result_xi[r] = Ops::add(result_xi[r], Ops::mul(d_x, impulse_i));
+				result_yi[r] = Ops::add(result_yi[r], Ops::mul(d_y, impulse_i));
+				result_zi[r] = Ops::add(result_zi[r], Ops::mul(d_z, impulse_i));
+				result_xj = Ops::sub(result_xj, Ops::mul(d_x, impulse_j));
+				result_yj = Ops::sub(result_yj, Ops::mul(d_y, impulse_j));
+				result_zj = Ops::sub(result_zj, Ops::mul(d_z, impulse_j));
+			}
+			Ops::store(d.ax + j, result_xj);
+			Ops::store(d.ay + j, result_yj);
+			Ops::store(d.az + j, result_zj);
+		}
+
+		// Lane k of rotation r belongs to lane (k + r) % W of the i-vector
+		for (std::size_t r = 0; r < R; r++) {
+			const std::size_t back = (W - pass - r) % W;
+			result_x = Ops::add(result_x, Ops::rotate_by(result_xi[r], back));
+			result_y = Ops::add(result_y, Ops::rotate_by(result_yi[r], back));
+			result_z = Ops::add(result_z, Ops::rotate_by(result_zi[r], back));
+		}
+	}
+	Ops::store(d.ax + i, result_x);
+	Ops::store(d.ay + i, result_y);
+	Ops::store(d.az + i, result_z);
+}
+
+template <class Ops, RsqrtMode Mode>
+void symmetric(const ForceData &d, std::size_t i_begin, std::size_t i_end,
+               std::size_t j_begin, std::size_t j_end) {
+	constexpr std::size_t W = Ops::W;
+	const bool diagonal = (i_begin == j_begin);
+
+	for (std::size_t i = i_begin; i < i_end; i += W) {
+		// Within a diagonal block only the vectors after i are visited
+		row_symmetric<Ops, Mode>(d, i, diagonal ? i + W : j_begin, j_end);
+
+		// Pairs inside the i-vector itself
+		if (diagonal) {
+			for (std::size_t a = i; a < i + W; a++) {
+				for (std::size_t b = a + 1; b < i + W; b++) {
+					body_pair_symmetric<Ops, Mode>(d, a, b);
+				}
+			}
+		}
+	}
+}
+
+template <class Ops>
+constexpr ForceKernels make_force_kernels(SimdLevel level, const char *name) {
+	return ForceKernels{level, name,
+		{accumulate<Ops, RsqrtMode::Raw>, accumulate<Ops, RsqrtMode::Newton1>,
+		 accumulate<Ops, RsqrtMode::Newton2>, accumulate<Ops, RsqrtMode::Exact>},
+		{symmetric<Ops, RsqrtMode::Raw>, symmetric<Ops, RsqrtMode::Newton1>,
+		 symmetric<Ops, RsqrtMode::Newton2>, symmetric<Ops, RsqrtMode::Exact>}};
+}
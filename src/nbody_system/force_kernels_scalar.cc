@@ -0,0 +1,34 @@
+
+#include <cmath>
+
+#include "force_kernels.hh"
+#include "kernel_common.hh"
+#include "simd_vec.hh"
+
+namespace {
+struct ScalarOps {
+	using V = float;
+	static constexpr std::size_t W = 1;
+	static constexpr std::size_t REG_BLOCK = 4;
+	static constexpr std::size_t SYM_ROTATIONS = W;
+	static V load(const float *p) { return *p; }
+	static void store(float *p, V v) { *p = v; }
+	static V load_partial(const float *p, std::size_t n) { return n > 0 ? *p : 0.0f; }
+	static void store_partial(float *p, V v, std::size_t n) { if (n > 0) *p = v; }
+	static V set1(float a) { return a; }
+	static V zero() { return 0.0f; }
+	static V add(V a, V b) { return a + b; }
+	static V sub(V a, V b) { return a - b; }
+	static V mul(V a, V b) { return a * b; }
+	static V div(V a, V b) { return a / b; }
+	static V sqrt(V a) { return std::sqrt(a); }
+	static V rsqrt(V a) { return rsqrt_approx(a); }
+	static float first(V v) { return v; }
+	static V rotate_by(V v, std::size_t) { return v; }
+};
+
+#include "force_kernels_impl.hh"
+}; // namespace
+
+extern const ForceKernels scalar_force_kernels =
+	make_force_kernels<ScalarOps>(SimdLevel::Scalar, "Scalar");
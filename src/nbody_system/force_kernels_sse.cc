@@ -0,0 +1,51 @@
+
+#include <cmath>
+#include <immintrin.h>
+
+#include "force_kernels.hh"
+#include "kernel_common.hh"
+#include "simd_vec.hh"
+
+namespace {
+struct SseOps {
+	using V = __m128;
+	static constexpr std::size_t W = 4;
+	static constexpr std::size_t REG_BLOCK = 2;
+	static constexpr std::size_t SYM_ROTATIONS = W;
+	static V load(const float *p) { return _mm_load_ps(p); }
+	static void store(float *p, V v) { _mm_store_ps(p, v); }
+	// No masked moves in SSE, so the lanes go through the stack
+	static V load_partial(const float *p, std::size_t n) {
+		alignas(16) float lanes[W] = {};
+		for (std::size_t k = 0; k < n; k++) lanes[k] = p[k];
+		return _mm_load_ps(lanes);
+	}
+	static void store_partial(float *p, V v, std::size_t n) {
+		alignas(16) float lanes[W];
+		_mm_store_ps(lanes, v);
+		for (std::size_t k = 0; k < n; k++) p[k] = lanes[k];
+	}
+	static V set1(float a) { return _mm_set1_ps(a); }
+	static V zero() { return _mm_setzero_ps(); }
+	static V add(V a, V b) { return _mm_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm_div_ps(a, b); }
+	static V sqrt(V a) { return _mm_sqrt_ps(a); }
+	static V rsqrt(V a) { return _mm_rsqrt_ps(a); }
+	static float first(V v) { return _mm_cvtss_f32(v); }
+	static V rotate_by(V v, std::size_t r) {
+		switch (r % W) {
+		case 1: return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 3, 2, 1));
+		case 2: return _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2));
+		case 3: return _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 1, 0, 3));
+		default: return v;
+		}
+	}
+};
+
+#include "force_kernels_impl.hh"
+}; // namespace
+
+extern const ForceKernels sse_force_kernels =
+	make_force_kernels<SseOps>(SimdLevel::SSE, "SSE");
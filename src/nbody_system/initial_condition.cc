@@ -1,182 +1,233 @@
 
 #include <algorithm>
+#include <cmath>
 #include <execution>
-#include <random>
 
 #include <iostream>
 
 #include "math_functions.hh"
+#include "vec.hh"
 #include "initial_condition.hh"
+#include "counter_rng.hh"
 #include "simd_vec.hh"
 
 namespace {
-std::random_device rd;
-std::mt19937 rg(rd());
-std::uniform_real_distribution<float> dist(-1.f, 1.f);
-std::lognormal_distribution<float> lgdist(0.0f, 1.0f);
 static constexpr float PI = 3.1415926f;
-}; // namespace
-
 
-// Generate disc of particles
-std::vector<Vec3<float>> generate_frisbee(int n_bodies, float rad) {
-  auto randomGenerator = [=]() {
-    Vec3<float> p;
-    const float theta = PI * 2 * dist(rg);
-    const float radius = dist(rg) * rad;
-    p.x = cos(theta) * radius;
-    p.y = sin(theta) * radius;
-    p.z = dist(rg) * rad / 10.f;
-    return p;
-  };
-  std::vector<Vec3<float>> particles(n_bodies);
-  std::generate(particles.begin(), particles.end(), randomGenerator);
-  return particles;
+// Random streams of rotating_4, per galaxy
+constexpr std::uint32_t STREAM_MASS = 0;
+constexpr std::uint32_t STREAM_SPHERE_1 = 1;
+constexpr std::uint32_t STREAM_SPHERE_2 = 2;
+constexpr std::uint32_t STREAMS_PER_GALAXY = 4;
+// and of the other scenarios, past those of the 4 galaxies
+constexpr std::uint32_t STREAM_FRISBEE = 16;
+constexpr std::uint32_t STREAM_PLUMMER_POS = 32;
+constexpr std::uint32_t STREAM_PLUMMER_VEL = 33;
+constexpr std::uint32_t STREAM_PLUMMER_DIR = 34;
+constexpr std::uint32_t STREAM_CUBE = 48;
+
+// Mass of the central body of frisbee and rotating_4, and total mass of
+// plummer and uniform_cube
+constexpr float SYSTEM_MASS = 1.e13f;
+
+// Fills the bodies of system in parallel, chunk by chunk, straight into the
+// SoA arrays; body(idx, pos, vel, mass) sets body idx from its index alone.
+// The ghost lanes past num_bodies keep their zeros
+template <class BodyFn> void fill_bodies(System &system, BodyFn body) {
+  const std::size_t n = system.num_bodies;
+  std::for_each(std::execution::par_unseq, std::begin(system.Cidx), std::end(system.Cidx),
+                [&](std::size_t ii) {
+    const std::size_t lanes = std::min(CHUNK, n - ii * CHUNK);
+    for (std::size_t jj = 0; jj < lanes; jj++) {
+      Vec3<float> pos, vel;
+      float mass;
+      body(ii * CHUNK + jj, pos, vel, mass);
+      system.PosX[ii].data[jj] = pos.x;
+      system.PosY[ii].data[jj] = pos.y;
+      system.PosZ[ii].data[jj] = pos.z;
+      system.VelX[ii].data[jj] = vel.x;
+      system.VelY[ii].data[jj] = vel.y;
+      system.VelZ[ii].data[jj] = vel.z;
+      system.Mass[ii].data[jj] = mass;
+    }
+  });
 }
 
+// Isotropic vector of length len from two words
+Vec3<float> random_direction(std::uint32_t w0, std::uint32_t w1, float len) {
+  const float z = signed_unit_float(w0);
+  const float phi = PI * 2 * unit_float(w1);
+  const float rxy = std::sqrt(std::max(0.0f, 1.0f - z * z)) * len;
+  return Vec3<float>(rxy * std::cos(phi), rxy * std::sin(phi), z * len);
+}
 
-template <typename T> std::vector<T> generate_random_mass(int n_bodies) {
-  auto randomGenerator = [=]() {
-    T mass = 1.0f + lgdist(rg) * 1e4f;
-    return mass;
-  };
-  std::vector<T> mass(n_bodies, 0.0f);
-  std::generate(mass.begin(), mass.end(), randomGenerator);
-  return mass;
+// Log-normal mass of body i
+float random_mass(std::uint64_t seed, std::uint32_t stream, std::uint32_t i) {
+  const Philox4x32 r = random_words(seed, stream, i);
+  return 1.0f + std::exp(normal_float(r[0], r[1])) * 1e4f;
 }
 
+// Velocity of a circular orbit about a mass at the origin, in the xy plane
+Vec3<float> orbital_velocity(const Vec3<float> &pos, float large_mass) {
+  Vec3<float> v = cross_product(pos, Vec3<float>(0.f, 0.f, 1.f));
+  const float orbital_vel = sqrtf(large_mass / magnitude(v));
+  return normalize(v) * orbital_vel;
+}
 
-template <class vecT, typename T>
-std::vector<vecT> orbital_velocity(const std::vector<vecT> &pos,
-                                   const T large_mass) {
-  std::vector<vecT> vel(pos.size(), vecT());
-  std::transform(std::execution::par_unseq, std::begin(pos), std::end(pos),
-                 std::begin(vel), [=](const vecT &pos) {
-                   vecT v = cross_product(pos, vecT(0.f, 0.f, 1.f));
-                   T orbital_vel = sqrtf(large_mass / magnitude(v));
-                   v = normalize(v) * orbital_vel;
-                   return v;
-                 });
-  return vel;
+// Point i of a thin spherical shell about the origin
+Vec3<float> hollow_sphere_point(float rad, std::uint64_t seed, std::uint32_t stream,
+                                std::uint32_t i) {
+  const Philox4x32 r = random_words(seed, stream, i);
+  Vec3<float> p;
+  const float theta = PI * 2 * signed_unit_float(r[0]);
+  const float phi = PI * signed_unit_float(r[1]);
+  const float radius = rad + signed_unit_float(r[2]) * rad / 100.f;
+  p.x = sin(theta) * cos(phi) * radius;
+  p.y = sin(theta) * sin(phi) * radius;
+  p.z = cos(theta) * radius;
+  return p;
 }
+}; // namespace
+
 
+// create system with 4 "galaxies" orbiting a large mass
+// each galaxy is two hollow spheres, centered and opposed, orbiting a large
+// mass at its first body, and the whole system orbits a larger mass at the
+// last body
+void rotating_4(System &system) {
 
-template <class vecT, typename T>
-std::vector<vecT> generate_hollow_sphere(int n_bodies, T rad) {
-  auto randomGenerator = [=]() {
-    vecT p;
-    const T theta = PI * 2 * dist(rg);
-    const T phi = PI * dist(rg);
-    const T radius = rad + dist(rg) * rad / 100.f;
-    p.x = sin(theta) * cos(phi) * radius;
-    p.y = sin(theta) * sin(phi) * radius;
-    p.z = cos(theta) * radius;
-    return p;
+  const std::size_t n = system.num_bodies;
+  const std::uint64_t seed = system.seed;
+
+  // split nbodies into 4 groups, the last takes the remainder
+  const std::size_t quad = n / 4;
+
+  // assign subgroup centers at corners
+  const Vec3<float> centers[4] = {{400000.0f, 400000.0f, 0.0f},
+                                  {-400000.0f, -400000.0f, 0.0f},
+                                  {400000.0f, -400000.0f, 0.0f},
+                                  {-400000.0f, 400000.0f, 0.0f}};
+  // the two spheres of a galaxy, about its center
+  const Vec3<float> com1(30000.0f, 0.0f, 0.0f);
+  const Vec3<float> com2(-30000.0f, 0.0f, 0.0f);
+  const float sphere_rad = 20000.0f;
+  const float galaxy_mass = 1.e10f;
+
+  auto body = [&](std::size_t idx, Vec3<float> &pos, Vec3<float> &vel, float &mass) {
+    if (idx == n - 1) {
+      // center of the system
+      pos = {0.f, 0.f, 0.f};
+      vel = {0.f, 0.f, 0.f};
+      mass = SYSTEM_MASS;
+      return;
+    }
+    const std::size_t galaxy = std::min<std::size_t>(idx / quad, 3);
+    const std::size_t size = galaxy == 3 ? n - 3 * quad : quad;
+    const auto local = static_cast<std::uint32_t>(idx - galaxy * quad);
+    // every galaxy draws from its own streams
+    const std::uint32_t stream = static_cast<std::uint32_t>(galaxy) * STREAMS_PER_GALAXY;
+
+    Vec3<float> v;
+    if (local == 0) {
+      // center of the galaxy
+      pos = {0.f, 0.f, 0.f};
+      v = {0.f, 0.f, 0.f};
+      mass = galaxy_mass;
+    } else {
+      const auto half = static_cast<std::uint32_t>(size / 2);
+      pos = local < half
+          ? hollow_sphere_point(sphere_rad, seed, stream + STREAM_SPHERE_1, local) + com1
+          : hollow_sphere_point(sphere_rad, seed, stream + STREAM_SPHERE_2, local - half) + com2;
+      // rotation about the center of the galaxy
+      v = orbital_velocity(pos, galaxy_mass);
+      mass = random_mass(seed, stream + STREAM_MASS, local);
+    }
+    // and of the galaxy about the center of the system
+    pos = pos + centers[galaxy];
+    vel = v + orbital_velocity(pos, SYSTEM_MASS);
   };
-  std::vector<vecT> particles(n_bodies, vecT());
-  std::generate(particles.begin(), particles.end(), randomGenerator);
-  return particles;
+
+  fill_bodies(system, body);
 }
 
 
-template <class vecT> std::vector<vecT> generate_two_sphere(int n_bodies) {
-  const vecT com1(30000.0f, 0.0f, 0.0f);
-  const vecT com2(-30000.0f, 0.0f, 0.0f);
-  const int half = n_bodies / 2;
-  const int other_half = n_bodies - half;
-  std::vector<vecT> p1 = generate_hollow_sphere<vecT>(half, 20000.f);
-  std::vector<vecT> p2 = generate_hollow_sphere<vecT>(other_half, 20000.f);
-  std::transform(std::execution::par_unseq,
-                p1.begin(), p1.end(), p1.begin(),
-                [=](auto& p) { return p + com1; });
-  std::transform(std::execution::par_unseq,
-                p2.begin(), p2.end(), p2.begin(),
-                [=](auto& p) { return p + com2; });
-  p1.insert(p1.end(), p2.begin(), p2.end());
-  return p1;
+// Disc of bodies in circular orbits about a large mass at the first body
+void frisbee(System &system) {
+
+  const std::uint64_t seed = system.seed;
+  const float rad = 400000.0f;
+  // keep clear of the central mass
+  const float inner = 0.05f * rad;
+
+  fill_bodies(system, [=](std::size_t idx, Vec3<float> &pos, Vec3<float> &vel, float &mass) {
+    if (idx == 0) {
+      pos = {0.f, 0.f, 0.f};
+      vel = {0.f, 0.f, 0.f};
+      mass = SYSTEM_MASS;
+      return;
+    }
+    const auto i = static_cast<std::uint32_t>(idx);
+    const Philox4x32 r = random_words(seed, STREAM_FRISBEE, i);
+    const float theta = PI * 2 * unit_float(r[0]);
+    const float radius = inner + unit_float(r[1]) * (rad - inner);
+    pos.x = cos(theta) * radius;
+    pos.y = sin(theta) * radius;
+    pos.z = signed_unit_float(r[2]) * rad / 10.f;
+    vel = orbital_velocity(pos, SYSTEM_MASS);
+    mass = random_mass(seed, STREAM_FRISBEE + 1, i);
+  });
 }
 
 
-// create "galaxy" from two spherical shells that orbit a larger mass
-void add_galaxy_to_system(
-    std::vector<Vec3<float>>& tmp_sysPos,
-    std::vector<Vec3<float>>& tmp_sysVel,
-    std::vector<float>& tmp_sysMss,
-    const Vec3<float> &center,
-    int n_bodies, float large_mass)
-{
-  // get random mass distribution, positions, and orbital velocities
-  std::vector<float> m = generate_random_mass<float>(n_bodies);
-  // arrange as two hollow spheres centered and opposed about a large mass
-  std::vector<Vec3<float>> p = generate_two_sphere<Vec3<float>>(n_bodies);
-  // calculate rotational velocity of two-sphere system about 0,0,0 (local) coordinate
-  std::vector<Vec3<float>> v = orbital_velocity(p, large_mass);
-  // set first position of two-sphere system to center of galaxy
-  p[0] = {0.f, 0.f, 0.f};
-  v[0] = {0.f, 0.f, 0.f};
-  m[0] = large_mass;
-
-  // shift two-sphere positions by center coordinate
-  std::transform(std::execution::par_unseq,
-                p.begin(), p.end(), p.begin(),
-                [=](auto& pos) { return pos + center; });
-
-  // insert two-sphere into system vectors
-  tmp_sysPos.insert(tmp_sysPos.end(), p.begin(), p.end());
-  tmp_sysVel.insert(tmp_sysVel.end(), v.begin(), v.end());
-  tmp_sysMss.insert(tmp_sysMss.end(), m.begin(), m.end());
+// Plummer sphere in equilibrium, equal masses (Aarseth, Henon & Wielen 1974)
+// radii are drawn from the cumulative mass profile, truncated at 10 scale
+// radii, and speeds by rejection from the distribution function
+void plummer(System &system) {
+
+  const std::uint64_t seed = system.seed;
+  const float a = 100000.0f; // Scale radius
+  const float r_max = 10.0f * a;
+  const float v_scale = std::sqrt(SYSTEM_MASS / a);
+  const float m = SYSTEM_MASS / system.num_bodies;
+
+  fill_bodies(system, [=](std::size_t idx, Vec3<float> &pos, Vec3<float> &vel, float &mass) {
+    const auto i = static_cast<std::uint32_t>(idx);
+    float radius = r_max;
+    Philox4x32 r;
+    for (std::uint32_t draw = 0; radius >= r_max; draw++) {
+      r = random_words(seed, STREAM_PLUMMER_POS, i, draw);
+      // mass fraction in (0, 1]
+      const float x = static_cast<float>((r[0] >> 8) + 1) * 0x1.0p-24f;
+      radius = a / std::sqrt(std::pow(x, -2.0f / 3.0f) - 1.0f);
+    }
+    pos = random_direction(r[1], r[2], radius);
+
+    // q = v / v_escape, from g(q) = q^2 (1 - q^2)^3.5, whose maximum is below 0.1
+    float q = 0.0f;
+    for (std::uint32_t draw = 0;; draw++) {
+      const Philox4x32 w = random_words(seed, STREAM_PLUMMER_VEL, i, draw);
+      q = unit_float(w[0]);
+      if (0.1f * unit_float(w[1]) < q * q * std::pow(1.0f - q * q, 3.5f)) break;
+    }
+    const float v_escape = std::sqrt(2.0f) * v_scale * std::pow(1.0f + radius * radius / (a * a), -0.25f);
+    const Philox4x32 d = random_words(seed, STREAM_PLUMMER_DIR, i);
+    vel = random_direction(d[0], d[1], q * v_escape);
+    mass = m;
+  });
 }
 
 
-// create system with 4 "galaxies" orbiting a large mass
-void rotating_4(System &system) {
+// Cold cube of equal masses at rest, which collapses
+void uniform_cube(System &system) {
 
-  // split nbodies into 4 groups
-  const int quad = system.num_bodies / 4;
-  const int last_quad = system.num_bodies - quad * 3;
+  const std::uint64_t seed = system.seed;
+  const float half = 200000.0f;
+  const float m = SYSTEM_MASS / system.num_bodies;
 
-  // assign subgroup centers at corners
-  const Vec3<float> center1(400000.0f, 400000.0f, 0.0f);
-  const Vec3<float> center2(-400000.0f, -400000.0f, 0.0f);
-  const Vec3<float> center3(400000.0f, -400000.0f, 0.0f);
-  const Vec3<float> center4(-400000.0f, 400000.0f, 0.0f);
-
-  // temporary system vectors
-  auto tmp_sysPos  =  std::vector<Vec3<float>>();
-  auto tmp_sysVel  = std::vector<Vec3<float>>();
-  auto tmp_sysMss = std::vector<float>();
-  // add "galaxies" to system
-  add_galaxy_to_system(tmp_sysPos, tmp_sysVel, tmp_sysMss, center1, quad, 1.e10f);
-  add_galaxy_to_system(tmp_sysPos, tmp_sysVel, tmp_sysMss, center2, quad, 1.e10f);
-  add_galaxy_to_system(tmp_sysPos, tmp_sysVel, tmp_sysMss, center3, quad, 1.e10f);
-  add_galaxy_to_system(tmp_sysPos, tmp_sysVel, tmp_sysMss, center4, last_quad, 1.e10f);
-
-  // calculate orbital velocity of system about global 0,0,0 coordinate
-  // add it to system velocity
-  std::vector<Vec3<float>> orb_vel = orbital_velocity(tmp_sysPos, 1e13f);
-  std::transform(std::execution::par_unseq,
-                orb_vel.begin(), orb_vel.end(),
-                tmp_sysVel.begin(), tmp_sysVel.begin(),
-                [=](const auto& ov, auto& sv) { return sv + ov; });
-  // set last position to center of system
-  tmp_sysPos[system.num_bodies-1] = {0.f, 0.f, 0.f};
-  tmp_sysVel[system.num_bodies-1] = {0.f, 0.f, 0.f};
-  tmp_sysMss[system.num_bodies-1] = 1.e13f;
-
-    for (std::size_t ii = 0; ii < system.num_bodies/CHUNK; ii++) {
-        for (std::size_t jj = 0; jj < CHUNK; jj++) {
-          std::size_t idx = ii * CHUNK + jj;
-          
-          system.PosX[ii].data[jj] = tmp_sysPos[idx].x;
-          system.PosY[ii].data[jj] = tmp_sysPos[idx].y;
-          system.PosZ[ii].data[jj] = tmp_sysPos[idx].z;
-
-          system.VelX[ii].data[jj] = tmp_sysVel[idx].x;
-          system.VelY[ii].data[jj] = tmp_sysVel[idx].y;
-          system.VelZ[ii].data[jj] = tmp_sysVel[idx].z;
-
-          system.Mass[ii].data[jj] = tmp_sysMss[idx];
-        }
-    }
+  fill_bodies(system, [=](std::size_t idx, Vec3<float> &pos, Vec3<float> &vel, float &mass) {
+    const Philox4x32 r = random_words(seed, STREAM_CUBE, idx);
+    pos = Vec3<float>(signed_unit_float(r[0]), signed_unit_float(r[1]), signed_unit_float(r[2])) * half;
+    vel = {0.f, 0.f, 0.f};
+    mass = m;
+  });
 }
-
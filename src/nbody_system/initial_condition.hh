@@ -1,10 +1,20 @@
-
 #pragma once
 
-#include <vector>
 #include "system.hh"
-#include "vec.hh"
 
-std::vector<Vec3<float>> generate_frisbee(int n_bodies, float rad);
+// Built-in initial conditions, selected by name through the scenario registry
+// each fills a System already allocated for its body count. Body i is drawn
+// from a counter-based RNG keyed by (system.seed, stream, i), so the bodies
+// are generated in parallel and are the same for any thread count
 
+// 4 galaxies of two hollow spheres, orbiting a large mass
 void rotating_4(System &system);
+
+// Disc in circular orbits about a large mass
+void frisbee(System &system);
+
+// Plummer sphere in equilibrium
+void plummer(System &system);
+
+// Cold uniform cube
+void uniform_cube(System &system);
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE__) && !defined(ENABLE_CUDA)
+#include <xmmintrin.h>
+#endif
+
+#include "force_kernels.hh"
+
+// Shared constants and helpers for the force kernels
+
+constexpr float softening2 = 0.00001f;
+
+// Hardware reciprocal square root estimate (~12 bits)
+inline float rsqrt_approx(const float x)
+{
+#if defined(__SSE__) && !defined(ENABLE_CUDA)
+  return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+  // Bit-level initial guess, refined once to about the same precision
+  std::uint32_t i;
+  std::memcpy(&i, &x, sizeof(i));
+  i = 0x5f375a86u - (i >> 1);
+  float y;
+  std::memcpy(&y, &i, sizeof(y));
+  return y * (1.5f - 0.5f * x * y * y);
+#endif
+}
+
+// 1/sqrt(x) at the precision selected by Mode
+template <RsqrtMode Mode>
+inline float inv_sqrt(const float x)
+{
+  if constexpr (Mode == RsqrtMode::Exact) {
+#ifdef ENABLE_CUDA
+    return rsqrtf(x);
+#else
+    return 1.0f/std::sqrt(x);
+#endif
+  } else {
+    float y = rsqrt_approx(x);
+    if constexpr (Mode == RsqrtMode::Newton1 || Mode == RsqrtMode::Newton2) {
+      y = y * (1.5f - 0.5f * x * y * y);
+    }
+    if constexpr (Mode == RsqrtMode::Newton2) {
+      y = y * (1.5f - 0.5f * x * y * y);
+    }
+    return y;
+  }
+}
+
+// Call f with the precision mode as a compile-time constant
+template <class F>
+inline void dispatch_rsqrt_mode(RsqrtMode mode, F &&f)
+{
+  switch (mode) {
+  case RsqrtMode::Raw:
+    f(std::integral_constant<RsqrtMode, RsqrtMode::Raw>{});
+    break;
+  case RsqrtMode::Newton1:
+    f(std::integral_constant<RsqrtMode, RsqrtMode::Newton1>{});
+    break;
+  case RsqrtMode::Newton2:
+    f(std::integral_constant<RsqrtMode, RsqrtMode::Newton2>{});
+    break;
+  case RsqrtMode::Exact:
+  default:
+    f(std::integral_constant<RsqrtMode, RsqrtMode::Exact>{});
+    break;
+  }
+}
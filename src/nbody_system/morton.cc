@@ -0,0 +1,74 @@
+
+#include <execution>
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "morton.hh"
+
+namespace {
+// Bodies a task bounds, whole chunks
+constexpr std::size_t BLOCK = 16384;
+
+struct Box {
+	float lo[3];
+	float hi[3];
+};
+
+Box merge(const Box &a, const Box &b) {
+	Box r;
+	for (int d = 0; d < 3; d++) {
+		r.lo[d] = std::min(a.lo[d], b.lo[d]);
+		r.hi[d] = std::max(a.hi[d], b.hi[d]);
+	}
+	return r;
+}
+
+// Range of n positions, kept per lane so the loop vectorizes
+void axis_bounds(const SIMDVec *pos, std::size_t n, float &lo, float &hi) {
+	float lane_lo[CHUNK], lane_hi[CHUNK];
+	std::fill_n(lane_lo, CHUNK, std::numeric_limits<float>::max());
+	std::fill_n(lane_hi, CHUNK, -std::numeric_limits<float>::max());
+	for (std::size_t c = 0; c * CHUNK < n; c++) {
+		const std::size_t lanes = std::min(CHUNK, n - c * CHUNK);
+		for (std::size_t l = 0; l < lanes; l++) {
+			lane_lo[l] = std::min(lane_lo[l], pos[c].data[l]);
+			lane_hi[l] = std::max(lane_hi[l], pos[c].data[l]);
+		}
+	}
+	lo = *std::min_element(lane_lo, lane_lo + CHUNK);
+	hi = *std::max_element(lane_hi, lane_hi + CHUNK);
+}
+}; // namespace
+
+
+BoundingCube bounding_cube(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                           std::size_t nbodies) {
+
+	std::vector<std::size_t> blocks((nbodies + BLOCK - 1) / BLOCK);
+	std::iota(std::begin(blocks), std::end(blocks), 0);
+	const SIMDVec *pos[3] = {px, py, pz};
+
+	constexpr float inf = std::numeric_limits<float>::max();
+	const Box empty{{inf, inf, inf}, {-inf, -inf, -inf}};
+	const Box box = std::transform_reduce(std::execution::par,
+		std::begin(blocks), std::end(blocks), empty, merge,
+		[&](std::size_t b) {
+			const std::size_t first = b * BLOCK;
+			const std::size_t n = std::min(BLOCK, nbodies - first);
+			Box r;
+			for (int d = 0; d < 3; d++) axis_bounds(pos[d] + first / CHUNK, n, r.lo[d], r.hi[d]);
+			return r;
+		});
+
+	BoundingCube cube;
+	for (int d = 0; d < 3; d++) {
+		cube.lo[d] = box.lo[d];
+		cube.hi[d] = box.hi[d];
+	}
+	const float extent = std::max({box.hi[0] - box.lo[0], box.hi[1] - box.lo[1],
+	                               box.hi[2] - box.lo[2]});
+	cube.extent = extent * 1.0001f + std::numeric_limits<float>::min();
+	return cube;
+}
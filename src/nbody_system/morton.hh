@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "simd_vec.hh"
+
+// Morton (Z-order) keys with 21 bits per axis, packed into 63 bits
+// bit layout of each 3-bit group (from high to low): x, y, z
+
+constexpr int MORTON_BITS = 21;
+constexpr std::uint32_t MORTON_CELLS = 1u << MORTON_BITS;
+
+// Spread the low 21 bits of v so that there are two zero bits between each
+inline std::uint64_t morton_expand(std::uint32_t v) {
+  std::uint64_t x = v & 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffull;
+  x = (x | x << 16) & 0x1f0000ff0000ffull;
+  x = (x | x << 8)  & 0x100f00f00f00f00full;
+  x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+  x = (x | x << 2)  & 0x1249249249249249ull;
+  return x;
+}
+
+// Inverse of morton_expand: gathers every third bit of x into the low 21 bits
+inline std::uint32_t morton_compact(std::uint64_t x) {
+  x &= 0x1249249249249249ull;
+  x = (x | x >> 2)  & 0x10c30c30c30c30c3ull;
+  x = (x | x >> 4)  & 0x100f00f00f00f00full;
+  x = (x | x >> 8)  & 0x1f0000ff0000ffull;
+  x = (x | x >> 16) & 0x1f00000000ffffull;
+  x = (x | x >> 32) & 0x1fffff;
+  return static_cast<std::uint32_t>(x);
+}
+
+inline std::uint64_t morton_key(std::uint32_t ix, std::uint32_t iy,
+                                std::uint32_t iz) {
+  return (morton_expand(ix) << 2) | (morton_expand(iy) << 1) | morton_expand(iz);
+}
+
+// Map a coordinate in [lo, lo + 1/inv_extent) onto the integer grid
+inline std::uint32_t morton_cell(float p, float lo, float inv_extent) {
+  float s = (p - lo) * inv_extent * static_cast<float>(MORTON_CELLS);
+  if (s < 0.0f) s = 0.0f;
+  if (s > static_cast<float>(MORTON_CELLS - 1)) s = static_cast<float>(MORTON_CELLS - 1);
+  return static_cast<std::uint32_t>(s);
+}
+
+// Bounds of a set of bodies: lo and hi per axis, and the side of the cube
+// from lo that holds them all, grown a little so the bodies on its far
+// faces still map inside the grid of morton_cell
+struct BoundingCube {
+  float lo[3];
+  float hi[3];
+  float extent;
+};
+
+// Of the first nbodies bodies of the SoA position arrays, ghosts left out
+BoundingCube bounding_cube(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                           std::size_t nbodies);
+
+// Octant (0-7) of the child of a node at `level` (root = 0) containing key
+inline unsigned morton_octant(std::uint64_t key, int level) {
+  return static_cast<unsigned>(key >> (3 * (MORTON_BITS - 1 - level))) & 7u;
+}
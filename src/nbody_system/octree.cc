@@ -0,0 +1,196 @@
+
+#include <execution>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+
+#include "octree.hh"
+#include "morton.hh"
+
+namespace {
+// Bounds of the children of a node, found by binary search on the sorted keys
+template <class KeyIndex>
+void child_bounds(const KeyIndex *ks, const OctreeNode &node, int level,
+                  std::uint32_t bounds[9]) {
+	const KeyIndex *begin = ks + node.first;
+	const KeyIndex *end = begin + node.count;
+	bounds[0] = node.first;
+	for (unsigned o = 1; o < 8; o++) {
+		const KeyIndex *p = std::partition_point(begin, end, [=](const KeyIndex &k) {
+			return morton_octant(k.key, level) < o;
+		});
+		bounds[o] = static_cast<std::uint32_t>(p - ks);
+	}
+	bounds[8] = node.first + node.count;
+}
+}; // namespace
+
+
+void Octree::build(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                   const SIMDVec *ms, std::size_t nbodies, std::uint32_t leaf_size) {
+
+	this->order.resize(nbodies);
+	this->keys.resize(nbodies);
+	this->X.resize(nbodies);
+	this->Y.resize(nbodies);
+	this->Z.resize(nbodies);
+	this->M.resize(nbodies);
+	std::iota(std::begin(this->order), std::end(this->order), 0);
+
+	// Bounding cube of all bodies
+	const BoundingCube box = bounding_cube(px, py, pz, nbodies);
+	const float extent = box.extent;
+	const float inv_extent = 1.0f / extent;
+	const float lo_x = box.lo[0];
+	const float lo_y = box.lo[1];
+	const float lo_z = box.lo[2];
+
+	// Morton keys, sorted to give the spatial order of the bodies
+	auto *ks = this->keys.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->order),
+									std::end(this->order), [=](std::uint32_t b) {
+		const std::uint32_t ix = morton_cell(px[b / CHUNK].data[b % CHUNK], lo_x, inv_extent);
+		const std::uint32_t iy = morton_cell(py[b / CHUNK].data[b % CHUNK], lo_y, inv_extent);
+		const std::uint32_t iz = morton_cell(pz[b / CHUNK].data[b % CHUNK], lo_z, inv_extent);
+		ks[b] = KeyIndex{morton_key(ix, iy, iz), b};
+	});
+	std::sort(std::execution::par_unseq, std::begin(this->keys), std::end(this->keys),
+		[](const KeyIndex &a, const KeyIndex &b) { return a.key < b.key; });
+
+	// Gather body data into sorted order
+	auto *od = this->order.data();
+	auto *sx = this->X.data();
+	auto *sy = this->Y.data();
+	auto *sz = this->Z.data();
+	auto *sm = this->M.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->keys),
+									std::end(this->keys), [=](const KeyIndex &k) {
+		const std::size_t s = &k - ks;
+		const std::uint32_t b = k.idx;
+		od[s] = b;
+		sx[s] = px[b / CHUNK].data[b % CHUNK];
+		sy[s] = py[b / CHUNK].data[b % CHUNK];
+		sz[s] = pz[b / CHUNK].data[b % CHUNK];
+		sm[s] = ms[b / CHUNK].data[b % CHUNK];
+	});
+
+	// Root cell
+	OctreeNode root{};
+	root.cx = lo_x + 0.5f * extent;
+	root.cy = lo_y + 0.5f * extent;
+	root.cz = lo_z + 0.5f * extent;
+	root.half = 0.5f * extent;
+	root.first = 0;
+	root.count = static_cast<std::uint32_t>(nbodies);
+	this->nodes.assign(1, root);
+
+	split_levels(leaf_size);
+	compute_multipoles();
+}
+
+
+// Top-down construction, one level at a time: count the children of every
+// node in the level, scan the counts to place them, then write the children
+void Octree::split_levels(std::uint32_t leaf_size) {
+
+	this->level_offset = {0, 1};
+
+	for (int level = 0; level < MORTON_BITS; level++) {
+		const std::size_t begin = this->level_offset[level];
+		const std::size_t end = this->level_offset[level + 1];
+		if (begin == end) break;
+
+		auto const *ks = this->keys.data();
+		std::for_each(std::execution::par_unseq, std::begin(this->nodes) + begin,
+										std::begin(this->nodes) + end, [=](OctreeNode &node) {
+			node.child = 0;
+			node.nchild = 0;
+			if (node.count <= leaf_size) return;
+			std::uint32_t bounds[9];
+			child_bounds(ks, node, level, bounds);
+			for (unsigned o = 0; o < 8; o++) {
+				node.nchild += bounds[o + 1] > bounds[o];
+			}
+		});
+
+		this->scan.resize(end - begin);
+		std::transform_exclusive_scan(std::execution::par_unseq,
+			std::begin(this->nodes) + begin, std::begin(this->nodes) + end,
+			std::begin(this->scan), std::uint32_t{0}, std::plus<>(),
+			[](const OctreeNode &node) { return node.nchild; });
+		const std::size_t total = this->scan.back() + this->nodes[end - 1].nchild;
+		if (total == 0) break;
+
+		this->nodes.resize(end + total);
+		auto *nd = this->nodes.data();
+		auto const *sc = this->scan.data();
+		std::for_each(std::execution::par_unseq, std::begin(this->nodes) + begin,
+										std::begin(this->nodes) + end, [=](OctreeNode &node) {
+			if (node.nchild == 0) return;
+			node.child = static_cast<std::uint32_t>(end + sc[&node - nd - begin]);
+			std::uint32_t bounds[9];
+			child_bounds(ks, node, level, bounds);
+			const float q = 0.5f * node.half;
+			std::uint32_t c = node.child;
+			for (unsigned o = 0; o < 8; o++) {
+				if (bounds[o + 1] == bounds[o]) continue;
+				OctreeNode &kid = nd[c++];
+				kid = OctreeNode{};
+				kid.cx = node.cx + ((o & 4) ? q : -q);
+				kid.cy = node.cy + ((o & 2) ? q : -q);
+				kid.cz = node.cz + ((o & 1) ? q : -q);
+				kid.half = q;
+				kid.first = bounds[o];
+				kid.count = bounds[o + 1] - bounds[o];
+			}
+		});
+		this->level_offset.push_back(end + total);
+	}
+}
+
+
+// Bottom-up pass for the monopole (mass and center of mass) of every cell
+void Octree::compute_multipoles() {
+
+	auto *nd = this->nodes.data();
+	auto const *sx = this->X.data();
+	auto const *sy = this->Y.data();
+	auto const *sz = this->Z.data();
+	auto const *sm = this->M.data();
+
+	for (std::size_t level = this->level_offset.size() - 1; level-- > 0;) {
+		std::for_each(std::execution::par_unseq,
+			std::begin(this->nodes) + this->level_offset[level],
+			std::begin(this->nodes) + this->level_offset[level + 1], [=](OctreeNode &node) {
+			float m = 0.0f;
+			float mx = 0.0f;
+			float my = 0.0f;
+			float mz = 0.0f;
+			if (node.nchild == 0) {
+				for (std::uint32_t s = node.first; s < node.first + node.count; s++) {
+					m += sm[s];
+					mx += sm[s] * sx[s];
+					my += sm[s] * sy[s];
+					mz += sm[s] * sz[s];
+				}
+			} else {
+				for (std::uint32_t c = node.child; c < node.child + node.nchild; c++) {
+					m += nd[c].mass;
+					mx += nd[c].mass * nd[c].com_x;
+					my += nd[c].mass * nd[c].com_y;
+					mz += nd[c].mass * nd[c].com_z;
+				}
+			}
+			node.mass = m;
+			if (m > 0.0f) {
+				node.com_x = mx / m;
+				node.com_y = my / m;
+				node.com_z = mz / m;
+			} else {
+				node.com_x = node.cx;
+				node.com_y = node.cy;
+				node.com_z = node.cz;
+			}
+		});
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "simd_vec.hh"
+
+// Octree node, stored level by level so that siblings are contiguous
+struct OctreeNode {
+	float com_x, com_y, com_z; // Center of mass
+	float mass;                // Total mass
+	float cx, cy, cz;          // Geometric center of the cell
+	float half;                // Half edge length of the cell
+	std::uint32_t first;       // First body (in sorted order)
+	std::uint32_t count;       // Number of bodies
+	std::uint32_t child;       // First child node (0 for leaves)
+	std::uint32_t nchild;      // Number of children
+};
+
+// Linear octree built from Morton-sorted bodies
+// construction, sorting, and the multipole pass all run in parallel
+class Octree {
+public:
+	Octree() = default;
+	void build(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+	           const SIMDVec *ms, std::size_t nbodies, std::uint32_t leaf_size);
+	bool is_leaf(const OctreeNode &node) const { return node.nchild == 0; }
+	std::vector<OctreeNode> nodes;
+	std::vector<std::size_t> level_offset; // Level l holds nodes [level_offset[l], level_offset[l+1])
+	std::vector<std::uint32_t> order;      // Sorted position -> body index
+	std::vector<float> X;                  // Body data in sorted order
+	std::vector<float> Y;
+	std::vector<float> Z;
+	std::vector<float> M;
+private:
+	struct KeyIndex {
+		std::uint64_t key;
+		std::uint32_t idx;
+	};
+	std::vector<KeyIndex> keys;
+	std::vector<std::uint32_t> scan;
+	void split_levels(std::uint32_t leaf_size);
+	void compute_multipoles();
+};
@@ -0,0 +1,222 @@
+
+#include <execution>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+
+#include "particle_mesh.hh"
+#include "morton.hh"
+
+
+void ParticleMesh::solve(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                         const SIMDVec *ms, std::size_t nbodies, std::size_t grid) {
+
+	// Power of two between 8 and MAX_GRID
+	static_assert(2 * MAX_GRID <= FFT::MAX_SIZE, "the padded grid needs longer FFTs");
+	std::size_t g = 8;
+	while (g < grid && g < MAX_GRID) g *= 2;
+	if (g != this->grid) {
+		this->grid = g;
+		this->fft.plan(2 * g);
+		make_green();
+	}
+
+	const std::size_t cells = g * g * g;
+	this->Rho.assign(cells, 0.0f);
+	this->Phi.resize(cells);
+	this->GX.resize(cells);
+	this->GY.resize(cells);
+	this->GZ.resize(cells);
+
+	// Bounding cube of all bodies, spread over cells [0, grid - 2] so that
+	// every CIC cloud stays inside the grid
+	const BoundingCube box = bounding_cube(px, py, pz, nbodies);
+	this->h = box.extent / static_cast<float>(g - 2);
+	for (int d = 0; d < 3; d++) this->lo[d] = box.lo[d];
+
+	deposit(px, py, pz, ms, nbodies);
+	convolve();
+	gradient();
+}
+
+
+// CIC deposit, made race-free by coloring: bodies are sorted into x-y
+// columns of cells, and a body in column (i, j) writes only to columns
+// i..i+1, j..j+1. Columns with the same (i % 2, j % 2) never share a cell,
+// so each of the four colors is deposited with one task per column
+void ParticleMesh::deposit(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                           const SIMDVec *ms, std::size_t nbodies) {
+
+	const std::size_t g = this->grid;
+	const float inv_h = 1.0f / this->h;
+	const float lo_x = this->lo[0];
+	const float lo_y = this->lo[1];
+	const float lo_z = this->lo[2];
+
+	this->keys.resize(nbodies);
+	auto *ks = this->keys.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->keys),
+									std::end(this->keys), [=](KeyIndex &k) {
+		const std::uint32_t b = static_cast<std::uint32_t>(&k - ks);
+		std::size_t i, j;
+		float f;
+		cic_cell(px[b / CHUNK].data[b % CHUNK], lo_x, inv_h, g, i, f);
+		cic_cell(py[b / CHUNK].data[b % CHUNK], lo_y, inv_h, g, j, f);
+		k = KeyIndex{static_cast<std::uint32_t>(i * g + j), b};
+	});
+	std::sort(std::execution::par_unseq, std::begin(this->keys), std::end(this->keys),
+		[](const KeyIndex &a, const KeyIndex &b) { return a.key < b.key; });
+
+	// First sorted body of every column
+	this->column_start.resize(g * g + 1);
+	auto *cs = this->column_start.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->column_start),
+									std::end(this->column_start), [=](std::uint32_t &start) {
+		const std::uint32_t c = static_cast<std::uint32_t>(&start - cs);
+		start = static_cast<std::uint32_t>(std::partition_point(ks, ks + nbodies,
+			[=](const KeyIndex &k) { return k.key < c; }) - ks);
+	});
+
+	auto *rho = this->Rho.data();
+	std::vector<std::uint32_t> columns(g * g / 4);
+	for (std::size_t color = 0; color < 4; color++) {
+		const std::size_t ci = color & 1;
+		const std::size_t cj = color >> 1;
+		std::iota(std::begin(columns), std::end(columns), 0);
+		std::for_each(std::execution::par_unseq, std::begin(columns),
+										std::end(columns), [=](std::uint32_t c) {
+			const std::size_t i = 2 * (c / (g / 2)) + ci;
+			const std::size_t j = 2 * (c % (g / 2)) + cj;
+			const std::size_t col = i * g + j;
+
+			for (std::uint32_t s = cs[col]; s < cs[col + 1]; s++) {
+				const std::uint32_t b = ks[s].idx;
+				const float m = ms[b / CHUNK].data[b % CHUNK];
+				std::size_t bi, bj, bk;
+				float fx, fy, fz;
+				cic_cell(px[b / CHUNK].data[b % CHUNK], lo_x, inv_h, g, bi, fx);
+				cic_cell(py[b / CHUNK].data[b % CHUNK], lo_y, inv_h, g, bj, fy);
+				cic_cell(pz[b / CHUNK].data[b % CHUNK], lo_z, inv_h, g, bk, fz);
+				for (std::size_t o = 0; o < 8; o++) {
+					const std::size_t di = o & 1, dj = (o >> 1) & 1, dk = o >> 2;
+					const float w = (di ? fx : 1.0f - fx) * (dj ? fy : 1.0f - fy) *
+					                (dk ? fz : 1.0f - fz);
+					rho[((bk + dk) * g + (bj + dj)) * g + (bi + di)] += w * m;
+				}
+			}
+		});
+	}
+}
+
+
+// Transform of the Green's function -1/r (in cell units) on the padded grid,
+// with distances wrapped so that the cyclic convolution of the zero-padded
+// density equals the open-boundary sum; the cell itself uses r = 1
+void ParticleMesh::make_green() {
+
+	const std::size_t m = 2 * this->grid;
+	this->work.resize(m * m * m);
+	auto *wk = this->work.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->work),
+									std::end(this->work), [=](std::complex<float> &w) {
+		const std::size_t c = &w - wk;
+		const auto wrap = [=](std::size_t i) {
+			return static_cast<float>(i < m / 2 ? i : m - i);
+		};
+		const float dx = wrap(c % m);
+		const float dy = wrap((c / m) % m);
+		const float dz = wrap(c / (m * m));
+		const float r = std::sqrt(dx * dx + dy * dy + dz * dz);
+		w = std::complex<float>(-1.0f / std::max(r, 1.0f), 0.0f);
+	});
+
+	for (int axis = 0; axis < 3; axis++) {
+		this->fft.transform_axis(wk, axis, false, m, m);
+	}
+
+	this->green.resize(m * m * m);
+	std::transform(std::execution::par_unseq, std::begin(this->work), std::end(this->work),
+		std::begin(this->green), [](const std::complex<float> &w) { return w.real(); });
+}
+
+
+// Potential by FFT convolution; lines that are known to be zero on the way
+// in, or not needed on the way out, are skipped
+void ParticleMesh::convolve() {
+
+	const std::size_t g = this->grid;
+	const std::size_t m = 2 * g;
+	auto *wk = this->work.data();
+	auto const *rho = this->Rho.data();
+	auto *phi = this->Phi.data();
+
+	std::fill(std::execution::par_unseq, std::begin(this->work), std::end(this->work),
+	          std::complex<float>(0.0f, 0.0f));
+
+	std::vector<std::size_t> rows(g * g);
+	std::iota(std::begin(rows), std::end(rows), 0);
+	std::for_each(std::execution::par_unseq, std::begin(rows),
+									std::end(rows), [=](std::size_t r) {
+		const std::size_t j = r % g;
+		const std::size_t k = r / g;
+		for (std::size_t i = 0; i < g; i++) {
+			wk[(k * m + j) * m + i] = rho[r * g + i];
+		}
+	});
+
+	this->fft.transform_axis(wk, 0, false, g, g);
+	this->fft.transform_axis(wk, 1, false, m, g);
+	this->fft.transform_axis(wk, 2, false, m, m);
+
+	std::transform(std::execution::par_unseq, std::begin(this->work), std::end(this->work),
+		std::begin(this->green), std::begin(this->work),
+		[](const std::complex<float> &w, float green) { return w * green; });
+
+	this->fft.transform_axis(wk, 2, true, m, m);
+	this->fft.transform_axis(wk, 1, true, m, g);
+	this->fft.transform_axis(wk, 0, true, g, g);
+
+	// Inverse transform scale, and 1/r in cell units to physical units
+	const float scale = 1.0f / (static_cast<float>(m * m * m) * this->h);
+	std::for_each(std::execution::par_unseq, std::begin(rows),
+									std::end(rows), [=](std::size_t r) {
+		const std::size_t j = r % g;
+		const std::size_t k = r / g;
+		for (std::size_t i = 0; i < g; i++) {
+			phi[r * g + i] = wk[(k * m + j) * m + i].real() * scale;
+		}
+	});
+}
+
+
+// Acceleration field -grad(phi) by central differences, one-sided at the faces
+void ParticleMesh::gradient() {
+
+	const std::size_t g = this->grid;
+	auto const *phi = this->Phi.data();
+	auto *gx = this->GX.data();
+	auto *gy = this->GY.data();
+	auto *gz = this->GZ.data();
+	const float inv_h = 1.0f / this->h;
+
+	std::vector<std::size_t> rows(g * g);
+	std::iota(std::begin(rows), std::end(rows), 0);
+	std::for_each(std::execution::par_unseq, std::begin(rows),
+									std::end(rows), [=](std::size_t r) {
+		const std::size_t j = r % g;
+		const std::size_t k = r / g;
+		const auto diff = [=](std::size_t c, std::size_t p, std::size_t stride) {
+			const std::size_t lo = (p > 0) ? c - stride : c;
+			const std::size_t hi = (p + 1 < g) ? c + stride : c;
+			const float span = static_cast<float>(((p + 1 < g) ? 1 : 0) + ((p > 0) ? 1 : 0));
+			return -(phi[hi] - phi[lo]) * inv_h / span;
+		};
+		for (std::size_t i = 0; i < g; i++) {
+			const std::size_t c = r * g + i;
+			gx[c] = diff(c, i, 1);
+			gy[c] = diff(c, j, g);
+			gz[c] = diff(c, k, g * g);
+		}
+	});
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+#include "simd_vec.hh"
+#include "fft.hh"
+
+// Particle-mesh gravity on a cubic grid with isolated boundaries
+// mass is deposited with cloud-in-cell (CIC) weights, the potential is the
+// convolution with the 1/r Green's function, done by FFT on a zero-padded grid
+// of twice the size, and the acceleration field is its finite-difference
+// gradient, interpolated back to the bodies with the same CIC weights
+class ParticleMesh {
+public:
+	ParticleMesh() = default;
+	// Finest grid: its zero-padded work grid of 512^3 complex cells takes
+	// 1 GiB, one finer would take 8 GiB
+	static constexpr std::size_t MAX_GRID = 256;
+	// grid is rounded up to a power of two, at most MAX_GRID
+	void solve(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+	           const SIMDVec *ms, std::size_t nbodies, std::size_t grid);
+	// CIC interpolation of the acceleration field at a position
+	void interpolate(float x, float y, float z, float &ax, float &ay, float &az) const;
+	std::size_t grid{0};      // Cells per axis
+	float lo[3]{};            // Position of cell (0, 0, 0)
+	float h{1.0f};            // Cell size
+	std::vector<float> Rho;   // Mass per cell, x fastest
+	std::vector<float> Phi;   // Potential per cell
+	std::vector<float> GX;    // Acceleration field per cell
+	std::vector<float> GY;
+	std::vector<float> GZ;
+private:
+	struct KeyIndex {
+		std::uint32_t key; // x-y column of the cell the body falls in
+		std::uint32_t idx;
+	};
+	std::vector<KeyIndex> keys;
+	std::vector<std::uint32_t> column_start;
+	std::vector<std::complex<float>> work;
+	std::vector<float> green; // Transform of the Green's function (real, even)
+	FFT fft;
+	void deposit(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+	             const SIMDVec *ms, std::size_t nbodies);
+	void make_green();
+	void convolve();
+	void gradient();
+};
+
+
+// Cell and offset along one axis, clamped so that cells c and c + 1 exist
+inline void cic_cell(float p, float lo, float inv_h, std::size_t grid,
+                     std::size_t &c, float &f) {
+	float u = (p - lo) * inv_h;
+	if (u < 0.0f) u = 0.0f;
+	if (u > static_cast<float>(grid - 2)) u = static_cast<float>(grid - 2);
+	c = static_cast<std::size_t>(u);
+	if (c > grid - 2) c = grid - 2;
+	f = u - static_cast<float>(c);
+}
+
+
+inline void ParticleMesh::interpolate(float x, float y, float z,
+                                      float &ax, float &ay, float &az) const {
+	const std::size_t g = this->grid;
+	const float inv_h = 1.0f / this->h;
+	std::size_t i, j, k;
+	float fx, fy, fz;
+	cic_cell(x, this->lo[0], inv_h, g, i, fx);
+	cic_cell(y, this->lo[1], inv_h, g, j, fy);
+	cic_cell(z, this->lo[2], inv_h, g, k, fz);
+
+	ax = 0.0f;
+	ay = 0.0f;
+	az = 0.0f;
+	for (std::size_t c = 0; c < 8; c++) {
+		const std::size_t di = c & 1, dj = (c >> 1) & 1, dk = c >> 2;
+		const float w = (di ? fx : 1.0f - fx) * (dj ? fy : 1.0f - fy) * (dk ? fz : 1.0f - fz);
+		const std::size_t cell = ((k + dk) * g + (j + dj)) * g + (i + di);
+		ax += w * this->GX[cell];
+		ay += w * this->GY[cell];
+		az += w * this->GZ[cell];
+	}
+}
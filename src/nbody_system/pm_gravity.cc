@@ -0,0 +1,33 @@
+
+#include <execution>
+#include <algorithm>
+
+#include "system.hh"
+
+// Particle-mesh force evaluation
+// every body is deposited on the mesh, but only the target chunks gather
+void System::accumulate_forces_PM(const std::vector<std::size_t> &targets) {
+
+	this->mesh.solve(this->PosX.data(), this->PosY.data(), this->PosZ.data(),
+	                 this->Mass.data(), this->num_bodies,
+	                 static_cast<std::size_t>(std::max(this->pm_grid, 0)));
+
+	auto const *px = this->PosX.data();
+	auto const *py = this->PosY.data();
+	auto const *pz = this->PosZ.data();
+	auto *ax = this->AccX.data();
+	auto *ay = this->AccY.data();
+	auto *az = this->AccZ.data();
+	const ParticleMesh *mesh = &this->mesh;
+	const std::size_t n = this->num_bodies;
+
+	std::for_each(std::execution::par_unseq, std::begin(targets),
+									std::end(targets), [=](std::size_t i) {
+		// Ghosts in the last chunk keep their zero acceleration
+		const std::size_t lanes = std::min(CHUNK, n - i * CHUNK);
+		for (std::size_t j = 0; j < lanes; j++) {
+			mesh->interpolate(px[i].data[j], py[i].data[j], pz[i].data[j],
+			                  ax[i].data[j], ay[i].data[j], az[i].data[j]);
+		}
+	});
+}
@@ -0,0 +1,90 @@
+
+#include <numeric>
+
+#if defined(ENABLE_PROFILING) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "profile.hh"
+
+const char *step_phase_name(StepPhase phase) {
+	switch (phase) {
+	case StepPhase::Kick: return "Kick";
+	case StepPhase::Drift: return "Drift";
+	case StepPhase::Forces: return "Forces";
+	case StepPhase::Levels: return "Levels";
+	case StepPhase::Sort: return "Sort";
+	}
+	return "Unknown";
+}
+
+
+double StepStats::total_seconds() const {
+	return std::accumulate(std::begin(this->seconds), std::end(this->seconds), 0.0);
+}
+
+
+#if defined(ENABLE_PROFILING) && defined(__linux__)
+
+namespace {
+int open_event(std::uint64_t config) {
+	perf_event_attr attr{};
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+}; // namespace
+
+
+bool HwCounters::open() {
+	if (is_open()) return true;
+	const std::uint64_t events[3] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	                                 PERF_COUNT_HW_CACHE_MISSES};
+	for (int i = 0; i < 3; i++) {
+		this->fd[i] = open_event(events[i]);
+		if (this->fd[i] < 0) {
+			close();
+			return false;
+		}
+	}
+	for (int f : this->fd) {
+		ioctl(f, PERF_EVENT_IOC_RESET, 0);
+		ioctl(f, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	return true;
+}
+
+
+void HwCounters::close() {
+	for (int &f : this->fd) {
+		if (f >= 0) ::close(f);
+		f = -1;
+	}
+}
+
+
+HwCounts HwCounters::read() const {
+	std::uint64_t v[3] = {0, 0, 0};
+	if (is_open()) {
+		for (int i = 0; i < 3; i++) {
+			if (::read(this->fd[i], &v[i], sizeof(v[i])) != sizeof(v[i])) v[i] = 0;
+		}
+	}
+	return HwCounts{v[0], v[1], v[2]};
+}
+
+#elif defined(ENABLE_PROFILING)
+
+bool HwCounters::open() { return false; }
+void HwCounters::close() {}
+HwCounts HwCounters::read() const { return HwCounts(); }
+
+#endif
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+// Phases of System::advance
+enum class StepPhase {
+	Kick,   // update_velocities / kick_block
+	Drift,  // update_positions
+	Forces, // compute_forces, including tree or mesh construction
+	Levels, // Block timestep level assignment and active chunk selection
+	Sort,   // sort_bodies
+};
+constexpr std::size_t STEP_PHASES = 5;
+
+const char *step_phase_name(StepPhase phase);
+
+// Hardware event counts, summed over the counted threads
+struct HwCounts {
+	std::uint64_t cycles{0};
+	std::uint64_t instructions{0};
+	std::uint64_t cache_misses{0}; // Last-level cache misses
+};
+
+// Timings and counters of one or more steps
+struct StepStats {
+	std::uint64_t steps{0};
+	double seconds[STEP_PHASES]{};
+	std::uint64_t pair_interactions{0}; // Body-body force evaluations
+	std::uint64_t cell_interactions{0}; // Body-cell (Barnes-Hut) or cell-cell (FMM) expansions
+	HwCounts hw;
+	double total_seconds() const;
+	void clear() { *this = StepStats(); }
+};
+
+// Profile of a System: the most recent step and the sum since the last reset
+struct StepProfile {
+	StepStats last;
+	StepStats total;
+	bool hw_available{false}; // Hardware counters opened successfully
+	void add_time(StepPhase phase, double seconds) {
+		last.seconds[static_cast<std::size_t>(phase)] += seconds;
+		total.seconds[static_cast<std::size_t>(phase)] += seconds;
+	}
+	void add_interactions(std::uint64_t pairs, std::uint64_t cells) {
+		last.pair_interactions += pairs;
+		last.cell_interactions += cells;
+		total.pair_interactions += pairs;
+		total.cell_interactions += cells;
+	}
+	void reset() { last.clear(); total.clear(); }
+};
+
+#ifdef ENABLE_PROFILING
+
+// Cycle, instruction and cache miss counters from perf_event_open (Linux)
+// events are counted for the calling thread and the threads it creates after
+// open(); worker threads that already exist are not included, so counts are
+// exact with one thread and a lower bound otherwise. Copies start closed
+class HwCounters {
+public:
+	HwCounters() = default;
+	HwCounters(const HwCounters &) {}
+	HwCounters &operator=(const HwCounters &) { return *this; }
+	~HwCounters() { close(); }
+	bool open();
+	void close();
+	bool is_open() const { return fd[0] >= 0; }
+	HwCounts read() const;
+private:
+	int fd[3]{-1, -1, -1};
+};
+
+// Brackets one System::advance: clears the last step, opens or closes the
+// hardware counters as requested, and records their change over the step
+class ScopedStep {
+public:
+	ScopedStep(StepProfile &profile, HwCounters &counters, bool use_hw)
+		: profile(profile), counters(counters) {
+		if (use_hw && !counters.is_open()) counters.open();
+		if (!use_hw && counters.is_open()) counters.close();
+		profile.hw_available = counters.is_open();
+		profile.last.clear();
+		start = counters.read();
+	}
+	~ScopedStep() {
+		const HwCounts stop = counters.read();
+		const HwCounts delta{stop.cycles - start.cycles, stop.instructions - start.instructions,
+		                     stop.cache_misses - start.cache_misses};
+		for (StepStats *s : {&profile.last, &profile.total}) {
+			s->steps += 1;
+			s->hw.cycles += delta.cycles;
+			s->hw.instructions += delta.instructions;
+			s->hw.cache_misses += delta.cache_misses;
+		}
+	}
+private:
+	StepProfile &profile;
+	HwCounters &counters;
+	HwCounts start;
+};
+
+// Adds the lifetime of the scope to a phase of a StepProfile
+class ScopedPhase {
+public:
+	ScopedPhase(StepProfile &profile, StepPhase phase)
+		: profile(profile), phase(phase), start(std::chrono::steady_clock::now()) {}
+	~ScopedPhase() {
+		const auto stop = std::chrono::steady_clock::now();
+		profile.add_time(phase, std::chrono::duration<double>(stop - start).count());
+	}
+private:
+	StepProfile &profile;
+	StepPhase phase;
+	std::chrono::steady_clock::time_point start;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_STEP(profile, counters, use_hw) \
+	ScopedStep PROFILE_CONCAT(scoped_step_, __LINE__)(profile, counters, use_hw)
+#define PROFILE_PHASE(profile, phase) \
+	ScopedPhase PROFILE_CONCAT(scoped_phase_, __LINE__)(profile, phase)
+#define PROFILE_INTERACTIONS(profile, pairs, cells) (profile).add_interactions(pairs, cells)
+
+#else
+
+#define PROFILE_STEP(profile, counters, use_hw)
+#define PROFILE_PHASE(profile, phase)
+#define PROFILE_INTERACTIONS(profile, pairs, cells)
+
+#endif
@@ -0,0 +1,208 @@
+
+#include <execution>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scenario.hh"
+#include "system.hh"
+#include "initial_condition.hh"
+#include "snapshot.hh"
+
+namespace {
+// Text is split into blocks of about this many bytes, parsed in parallel
+constexpr std::size_t CSV_BLOCK_BYTES = std::size_t{1} << 22;
+
+std::vector<Scenario> &registry() {
+	static std::vector<Scenario> list = {
+		{"rotating_4", "4 galaxies orbiting a large mass", rotating_4, MIN_BODIES},
+		{"frisbee", "Disc in circular orbits about a large mass", frisbee, 2},
+		{"plummer", "Plummer sphere in equilibrium", plummer, 1},
+		{"uniform_cube", "Cold uniform cube, collapsing", uniform_cube, 1},
+	};
+	return list;
+}
+
+// Read-only mapping of a whole file
+struct MappedFile {
+	MappedFile(const std::string &path) {
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *map = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ,
+			                   MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				this->data = static_cast<const char *>(map);
+				this->size = static_cast<std::size_t>(st.st_size);
+				// Pages are read ahead as the blocks advance and, being clean,
+				// can be dropped again under memory pressure
+				::madvise(map, this->size, MADV_SEQUENTIAL);
+			}
+		}
+		::close(fd);
+	}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	~MappedFile() {
+		if (this->data) ::munmap(const_cast<char *>(this->data), this->size);
+	}
+	const char *data{nullptr};
+	std::size_t size{0};
+};
+
+bool is_separator(char c) {
+	return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+// A line holds a body if it starts with a number
+bool is_body_line(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	return p < end && (std::isdigit(static_cast<unsigned char>(*p)) ||
+	                   *p == '-' || *p == '+' || *p == '.');
+}
+
+// Start of the first line at or after pos
+std::size_t line_start(const MappedFile &file, std::size_t pos) {
+	if (pos == 0) return 0;
+	if (pos >= file.size) return file.size;
+	const void *nl = std::memchr(file.data + pos - 1, '\n', file.size - pos + 1);
+	return nl ? static_cast<std::size_t>(static_cast<const char *>(nl) - file.data) + 1 : file.size;
+}
+
+// Applies fn(line, line_end) to every line in [begin, end)
+template <class LineFn>
+void for_each_line(const MappedFile &file, std::size_t begin, std::size_t end, LineFn fn) {
+	const char *p = file.data + begin;
+	const char *stop = file.data + end;
+	while (p < stop) {
+		const char *nl = static_cast<const char *>(std::memchr(p, '\n', stop - p));
+		const char *line_end = nl ? nl : stop;
+		if (!fn(p, line_end)) return;
+		p = line_end + 1;
+	}
+}
+
+// The seven fields of one line; false on anything else
+bool parse_body(const char *p, const char *end, float (&fields)[IC_FIELDS]) {
+	for (float &f : fields) {
+		while (p < end && is_separator(*p)) p++;
+		if (p < end && *p == '+') p++;
+		const std::from_chars_result res = std::from_chars(p, end, f);
+		if (res.ec != std::errc()) return false;
+		p = res.ptr;
+	}
+	while (p < end && is_separator(*p)) p++;
+	return p == end;
+}
+}; // namespace
+
+
+bool register_scenario(const Scenario &scenario) {
+	if (!scenario.generate || find_scenario(scenario.name)) return false;
+	registry().push_back(scenario);
+	return true;
+}
+
+
+const std::vector<Scenario> &scenarios() {
+	return registry();
+}
+
+
+const Scenario *find_scenario(const std::string &name) {
+	for (const Scenario &s : registry()) {
+		if (s.name == name) return &s;
+	}
+	return nullptr;
+}
+
+
+IcFormat ic_format(const std::string &path) {
+	if (is_snapshot(path)) return IcFormat::Snapshot;
+	const std::size_t dot = path.find_last_of('.');
+	const std::string ext = dot == std::string::npos ? "" : path.substr(dot);
+	return ext == ".csv" || ext == ".txt" ? IcFormat::Csv : IcFormat::Binary;
+}
+
+
+// Two passes over the mapped file: count the bodies of each block, then, with
+// the body count known and the arrays allocated, parse every block into its
+// own range of bodies
+bool System::load_initial_conditions(const std::string &path) {
+
+	const IcFormat format = ic_format(path);
+	if (format == IcFormat::Snapshot) return read_snapshot(path);
+
+	const MappedFile file(path);
+	if (!file.data) return false;
+	constexpr auto max_bodies = static_cast<std::size_t>(std::numeric_limits<int>::max());
+	std::vector<SIMDVec> *arrays[IC_FIELDS] = {
+		&this->PosX, &this->PosY, &this->PosZ, &this->VelX, &this->VelY, &this->VelZ, &this->Mass};
+
+	if (format == IcFormat::Binary) {
+		constexpr std::size_t record = IC_FIELDS * sizeof(float);
+		const std::size_t n = file.size / record;
+		if (file.size % record != 0 || n > max_bodies) return false;
+
+		allocate(static_cast<int>(n));
+		std::for_each(std::execution::par, std::begin(this->Cidx), std::end(this->Cidx),
+		              [&](std::size_t ii) {
+			const std::size_t lanes = std::min(CHUNK, n - ii * CHUNK);
+			for (std::size_t jj = 0; jj < lanes; jj++) {
+				float fields[IC_FIELDS];
+				std::memcpy(fields, file.data + (ii * CHUNK + jj) * record, record);
+				for (std::size_t f = 0; f < IC_FIELDS; f++) (*arrays[f])[ii].data[jj] = fields[f];
+			}
+		});
+		return true;
+	}
+
+	const std::size_t blocks = (file.size + CSV_BLOCK_BYTES - 1) / CSV_BLOCK_BYTES;
+	std::vector<std::size_t> block(blocks);
+	std::iota(std::begin(block), std::end(block), 0);
+	std::vector<std::size_t> count(blocks + 1, 0);
+	std::for_each(std::execution::par, std::begin(block), std::end(block), [&](std::size_t b) {
+		for_each_line(file, line_start(file, b * CSV_BLOCK_BYTES),
+		              line_start(file, (b + 1) * CSV_BLOCK_BYTES),
+		              [&](const char *line, const char *end) {
+			if (is_body_line(line, end)) count[b + 1]++;
+			return true;
+		});
+	});
+	// count[b] becomes the first body of block b
+	std::inclusive_scan(std::begin(count), std::end(count), std::begin(count));
+	const std::size_t n = count[blocks];
+	if (n == 0 || n > max_bodies) return false;
+
+	allocate(static_cast<int>(n));
+	std::atomic<bool> ok{true};
+	std::for_each(std::execution::par, std::begin(block), std::end(block), [&](std::size_t b) {
+		std::size_t idx = count[b];
+		for_each_line(file, line_start(file, b * CSV_BLOCK_BYTES),
+		              line_start(file, (b + 1) * CSV_BLOCK_BYTES),
+		              [&](const char *line, const char *end) {
+			if (!is_body_line(line, end)) return true;
+			float fields[IC_FIELDS];
+			if (!parse_body(line, end, fields)) {
+				ok = false;
+				return false;
+			}
+			for (std::size_t f = 0; f < IC_FIELDS; f++) {
+				(*arrays[f])[idx / CHUNK].data[idx % CHUNK] = fields[f];
+			}
+			idx++;
+			return true;
+		});
+	});
+	return ok;
+}
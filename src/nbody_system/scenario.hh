@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class System;
+
+// Named initial conditions
+// a scenario fills the positions, velocities and masses of a System that
+// setup() has already allocated for the body count; the ghost lanes of the
+// last chunk must keep their zeros. Built in: rotating_4 (the default),
+// frisbee, plummer and uniform_cube
+using ScenarioGenerator = void (*)(System &system);
+
+struct Scenario {
+	std::string name;
+	std::string description;
+	ScenarioGenerator generate{nullptr};
+	int min_bodies{1};
+};
+
+constexpr const char *DEFAULT_SCENARIO = "rotating_4";
+
+// Adds a scenario to the registry; false if the name is taken. Register
+// before any System is set up, the registry is not locked
+bool register_scenario(const Scenario &scenario);
+const std::vector<Scenario> &scenarios();
+// nullptr for an unknown name
+const Scenario *find_scenario(const std::string &name);
+
+// External initial condition files, read by System::load_initial_conditions
+// one body per record, seven fields: x y z vx vy vz mass
+//   Csv: a text line per body, fields separated by commas or white space;
+//     blank lines and lines that do not start with a number (headers,
+//     comments) are skipped
+//   Binary: packed float32 records in native byte order, no header
+// Snapshots (System::write_snapshot) are recognized by their magic. The file
+// is mapped and parsed in parallel blocks straight into the SoA arrays, so
+// it is never held in memory as a whole, nor copied into temporaries
+enum class IcFormat {
+	Csv,
+	Binary,
+	Snapshot,
+};
+constexpr std::size_t IC_FIELDS = 7;
+
+// By magic, then by extension: .csv and .txt are Csv, anything else Binary
+IcFormat ic_format(const std::string &path);
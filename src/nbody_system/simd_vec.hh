@@ -1,15 +1,17 @@
 
 #pragma once
 
-#ifdef ENABLE_AVX
-    constexpr std::size_t ALIGN = 32;
-    constexpr std::size_t CHUNK = 8;
-#elif defined ENABLE_CUDA
+#include <cstddef>
+
+// On the CPU a chunk is as wide as the widest supported vector (AVX-512),
+// so one layout serves every kernel: narrower instruction sets process
+// each chunk as several vectors (2 x AVX2, 4 x SSE, 16 x scalar)
+#ifdef ENABLE_CUDA
     constexpr std::size_t ALIGN = 4;
     constexpr std::size_t CHUNK = 1;
 #else
-    constexpr std::size_t ALIGN = 16;
-    constexpr std::size_t CHUNK = 4;
+    constexpr std::size_t ALIGN = 64;
+    constexpr std::size_t CHUNK = 16;
 #endif
 
 
@@ -0,0 +1,216 @@
+
+#include <execution>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <numeric>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.hh"
+#include "system.hh"
+
+namespace {
+constexpr char SNAPSHOT_MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P'};
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr std::uint64_t PAGE = 4096;
+
+std::uint64_t round_up(std::uint64_t n, std::uint64_t m) {
+	return (n + m - 1) / m * m;
+}
+
+// Offset of the body IDs, after the last array
+std::uint64_t ids_offset(const SnapshotHeader &head) {
+	return round_up(head.offset[SNAPSHOT_FIELDS - 1] + head.stride * sizeof(float), PAGE);
+}
+}; // namespace
+
+
+bool write_snapshot(const std::string &path, const SnapshotView &view) {
+
+	if (view.num_bodies == 0) return false;
+	const std::uint64_t stride = round_up(view.num_bodies, CHUNK);
+	const std::uint64_t bytes = stride * sizeof(float);
+
+	SnapshotHeader head{};
+	std::memcpy(head.magic, SNAPSHOT_MAGIC, sizeof(head.magic));
+	head.version = SNAPSHOT_VERSION;
+	head.byte_order = BYTE_ORDER_MARK;
+	head.chunk = static_cast<std::uint32_t>(CHUNK);
+	head.num_bodies = view.num_bodies;
+	head.stride = stride;
+	head.elapsed_time = view.elapsed_time;
+	head.flags = view.id ? SNAPSHOT_BODY_IDS : 0;
+	std::uint64_t end = round_up(sizeof(SnapshotHeader), PAGE);
+	for (std::size_t f = 0; f < SNAPSHOT_FIELDS; f++) {
+		head.offset[f] = end;
+		end = round_up(end + bytes, PAGE);
+	}
+	if (view.id) end = round_up(end + stride * sizeof(std::uint32_t), PAGE);
+
+	const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	if (::ftruncate(fd, static_cast<off_t>(end)) != 0) {
+		::close(fd);
+		return false;
+	}
+	void *map = ::mmap(nullptr, end, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) return false;
+
+	auto *out = static_cast<char *>(map);
+	std::memcpy(out, &head, sizeof(head));
+	std::array<std::size_t, SNAPSHOT_FIELDS> fields;
+	std::iota(std::begin(fields), std::end(fields), 0);
+	std::for_each(std::execution::par, std::begin(fields), std::end(fields), [&](std::size_t f) {
+		std::memcpy(out + head.offset[f], view.field[f], bytes);
+	});
+	if (view.id) std::memcpy(out + ids_offset(head), view.id, stride * sizeof(std::uint32_t));
+
+	const bool synced = (::msync(map, end, MS_ASYNC) == 0);
+	::munmap(map, end);
+	return synced;
+}
+
+
+bool SnapshotReader::open(const std::string &path) {
+
+	close();
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+		::close(fd);
+		return false;
+	}
+	const std::size_t size = static_cast<std::size_t>(st.st_size);
+	void *map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) return false;
+	this->base = map;
+	this->size = size;
+	this->head = static_cast<const SnapshotHeader *>(map);
+
+	// Reject foreign, newer, or truncated files
+	const SnapshotHeader &h = *this->head;
+	bool valid = std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) == 0 &&
+	             h.version == SNAPSHOT_VERSION && h.byte_order == BYTE_ORDER_MARK &&
+	             h.stride >= h.num_bodies;
+	for (std::size_t f = 0; valid && f < SNAPSHOT_FIELDS; f++) {
+		valid = h.offset[f] % alignof(SIMDVec) == 0 &&
+		        h.offset[f] + h.stride * sizeof(float) <= size;
+	}
+	if (valid && (h.flags & SNAPSHOT_BODY_IDS)) {
+		valid = ids_offset(h) + h.stride * sizeof(std::uint32_t) <= size;
+	}
+	if (!valid) {
+		close();
+		return false;
+	}
+	::madvise(this->base, this->size, MADV_SEQUENTIAL);
+	return true;
+}
+
+
+void SnapshotReader::close() {
+	if (this->base) ::munmap(this->base, this->size);
+	this->base = nullptr;
+	this->size = 0;
+	this->head = nullptr;
+}
+
+
+const float *SnapshotReader::field(SnapshotField f) const {
+	return reinterpret_cast<const float *>(static_cast<const char *>(this->base) +
+	                                       this->head->offset[static_cast<std::size_t>(f)]);
+}
+
+
+const std::uint32_t *SnapshotReader::ids() const {
+	if (!(this->head->flags & SNAPSHOT_BODY_IDS)) return nullptr;
+	return reinterpret_cast<const std::uint32_t *>(static_cast<const char *>(this->base) +
+	                                               ids_offset(*this->head));
+}
+
+
+bool is_snapshot(const std::string &path) {
+	std::ifstream in(path, std::ios::binary);
+	char magic[8];
+	return in.read(magic, sizeof(magic)) && std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
+
+
+void write_text_points(std::ostream &os, const float *x, const float *y, const float *z,
+                       std::size_t nbodies) {
+	os << std::setprecision(8);
+	os << "x y z\n";
+	os << "#coordflag xyz\n";
+	for (std::size_t i = 0; i < nbodies; i++) {
+		os << x[i] << " " << y[i] << " " << z[i] << "\n";
+	}
+}
+
+
+bool snapshot_to_text(const std::string &snapshot_path, const std::string &text_path) {
+
+	SnapshotReader reader;
+	if (!reader.open(snapshot_path)) return false;
+	std::ofstream outfile(text_path);
+	if (!outfile) return false;
+	write_text_points(outfile, reader.field(SnapshotField::PosX),
+	                  reader.field(SnapshotField::PosY), reader.field(SnapshotField::PosZ),
+	                  reader.header().num_bodies);
+	return static_cast<bool>(outfile);
+}
+
+
+bool System::write_snapshot(const std::string &path) const {
+
+	SnapshotView view;
+	view.num_bodies = static_cast<std::uint64_t>(this->num_bodies);
+	view.elapsed_time = this->elapsed_time;
+	const std::vector<SIMDVec> *arrays[SNAPSHOT_FIELDS] = {
+		&this->PosX, &this->PosY, &this->PosZ, &this->VelX, &this->VelY, &this->VelZ, &this->Mass};
+	for (std::size_t f = 0; f < SNAPSHOT_FIELDS; f++) view.field[f] = arrays[f]->data();
+	if (!this->Id.empty()) view.id = this->Id.data();
+	return ::write_snapshot(path, view);
+}
+
+
+// The arrays of the file replace the current state; accelerations start at
+// zero as after setup(). Body IDs come with the bodies if the file has them
+bool System::read_snapshot(const std::string &path) {
+
+	SnapshotReader reader;
+	if (!reader.open(path)) return false;
+	const SnapshotHeader &h = reader.header();
+	constexpr auto max_bodies = static_cast<std::uint64_t>(std::numeric_limits<int>::max());
+	if (h.num_bodies == 0 || h.num_bodies > max_bodies) {
+		return false;
+	}
+
+	allocate(static_cast<int>(h.num_bodies));
+	this->elapsed_time = static_cast<float>(h.elapsed_time);
+	std::vector<SIMDVec> *arrays[SNAPSHOT_FIELDS] = {
+		&this->PosX, &this->PosY, &this->PosZ, &this->VelX, &this->VelY, &this->VelZ, &this->Mass};
+	std::array<std::size_t, SNAPSHOT_FIELDS> fields;
+	std::iota(std::begin(fields), std::end(fields), 0);
+	std::for_each(std::execution::par, std::begin(fields), std::end(fields), [&](std::size_t f) {
+		std::memcpy(arrays[f]->data()->data, reader.field(static_cast<SnapshotField>(f)),
+		            h.num_bodies * sizeof(float));
+	});
+	if (const std::uint32_t *ids = reader.ids()) {
+		// The ghosts are numbered after the bodies, whatever the writer's chunk
+		this->Id.resize(this->Level.size());
+		std::copy(ids, ids + h.num_bodies, std::begin(this->Id));
+		std::iota(std::begin(this->Id) + h.num_bodies, std::end(this->Id),
+		          static_cast<std::uint32_t>(h.num_bodies));
+	}
+	return true;
+}
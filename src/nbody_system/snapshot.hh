@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "simd_vec.hh"
+
+// Binary snapshot format, version 1
+// a fixed header followed by the SoA arrays exactly as System holds them in
+// memory: each array is `stride` floats (num_bodies rounded up to whole
+// chunks) and starts on a page boundary, so a mapped file can be used in
+// place. With SNAPSHOT_BODY_IDS in flags, the System's Id array (stride
+// uint32) follows on the next page boundary after the last array. Data is
+// stored in the byte order of the writer, which the reader checks
+enum class SnapshotField {
+	PosX,
+	PosY,
+	PosZ,
+	VelX,
+	VelY,
+	VelZ,
+	Mass,
+};
+constexpr std::size_t SNAPSHOT_FIELDS = 7;
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+constexpr std::uint32_t SNAPSHOT_BODY_IDS = 1; // Flag
+
+struct SnapshotHeader {
+	char magic[8];              // "NBODYSNP"
+	std::uint32_t version;      // SNAPSHOT_VERSION
+	std::uint32_t byte_order;   // 0x01020304 as written
+	std::uint32_t chunk;        // CHUNK of the writer
+	std::uint32_t flags;
+	std::uint64_t num_bodies;
+	std::uint64_t stride;       // Floats per array
+	double elapsed_time;
+	std::uint64_t offset[SNAPSHOT_FIELDS]; // Byte offset of each array
+};
+
+// Arrays of one snapshot, in the SIMDVec layout of System
+struct SnapshotView {
+	std::uint64_t num_bodies{0};
+	double elapsed_time{0.0};
+	const SIMDVec *field[SNAPSHOT_FIELDS]{};
+	const std::uint32_t *id{nullptr}; // stride body IDs, or none
+};
+
+// Writes a snapshot through a shared mapping of the output file, with the
+// arrays copied in parallel
+bool write_snapshot(const std::string &path, const SnapshotView &view);
+
+// Read-only mapping of a snapshot file
+// the arrays are used in place: field() points into the mapping and stays
+// valid until the reader is closed or destroyed
+class SnapshotReader {
+public:
+	SnapshotReader() = default;
+	SnapshotReader(const SnapshotReader &) = delete;
+	SnapshotReader &operator=(const SnapshotReader &) = delete;
+	~SnapshotReader() { close(); }
+	bool open(const std::string &path);
+	void close();
+	bool is_open() const { return this->base != nullptr; }
+	const SnapshotHeader &header() const { return *this->head; }
+	const float *field(SnapshotField f) const;
+	const std::uint32_t *ids() const; // Null if the file has none
+private:
+	void *base{nullptr};
+	std::size_t size{0};
+	const SnapshotHeader *head{nullptr};
+};
+
+// True if path starts like a snapshot
+bool is_snapshot(const std::string &path);
+
+// Positions in the .3D point format of System::write_points
+void write_text_points(std::ostream &os, const float *x, const float *y, const float *z,
+                       std::size_t nbodies);
+
+// Converts a snapshot to the .3D point format
+bool snapshot_to_text(const std::string &snapshot_path, const std::string &text_path);
@@ -0,0 +1,517 @@
+
+#include <execution>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+#include "snapshot_stream.hh"
+#include "system.hh"
+#include "morton.hh"
+
+namespace {
+constexpr char STREAM_MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'S', 'T', 'R'};
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr std::uint64_t BLOCK_BODIES = 16384; // Bodies per independently coded block
+constexpr int RICE_ESCAPE = 16;               // Quotients this large are stored raw
+constexpr int RICE_PARAMETER_BITS = 6;
+
+struct StreamHeader {
+	char magic[8];              // "NBODYSTR"
+	std::uint32_t version;      // STREAM_VERSION
+	std::uint32_t byte_order;   // 0x01020304 as written
+	std::uint64_t num_bodies;
+	std::int32_t bits;
+	std::int32_t delta;
+	std::int32_t keyframe_interval;
+	std::uint32_t reserved;
+};
+
+// Followed by num_blocks block sizes (uint32) and the blocks themselves
+struct FrameHeader {
+	std::uint64_t payload_bytes;
+	double elapsed_time;
+	float lo[3];
+	float hi[3];
+	std::uint32_t keyframe;
+	std::uint32_t num_blocks;
+};
+
+std::uint64_t zigzag(std::int64_t d) {
+	return (static_cast<std::uint64_t>(d) << 1) ^ static_cast<std::uint64_t>(d >> 63);
+}
+
+std::int64_t unzigzag(std::uint64_t u) {
+	return static_cast<std::int64_t>(u >> 1) ^ -static_cast<std::int64_t>(u & 1);
+}
+
+std::uint64_t low_bits(int n) {
+	return n >= 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << n) - 1;
+}
+
+// Little-endian bit packing, least significant bit first, flushed to the
+// output 32 bits at a time
+class BitWriter {
+public:
+	explicit BitWriter(std::vector<std::uint8_t> &out) : out(out) {}
+	void put(std::uint64_t v, int n) { // n <= 32
+		this->acc |= (v & low_bits(n)) << this->fill;
+		this->fill += n;
+		if (this->fill >= 32) {
+			const std::size_t size = this->out.size();
+			this->out.resize(size + 4);
+			const auto word = static_cast<std::uint32_t>(this->acc);
+			std::memcpy(this->out.data() + size, &word, 4);
+			this->acc >>= 32;
+			this->fill -= 32;
+		}
+	}
+	void put_wide(std::uint64_t v, int n) { // n <= 64
+		if (n > 32) {
+			put(v, 32);
+			put(v >> 32, n - 32);
+		} else {
+			put(v, n);
+		}
+	}
+	// Unary quotient (ones closed by a zero), then k low bits
+	void put_rice(std::uint64_t v, int k) {
+		const std::uint64_t quotient = v >> k;
+		if (quotient >= RICE_ESCAPE) {
+			put(low_bits(RICE_ESCAPE), RICE_ESCAPE);
+			put_wide(v, 64);
+			return;
+		}
+		const int unary = static_cast<int>(quotient) + 1;
+		if (unary + k <= 32) {
+			put(low_bits(unary - 1) | (v & low_bits(k)) << unary, unary + k);
+		} else {
+			put(low_bits(unary - 1), unary);
+			put_wide(v, k);
+		}
+	}
+	void finish() {
+		for (; this->fill > 0; this->fill -= 8) {
+			this->out.push_back(static_cast<std::uint8_t>(this->acc));
+			this->acc >>= 8;
+		}
+		this->acc = 0;
+		this->fill = 0;
+	}
+private:
+	std::vector<std::uint8_t> &out;
+	std::uint64_t acc{0};
+	int fill{0};
+};
+
+class BitReader {
+public:
+	BitReader(const std::uint8_t *data, std::size_t bytes)
+		: p(data), end(data + bytes), limit(8 * bytes) {}
+	std::uint64_t get(int n) { // n <= 32
+		if (this->fill < n) refill();
+		const std::uint64_t v = this->acc & low_bits(n);
+		this->acc >>= n;
+		this->fill -= n;
+		this->consumed += static_cast<std::uint64_t>(n);
+		return v;
+	}
+	std::uint64_t get_wide(int n) {
+		if (n > 32) {
+			const std::uint64_t lo = get(32);
+			return lo | get(n - 32) << 32;
+		}
+		return get(n);
+	}
+	std::uint64_t get_rice(int k) {
+		if (this->fill < RICE_ESCAPE + 1) refill();
+		const int quotient = std::countr_one(this->acc);
+		if (quotient >= RICE_ESCAPE) {
+			get(RICE_ESCAPE);
+			return get_wide(64);
+		}
+		get(quotient + 1);
+		return static_cast<std::uint64_t>(quotient) << k | get_wide(k);
+	}
+	// False if more bits were taken than the block holds
+	bool ok() const { return this->consumed <= this->limit; }
+private:
+	// Past the end, zeros are shifted in and ok() reports the overrun
+	void refill() {
+		while (this->fill <= 56) {
+			const std::uint64_t byte = this->p < this->end ? *this->p++ : 0;
+			this->acc |= byte << this->fill;
+			this->fill += 8;
+		}
+	}
+	const std::uint8_t *p;
+	const std::uint8_t *end;
+	std::uint64_t limit;
+	std::uint64_t consumed{0};
+	std::uint64_t acc{0};
+	int fill{0};
+};
+
+// Rice parameter for residuals with this sum, close to optimal for a
+// geometric distribution
+int rice_parameter(double sum, std::size_t n) {
+	const double mean = sum / static_cast<double>(std::max<std::size_t>(n, 1)) * 0.6931;
+	return mean < 1.0 ? 0 : std::min(62, static_cast<int>(std::log2(mean)));
+}
+
+void encode_residuals(BitWriter &bits, const std::uint64_t *r, std::size_t n, double sum) {
+	const int k = rice_parameter(sum, n);
+	bits.put(static_cast<std::uint64_t>(k), RICE_PARAMETER_BITS);
+	for (std::size_t i = 0; i < n; i++) bits.put_rice(r[i], k);
+}
+
+// Grid codes of n positions; rounds to nearest and clamps to [0, maxq]
+void quantize_lanes(const SIMDVec *pos, std::size_t n, float lo, float scale,
+                    std::uint32_t maxq, std::uint32_t *code) {
+	const float top = static_cast<float>(maxq);
+	for (std::size_t c = 0; c * CHUNK < n; c++) {
+		const std::size_t lanes = std::min(CHUNK, n - c * CHUNK);
+		for (std::size_t l = 0; l < lanes; l++) {
+			const float s = std::min(std::max(0.0f, (pos[c].data[l] - lo) * scale + 0.5f), top);
+			code[c * CHUNK + l] = static_cast<std::uint32_t>(static_cast<std::int32_t>(s));
+		}
+	}
+}
+
+// Grid of a frame: the box grown a little, so it has some extent on every
+// axis and, for temporal coding, room for bodies to move before a keyframe
+void frame_grid(const BoundingCube &box, float margin, float lo[3], float hi[3]) {
+	for (int d = 0; d < 3; d++) {
+		const float extent = box.hi[d] - box.lo[d];
+		const float pad = margin * extent +
+			1e-6f * std::max({1.0f, std::abs(box.lo[d]), std::abs(box.hi[d])});
+		lo[d] = box.lo[d] - pad;
+		hi[d] = box.hi[d] + pad;
+	}
+}
+}; // namespace
+
+
+bool is_snapshot_stream(const std::string &path) {
+	std::FILE *f = std::fopen(path.c_str(), "rb");
+	if (!f) return false;
+	char magic[8];
+	const bool match = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+	                   std::memcmp(magic, STREAM_MAGIC, sizeof(magic)) == 0;
+	std::fclose(f);
+	return match;
+}
+
+
+bool SnapshotStreamWriter::open(const std::string &path, std::uint64_t num_bodies,
+                                const StreamSettings &settings) {
+
+	close();
+	const int max_bits = settings.delta == StreamDelta::Temporal ? STREAM_MAX_BITS
+	                                                             : STREAM_MAX_SFC_BITS;
+	if (num_bodies == 0 || num_bodies > std::numeric_limits<std::uint32_t>::max() ||
+	    settings.bits < 1 || settings.bits > max_bits || settings.keyframe_interval < 1) {
+		return false;
+	}
+	this->file = std::fopen(path.c_str(), "wb");
+	if (!this->file) return false;
+
+	StreamHeader head{};
+	std::memcpy(head.magic, STREAM_MAGIC, sizeof(head.magic));
+	head.version = STREAM_VERSION;
+	head.byte_order = BYTE_ORDER_MARK;
+	head.num_bodies = num_bodies;
+	head.bits = settings.bits;
+	head.delta = static_cast<std::int32_t>(settings.delta);
+	head.keyframe_interval = settings.keyframe_interval;
+	if (std::fwrite(&head, sizeof(head), 1, this->file) != 1) {
+		close();
+		return false;
+	}
+
+	this->num_bodies = num_bodies;
+	this->settings = settings;
+	this->num_frames = 0;
+	this->num_bytes = sizeof(head);
+	this->since_keyframe = 0;
+	for (std::vector<std::uint32_t> &a : this->q) a.assign(num_bodies, 0);
+	for (std::vector<std::int32_t> &a : this->dq) a.assign(num_bodies, 0);
+	if (settings.delta == StreamDelta::SpaceFillingCurve) this->keys.resize(num_bodies);
+	this->blocks.resize((num_bodies + BLOCK_BODIES - 1) / BLOCK_BODIES);
+	return true;
+}
+
+
+void SnapshotStreamWriter::close() {
+	if (this->file) std::fclose(this->file);
+	this->file = nullptr;
+}
+
+
+bool SnapshotStreamWriter::append(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                                  double elapsed_time) {
+
+	if (!this->file) return false;
+	const std::uint64_t nbodies = this->num_bodies;
+	const bool temporal = this->settings.delta == StreamDelta::Temporal;
+	const std::uint32_t maxq = static_cast<std::uint32_t>(low_bits(this->settings.bits));
+
+	// Blocks are whole chunks, so the loops below run over full SIMDVec lanes
+	std::vector<std::size_t> block_index(this->blocks.size());
+	std::iota(std::begin(block_index), std::end(block_index), 0);
+	const SIMDVec *pos[3] = {px, py, pz};
+
+	const BoundingCube box = bounding_cube(px, py, pz, static_cast<std::size_t>(nbodies));
+
+	// Temporal frames keep the grid of their keyframe while it holds every body
+	bool keyframe = !temporal || this->since_keyframe == 0 ||
+	                this->since_keyframe >= static_cast<std::uint32_t>(this->settings.keyframe_interval);
+	for (int d = 0; d < 3; d++) {
+		keyframe = keyframe || box.lo[d] < this->lo[d] || box.hi[d] > this->hi[d];
+	}
+	if (keyframe) frame_grid(box, temporal ? 0.125f : 0.0f, this->lo, this->hi);
+	this->since_keyframe = keyframe ? 1 : this->since_keyframe + 1;
+
+	float scale[3];
+	for (int d = 0; d < 3; d++) scale[d] = static_cast<float>(maxq) / (this->hi[d] - this->lo[d]);
+
+	if (!temporal) {
+		std::for_each(std::execution::par, std::begin(block_index), std::end(block_index),
+		              [&](std::size_t blk) {
+			const std::uint64_t first = blk * BLOCK_BODIES;
+			const std::size_t n = static_cast<std::size_t>(std::min(BLOCK_BODIES, nbodies - first));
+			std::vector<std::uint32_t> code[3];
+			for (int d = 0; d < 3; d++) {
+				code[d].resize(n);
+				quantize_lanes(pos[d] + first / CHUNK, n, this->lo[d], scale[d], maxq, code[d].data());
+			}
+			std::uint64_t *ks = this->keys.data() + first;
+			for (std::size_t i = 0; i < n; i++) ks[i] = morton_key(code[0][i], code[1][i], code[2][i]);
+		});
+		std::sort(std::execution::par_unseq, std::begin(this->keys), std::end(this->keys));
+	}
+
+	// Each block codes its residuals into its own buffer
+	std::for_each(std::execution::par, std::begin(block_index), std::end(block_index),
+	              [&](std::size_t blk) {
+		const std::uint64_t first = blk * BLOCK_BODIES;
+		const std::size_t n = static_cast<std::size_t>(std::min(BLOCK_BODIES, nbodies - first));
+		std::vector<std::uint64_t> residual(n);
+		std::vector<std::uint8_t> &out = this->blocks[blk];
+		out.clear();
+		BitWriter bits(out);
+
+		if (temporal) {
+			std::vector<std::uint32_t> code(n);
+			for (int d = 0; d < 3; d++) {
+				quantize_lanes(pos[d] + first / CHUNK, n, this->lo[d], scale[d], maxq, code.data());
+				std::uint32_t *qd = this->q[d].data() + first;
+				std::int32_t *vd = this->dq[d].data() + first;
+				std::uint64_t sum = 0;
+				if (keyframe) {
+					std::int64_t prev = 0;
+					for (std::size_t i = 0; i < n; i++) {
+						residual[i] = zigzag(std::int64_t{code[i]} - prev);
+						prev = code[i];
+					}
+					std::fill_n(vd, n, 0);
+				} else {
+					for (std::size_t i = 0; i < n; i++) {
+						const std::int64_t predicted = std::int64_t{qd[i]} + vd[i];
+						residual[i] = zigzag(std::int64_t{code[i]} - predicted);
+						vd[i] = static_cast<std::int32_t>(std::int64_t{code[i]} - qd[i]);
+					}
+				}
+				for (std::size_t i = 0; i < n; i++) sum += residual[i];
+				std::copy_n(code.data(), n, qd);
+				encode_residuals(bits, residual.data(), n, static_cast<double>(sum));
+			}
+		} else {
+			const std::uint64_t *ks = this->keys.data() + first;
+			std::uint64_t prev = 0;
+			double sum = 0.0;
+			for (std::size_t i = 0; i < n; i++) {
+				residual[i] = ks[i] - prev;
+				sum += static_cast<double>(residual[i]);
+				prev = ks[i];
+			}
+			encode_residuals(bits, residual.data(), n, sum);
+		}
+		bits.finish();
+	});
+
+	FrameHeader head{};
+	head.elapsed_time = elapsed_time;
+	for (int d = 0; d < 3; d++) {
+		head.lo[d] = this->lo[d];
+		head.hi[d] = this->hi[d];
+	}
+	head.keyframe = keyframe ? 1 : 0;
+	head.num_blocks = static_cast<std::uint32_t>(this->blocks.size());
+	std::vector<std::uint32_t> sizes(this->blocks.size());
+	for (std::size_t blk = 0; blk < this->blocks.size(); blk++) {
+		sizes[blk] = static_cast<std::uint32_t>(this->blocks[blk].size());
+		head.payload_bytes += sizes[blk];
+	}
+
+	bool ok = std::fwrite(&head, sizeof(head), 1, this->file) == 1 &&
+	          std::fwrite(sizes.data(), sizeof(std::uint32_t), sizes.size(), this->file) == sizes.size();
+	for (std::size_t blk = 0; ok && blk < this->blocks.size(); blk++) {
+		const std::vector<std::uint8_t> &out = this->blocks[blk];
+		ok = std::fwrite(out.data(), 1, out.size(), this->file) == out.size();
+	}
+	// Whole frames reach the file, so a reader can follow a running stream
+	ok = ok && std::fflush(this->file) == 0;
+	if (!ok) {
+		// The grid of the next frame must not depend on a frame that was lost
+		this->since_keyframe = 0;
+		return false;
+	}
+	this->num_frames++;
+	this->num_bytes += sizeof(head) + sizes.size() * sizeof(std::uint32_t) + head.payload_bytes;
+	return true;
+}
+
+
+bool SnapshotStreamWriter::append(const System &system) {
+	if (static_cast<std::uint64_t>(system.num_bodies) != this->num_bodies) return false;
+	return append(system.PosX.data(), system.PosY.data(), system.PosZ.data(), system.elapsed_time);
+}
+
+
+bool SnapshotStreamReader::open(const std::string &path) {
+
+	close();
+	this->file = std::fopen(path.c_str(), "rb");
+	if (!this->file) return false;
+
+	// Reject foreign, newer, or inconsistent files
+	StreamHeader head;
+	const bool valid = std::fread(&head, sizeof(head), 1, this->file) == 1 &&
+		std::memcmp(head.magic, STREAM_MAGIC, sizeof(head.magic)) == 0 &&
+		head.version == STREAM_VERSION && head.byte_order == BYTE_ORDER_MARK &&
+		head.num_bodies > 0 && head.num_bodies <= std::numeric_limits<std::uint32_t>::max() &&
+		(head.delta == static_cast<std::int32_t>(StreamDelta::Temporal) ||
+		 head.delta == static_cast<std::int32_t>(StreamDelta::SpaceFillingCurve)) &&
+		head.bits >= 1 &&
+		head.bits <= (head.delta == static_cast<std::int32_t>(StreamDelta::Temporal) ? STREAM_MAX_BITS
+		                                                                             : STREAM_MAX_SFC_BITS);
+	if (!valid) {
+		close();
+		return false;
+	}
+	this->nbodies = head.num_bodies;
+	this->stream_settings.bits = head.bits;
+	this->stream_settings.delta = static_cast<StreamDelta>(head.delta);
+	this->stream_settings.keyframe_interval = head.keyframe_interval;
+	this->have_keyframe = false;
+	this->index.resize(this->nbodies);
+	std::iota(std::begin(this->index), std::end(this->index), 0);
+	if (this->stream_settings.delta == StreamDelta::Temporal) {
+		for (std::vector<std::uint32_t> &a : this->q) a.assign(this->nbodies, 0);
+		for (std::vector<std::int32_t> &a : this->dq) a.assign(this->nbodies, 0);
+	} else {
+		this->keys.resize(this->nbodies);
+	}
+	return true;
+}
+
+
+void SnapshotStreamReader::close() {
+	if (this->file) std::fclose(this->file);
+	this->file = nullptr;
+}
+
+
+bool SnapshotStreamReader::next(StreamFrame &frame) {
+
+	if (!this->file) return false;
+	const std::uint64_t nbodies = this->nbodies;
+	const std::uint64_t num_blocks = (nbodies + BLOCK_BODIES - 1) / BLOCK_BODIES;
+	const bool temporal = this->stream_settings.delta == StreamDelta::Temporal;
+	const std::uint32_t maxq = static_cast<std::uint32_t>(low_bits(this->stream_settings.bits));
+
+	FrameHeader head;
+	if (std::fread(&head, sizeof(head), 1, this->file) != 1 || head.num_blocks != num_blocks ||
+	    (!head.keyframe && !this->have_keyframe)) {
+		return false;
+	}
+	this->block_bytes.resize(num_blocks);
+	if (std::fread(this->block_bytes.data(), sizeof(std::uint32_t), num_blocks, this->file) != num_blocks) {
+		return false;
+	}
+	std::vector<std::uint64_t> offset(num_blocks + 1, 0);
+	std::inclusive_scan(std::begin(this->block_bytes), std::end(this->block_bytes),
+	                    std::begin(offset) + 1, std::plus<>(), std::uint64_t{0});
+	if (offset.back() != head.payload_bytes) return false;
+	this->payload.resize(head.payload_bytes);
+	if (std::fread(this->payload.data(), 1, this->payload.size(), this->file) != this->payload.size()) {
+		return false;
+	}
+
+	std::vector<std::size_t> block_index(num_blocks);
+	std::iota(std::begin(block_index), std::end(block_index), 0);
+	const bool decoded = std::transform_reduce(std::execution::par,
+		std::begin(block_index), std::end(block_index), true, std::logical_and<>(),
+		[&](std::size_t blk) {
+			const std::uint64_t first = blk * BLOCK_BODIES;
+			const std::size_t n = static_cast<std::size_t>(std::min(BLOCK_BODIES, nbodies - first));
+			BitReader bits(this->payload.data() + offset[blk], this->block_bytes[blk]);
+			bool valid = true;
+			if (temporal) {
+				for (int d = 0; d < 3; d++) {
+					const int k = static_cast<int>(bits.get(RICE_PARAMETER_BITS));
+					std::uint32_t *qd = this->q[d].data() + first;
+					std::int32_t *vd = this->dq[d].data() + first;
+					std::int64_t prev = 0;
+					for (std::size_t i = 0; i < n; i++) {
+						const std::int64_t predicted = head.keyframe ? prev : std::int64_t{qd[i]} + vd[i];
+						const std::int64_t code = predicted + unzigzag(bits.get_rice(k));
+						valid = valid && code >= 0 && code <= maxq;
+						vd[i] = head.keyframe ? 0 : static_cast<std::int32_t>(code - qd[i]);
+						qd[i] = static_cast<std::uint32_t>(code);
+						prev = code;
+					}
+				}
+			} else {
+				const int k = static_cast<int>(bits.get(RICE_PARAMETER_BITS));
+				std::uint64_t *ks = this->keys.data() + first;
+				std::uint64_t prev = 0;
+				for (std::size_t i = 0; i < n; i++) prev = ks[i] = prev + bits.get_rice(k);
+			}
+			return valid && bits.ok();
+		});
+	if (!decoded) {
+		this->have_keyframe = false;
+		return false;
+	}
+	this->have_keyframe = true;
+
+	frame.elapsed_time = head.elapsed_time;
+	frame.x.resize(nbodies);
+	frame.y.resize(nbodies);
+	frame.z.resize(nbodies);
+	float lo[3], step[3];
+	for (int d = 0; d < 3; d++) {
+		lo[d] = head.lo[d];
+		step[d] = (head.hi[d] - head.lo[d]) / static_cast<float>(maxq);
+	}
+	float *out[3] = {frame.x.data(), frame.y.data(), frame.z.data()};
+	const std::uint32_t *qs[3] = {this->q[0].data(), this->q[1].data(), this->q[2].data()};
+	const std::uint64_t *ks = this->keys.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->index), std::end(this->index),
+	              [=](std::uint32_t b) {
+		std::uint32_t code[3];
+		if (temporal) {
+			for (int d = 0; d < 3; d++) code[d] = qs[d][b];
+		} else {
+			code[0] = morton_compact(ks[b] >> 2);
+			code[1] = morton_compact(ks[b] >> 1);
+			code[2] = morton_compact(ks[b]);
+		}
+		for (int d = 0; d < 3; d++) out[d][b] = lo[d] + static_cast<float>(code[d]) * step[d];
+	});
+	return true;
+}
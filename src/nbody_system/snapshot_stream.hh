@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "simd_vec.hh"
+
+class System;
+
+// Compressed position stream, version 1
+// a sequence of frames holding only positions, each quantized to `bits` bits
+// per axis on the grid of a bounding box. Residuals are Rice coded in
+// independent blocks of bodies, so frames are encoded and decoded in
+// parallel. Two ways to form the residuals:
+//   Temporal: difference from the same body in the previous frame, moved on
+//     by its displacement over the frame before that. The box is padded and
+//     kept until a body leaves it or `keyframe_interval` frames have passed;
+//     keyframes code each body against its neighbour in the arrays. Body
+//     order is preserved
+//   SpaceFillingCurve: every frame stands alone, bodies are sorted along a
+//     Morton curve and the gaps between consecutive keys are coded. Bodies
+//     come back in curve order, not in the order of System
+// Positions are stored in the byte order of the writer, which the reader
+// checks
+enum class StreamDelta {
+	Temporal,
+	SpaceFillingCurve,
+};
+constexpr std::uint32_t STREAM_VERSION = 1;
+constexpr int STREAM_MAX_BITS = 24;     // Temporal
+constexpr int STREAM_MAX_SFC_BITS = 21; // Three axes in one 64 bit key
+
+struct StreamSettings {
+	int bits{16};
+	StreamDelta delta{StreamDelta::Temporal};
+	int keyframe_interval{64};
+};
+
+struct StreamFrame {
+	double elapsed_time{0.0};
+	std::vector<float> x, y, z;
+};
+
+class SnapshotStreamWriter {
+public:
+	SnapshotStreamWriter() = default;
+	SnapshotStreamWriter(const SnapshotStreamWriter &) = delete;
+	SnapshotStreamWriter &operator=(const SnapshotStreamWriter &) = delete;
+	~SnapshotStreamWriter() { close(); }
+	// False if the file cannot be created or the settings are out of range
+	bool open(const std::string &path, std::uint64_t num_bodies, const StreamSettings &settings);
+	void close();
+	bool is_open() const { return this->file != nullptr; }
+	// Positions in the SIMDVec layout of System
+	bool append(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz, double elapsed_time);
+	bool append(const System &system);
+	std::uint64_t frames() const { return this->num_frames; }
+	std::uint64_t bytes() const { return this->num_bytes; } // Written so far
+private:
+	std::FILE *file{nullptr};
+	std::uint64_t num_bodies{0};
+	StreamSettings settings;
+	std::uint64_t num_frames{0};
+	std::uint64_t num_bytes{0};
+	std::uint32_t since_keyframe{0};
+	float lo[3]{}, hi[3]{};
+	std::vector<std::uint32_t> q[3];    // Quantized positions of the last frame
+	std::vector<std::int32_t> dq[3];    // and their change since the frame before
+	std::vector<std::uint64_t> keys;    // Morton keys, SpaceFillingCurve only
+	std::vector<std::vector<std::uint8_t>> blocks;
+};
+
+class SnapshotStreamReader {
+public:
+	SnapshotStreamReader() = default;
+	SnapshotStreamReader(const SnapshotStreamReader &) = delete;
+	SnapshotStreamReader &operator=(const SnapshotStreamReader &) = delete;
+	~SnapshotStreamReader() { close(); }
+	bool open(const std::string &path);
+	void close();
+	bool is_open() const { return this->file != nullptr; }
+	std::uint64_t num_bodies() const { return this->nbodies; }
+	const StreamSettings &settings() const { return this->stream_settings; }
+	// Decodes the next frame; false at the end of the stream or on a
+	// truncated or corrupt frame
+	bool next(StreamFrame &frame);
+private:
+	std::FILE *file{nullptr};
+	std::uint64_t nbodies{0};
+	StreamSettings stream_settings;
+	bool have_keyframe{false};
+	std::vector<std::uint32_t> index;
+	std::vector<std::uint32_t> q[3];
+	std::vector<std::int32_t> dq[3];
+	std::vector<std::uint64_t> keys;
+	std::vector<std::uint32_t> block_bytes;
+	std::vector<std::uint8_t> payload;
+};
+
+// True if path starts like a compressed stream
+bool is_snapshot_stream(const std::string &path);
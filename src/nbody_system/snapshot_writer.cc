@@ -0,0 +1,139 @@
+
+#include <execution>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <numeric>
+#include <utility>
+
+#include "snapshot_writer.hh"
+#include "system.hh"
+
+AsyncSnapshotWriter::AsyncSnapshotWriter(std::string prefix, int every, std::size_t depth)
+	: prefix(std::move(prefix)), every(std::max(every, 1)), buffers(std::max<std::size_t>(depth, 1)) {
+	this->free_list.resize(this->buffers.size());
+	std::iota(std::begin(this->free_list), std::end(this->free_list), 0);
+	this->worker = std::thread(&AsyncSnapshotWriter::run, this);
+}
+
+
+AsyncSnapshotWriter::AsyncSnapshotWriter(std::string prefix, const StreamSettings &stream,
+                                         int every, std::size_t depth)
+	: AsyncSnapshotWriter(std::move(prefix), every, depth) {
+	// The thread only reads these for a queued buffer, and none is queued yet
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->compress = true;
+	this->stream_settings = stream;
+}
+
+
+AsyncSnapshotWriter::~AsyncSnapshotWriter() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->filled.notify_one();
+	this->worker.join();
+}
+
+
+bool AsyncSnapshotWriter::submit(const System &system, std::int64_t step) {
+
+	if (step % this->every != 0) return false;
+
+	std::size_t b;
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		const auto t0 = std::chrono::steady_clock::now();
+		this->released.wait(lock, [this] { return !this->free_list.empty(); });
+		this->stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		b = this->free_list.back();
+		this->free_list.pop_back();
+	}
+
+	// The buffer is owned by this thread until it is queued
+	Buffer &buf = this->buffers[b];
+	buf.step = step;
+	buf.num_bodies = static_cast<std::uint64_t>(system.num_bodies);
+	buf.elapsed_time = system.elapsed_time;
+	const std::vector<SIMDVec> *arrays[SNAPSHOT_FIELDS] = {
+		&system.PosX, &system.PosY, &system.PosZ, &system.VelX, &system.VelY, &system.VelZ, &system.Mass};
+	// A compressed stream only holds positions
+	const std::size_t num_fields = this->compress ? 3 : SNAPSHOT_FIELDS;
+	std::array<std::size_t, SNAPSHOT_FIELDS> fields;
+	std::iota(std::begin(fields), std::end(fields), 0);
+	std::for_each(std::execution::par, std::begin(fields), std::begin(fields) + num_fields,
+	              [&](std::size_t f) {
+		buf.field[f].assign(std::begin(*arrays[f]), std::end(*arrays[f]));
+	});
+	if (!this->compress) buf.id = system.Id;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.push_back(b);
+	}
+	this->filled.notify_one();
+	return true;
+}
+
+
+void AsyncSnapshotWriter::flush() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->released.wait(lock, [this] { return this->queue.empty() && this->busy == 0; });
+}
+
+
+std::uint64_t AsyncSnapshotWriter::written() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->num_written;
+}
+
+
+std::uint64_t AsyncSnapshotWriter::failed() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->num_failed;
+}
+
+
+double AsyncSnapshotWriter::stall_seconds() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->stall;
+}
+
+
+// Writer thread: drains the queue in order, then exits once stopping is set
+void AsyncSnapshotWriter::run() {
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while (true) {
+		this->filled.wait(lock, [this] { return this->stopping || !this->queue.empty(); });
+		if (this->queue.empty()) break;
+		const std::size_t b = this->queue.front();
+		this->queue.pop_front();
+		this->busy++;
+		lock.unlock();
+
+		const Buffer &buf = this->buffers[b];
+		bool ok;
+		if (this->compress) {
+			if (!this->stream.is_open()) {
+				this->stream.open(this->prefix + ".nbs", buf.num_bodies, this->stream_settings);
+			}
+			ok = this->stream.append(buf.field[0].data(), buf.field[1].data(), buf.field[2].data(),
+			                         buf.elapsed_time);
+		} else {
+			SnapshotView view;
+			view.num_bodies = buf.num_bodies;
+			view.elapsed_time = buf.elapsed_time;
+			for (std::size_t f = 0; f < SNAPSHOT_FIELDS; f++) view.field[f] = buf.field[f].data();
+			if (!buf.id.empty()) view.id = buf.id.data();
+			ok = write_snapshot(this->prefix + "." + std::to_string(buf.step) + ".snap", view);
+		}
+
+		lock.lock();
+		this->busy--;
+		(ok ? this->num_written : this->num_failed)++;
+		this->free_list.push_back(b);
+		this->released.notify_all();
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "simd_vec.hh"
+#include "snapshot.hh"
+#include "snapshot_stream.hh"
+
+class System;
+
+// Background snapshot output
+// submit() copies the arrays of a System into one of `depth` preallocated
+// buffers and queues it for a writer thread, so the next steps overlap with
+// the disk I/O. When every buffer is queued or being written, submit() waits
+// for one to be released (backpressure) instead of growing memory. Only every
+// `every`-th step is written; files are named <prefix>.<step>.snap, or, with
+// StreamSettings, positions go as frames of one compressed <prefix>.nbs
+class AsyncSnapshotWriter {
+public:
+	AsyncSnapshotWriter(std::string prefix, int every = 1, std::size_t depth = 2);
+	AsyncSnapshotWriter(std::string prefix, const StreamSettings &stream, int every = 1,
+	                    std::size_t depth = 2);
+	AsyncSnapshotWriter(const AsyncSnapshotWriter &) = delete;
+	AsyncSnapshotWriter &operator=(const AsyncSnapshotWriter &) = delete;
+	// Writes everything still queued, then stops the thread
+	~AsyncSnapshotWriter();
+	// Queue a snapshot of system if step is a multiple of `every`;
+	// returns false when step is skipped
+	bool submit(const System &system, std::int64_t step);
+	// Wait until every queued snapshot is on disk
+	void flush();
+	std::uint64_t written() const;     // Snapshots written successfully
+	std::uint64_t failed() const;      // Snapshots that could not be written
+	double stall_seconds() const;      // Time submit() spent waiting for a buffer
+private:
+	struct Buffer {
+		std::int64_t step{0};
+		std::uint64_t num_bodies{0};
+		double elapsed_time{0.0};
+		std::vector<SIMDVec> field[SNAPSHOT_FIELDS];
+		std::vector<std::uint32_t> id;
+	};
+	void run();
+	std::string prefix;
+	int every;
+	bool compress{false};
+	StreamSettings stream_settings;
+	SnapshotStreamWriter stream; // Opened by the writer thread on the first frame
+	std::vector<Buffer> buffers;
+	std::vector<std::size_t> free_list; // Buffers ready to be filled
+	std::deque<std::size_t> queue;      // Filled buffers, oldest first
+	std::size_t busy{0};                // Buffers being written
+	bool stopping{false};
+	std::uint64_t num_written{0};
+	std::uint64_t num_failed{0};
+	double stall{0.0};
+	mutable std::mutex mutex;
+	std::condition_variable filled;   // Signals the writer thread
+	std::condition_variable released; // Signals submit() and flush()
+	std::thread worker;
+};
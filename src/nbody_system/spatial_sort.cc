@@ -0,0 +1,123 @@
+
+#include <execution>
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <utility>
+
+#include "spatial_sort.hh"
+#include "morton.hh"
+
+namespace {
+// Bodies a task counts and scatters in each radix pass
+constexpr std::size_t BLOCK = std::size_t{1} << 16;
+constexpr int RADIX_BITS = 8;
+constexpr std::size_t RADIX = std::size_t{1} << RADIX_BITS;
+constexpr int KEY_BITS = 3 * SORT_AXIS_BITS;
+}; // namespace
+
+
+// Least significant digit first: each block of bodies counts its digits, a
+// scan over digits then blocks turns the counts into offsets, and each block
+// scatters its bodies from there, which keeps every pass stable. A digit all
+// bodies share (the high bits of a small or tightly clustered system) takes
+// no pass
+void SpatialSort::sort(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz,
+                       std::size_t nbodies) {
+
+	this->nbodies = nbodies;
+	this->order.resize(nbodies);
+	this->keys.resize(nbodies);
+	this->next_keys.resize(nbodies);
+	this->next_order.resize(nbodies);
+	this->arena.resize((nbodies + CHUNK - 1) / CHUNK);
+	const std::size_t num_blocks = (nbodies + BLOCK - 1) / BLOCK;
+	this->blocks.resize(num_blocks);
+	std::iota(std::begin(this->blocks), std::end(this->blocks), 0);
+	std::iota(std::begin(this->order), std::end(this->order), 0);
+
+	// Bounding cube of all bodies, as for the octree
+	const BoundingCube box = bounding_cube(px, py, pz, nbodies);
+	const float inv_extent = 1.0f / box.extent;
+	const float lo_x = box.lo[0];
+	const float lo_y = box.lo[1];
+	const float lo_z = box.lo[2];
+
+	// The top SORT_AXIS_BITS of the octree's cells on each axis
+	constexpr int drop = MORTON_BITS - SORT_AXIS_BITS;
+	auto *ks = this->keys.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->order),
+	              std::end(this->order), [=](std::uint32_t b) {
+		const std::uint32_t ix = morton_cell(px[b / CHUNK].data[b % CHUNK], lo_x, inv_extent) >> drop;
+		const std::uint32_t iy = morton_cell(py[b / CHUNK].data[b % CHUNK], lo_y, inv_extent) >> drop;
+		const std::uint32_t iz = morton_cell(pz[b / CHUNK].data[b % CHUNK], lo_z, inv_extent) >> drop;
+		ks[b] = static_cast<std::uint32_t>(morton_key(ix, iy, iz));
+	});
+
+	for (int shift = 0; shift < KEY_BITS; shift += RADIX_BITS) {
+		this->offsets.assign(num_blocks * RADIX, 0);
+		std::for_each(std::execution::par, std::begin(this->blocks), std::end(this->blocks),
+		              [&](std::size_t b) {
+			std::uint32_t *count = this->offsets.data() + b * RADIX;
+			for (std::size_t i = b * BLOCK; i < std::min(nbodies, (b + 1) * BLOCK); i++) {
+				count[(this->keys[i] >> shift) & (RADIX - 1)]++;
+			}
+		});
+
+		bool shared = false;
+		std::uint32_t first = 0;
+		for (std::size_t d = 0; d < RADIX; d++) {
+			const std::uint32_t digit_first = first;
+			for (std::size_t b = 0; b < num_blocks; b++) {
+				const std::uint32_t count = this->offsets[b * RADIX + d];
+				this->offsets[b * RADIX + d] = first;
+				first += count;
+			}
+			shared |= first - digit_first == nbodies;
+		}
+		if (shared) continue;
+
+		std::for_each(std::execution::par, std::begin(this->blocks), std::end(this->blocks),
+		              [&](std::size_t b) {
+			std::uint32_t *offset = this->offsets.data() + b * RADIX;
+			for (std::size_t i = b * BLOCK; i < std::min(nbodies, (b + 1) * BLOCK); i++) {
+				const std::uint32_t s = offset[(this->keys[i] >> shift) & (RADIX - 1)]++;
+				this->next_keys[s] = this->keys[i];
+				this->next_order[s] = this->order[i];
+			}
+		});
+		std::swap(this->keys, this->next_keys);
+		std::swap(this->order, this->next_order);
+	}
+}
+
+
+// Gathers into the arena, then copies back, so data keeps its address and
+// the ghost lanes after the last body are left alone
+template <class T>
+void SpatialSort::gather(T *data) {
+	auto *out = reinterpret_cast<T *>(this->arena.data());
+	auto const *od = this->order.data();
+	std::for_each(std::execution::par_unseq, std::begin(this->order),
+	              std::end(this->order), [=](const std::uint32_t &b) {
+		out[&b - od] = data[b];
+	});
+	std::copy(std::execution::par_unseq, out, out + this->nbodies, data);
+}
+
+
+void SpatialSort::permute(SIMDVec *data) {
+	gather(data->data);
+}
+
+void SpatialSort::permute(std::uint8_t *data) {
+	gather(data);
+}
+
+void SpatialSort::permute(std::uint16_t *data) {
+	gather(data);
+}
+
+void SpatialSort::permute(std::uint32_t *data) {
+	gather(data);
+}
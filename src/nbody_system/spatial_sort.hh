@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "simd_vec.hh"
+
+// Order of the bodies along a Morton curve, to lay out neighbours in space
+// next to each other in memory
+// keys have SORT_AXIS_BITS bits per axis and are radix sorted in parallel,
+// a stable counting sort per digit. permute() reorders an array of the
+// System in place through a scratch arena; like the keys, it is kept from
+// one sort to the next, so sorting every few steps does not allocate
+constexpr int SORT_AXIS_BITS = 10;
+
+class SpatialSort {
+public:
+	SpatialSort() = default;
+	void sort(const SIMDVec *px, const SIMDVec *py, const SIMDVec *pz, std::size_t nbodies);
+	// Moves the body at order[i] to i, for the first nbodies elements of data
+	void permute(SIMDVec *data);
+	void permute(std::uint8_t *data);
+	void permute(std::uint16_t *data);
+	void permute(std::uint32_t *data);
+	std::vector<std::uint32_t> order; // Sorted position -> body index
+private:
+	template <class T> void gather(T *data);
+	std::size_t nbodies{0};
+	std::vector<std::uint32_t> keys;
+	std::vector<std::uint32_t> next_keys;  // Output of a radix pass
+	std::vector<std::uint32_t> next_order;
+	std::vector<std::uint32_t> offsets;    // Per block digit counts, then offsets
+	std::vector<std::size_t> blocks;
+	std::vector<SIMDVec> arena;            // One permuted array at a time
+};
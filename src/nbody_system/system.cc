@@ -9,75 +9,277 @@
 #include <fstream>
 
 #include "system.hh"
-#include "initial_condition.hh"
+#include "scenario.hh"
+#include "kernel_common.hh"
+#include "snapshot.hh"
+#include "morton.hh"
 
-#ifdef ENABLE_AVX
-#include <immintrin.h>
-#endif
+bool System::setup(int nbodies) {
 
-constexpr float softening2 = 0.00001f;
+	const Scenario *ic = find_scenario(this->scenario);
+	if (!ic || nbodies < ic->min_bodies) return false;
 
-template <typename T>
-inline T inv_sqrt(const T x)
-{
-#ifdef ENABLE_CUDA
-  return rsqrtf(x);
-#else
-  return 1.0f/std::sqrt(x);
-#endif
+	allocate(nbodies);
+	ic->generate(*this);
+
+	return true;
 }
 
-bool System::setup(int nbodies) {
 
-	if (nbodies % CHUNK != 0) return false;
+// Zeroed state for nbodies bodies
+// the last chunk is padded with ghost bodies: zero mass, at rest at the
+// origin, and never given an acceleration, so they stay put and exert no
+// force. The force drivers skip them or mask them out of the last vector
+void System::allocate(int nbodies) {
 
 	this->num_bodies = nbodies;
+	this->elapsed_time = 0.0f;
+	const std::size_t chunks = (static_cast<std::size_t>(nbodies) + CHUNK - 1) / CHUNK;
+
+	this->PosX = std::vector<SIMDVec>(chunks);
+	this->PosY = std::vector<SIMDVec>(chunks);
+	this->PosZ = std::vector<SIMDVec>(chunks);
 	
-	this->PosX = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	this->PosY = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	this->PosZ = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	
-	this->VelX = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	this->VelY = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	this->VelZ = std::vector<SIMDVec>(this->num_bodies/CHUNK);
+	this->VelX = std::vector<SIMDVec>(chunks);
+	this->VelY = std::vector<SIMDVec>(chunks);
+	this->VelZ = std::vector<SIMDVec>(chunks);
 	
-	this->AccX = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	this->AccY = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-	this->AccZ = std::vector<SIMDVec>(this->num_bodies/CHUNK);
+	this->AccX = std::vector<SIMDVec>(chunks);
+	this->AccY = std::vector<SIMDVec>(chunks);
+	this->AccZ = std::vector<SIMDVec>(chunks);
 	
-	this->Mass = std::vector<SIMDVec>(this->num_bodies/CHUNK);
-
-	this->flatPos = std::vector<float>(3 * this->num_bodies);
-	this->flatVel = std::vector<float>(3 * this->num_bodies);
+	this->Mass = std::vector<SIMDVec>(chunks);
 
-	this->Cidx  = std::vector<std::size_t>(this->num_bodies/CHUNK);
+	this->Cidx  = std::vector<std::size_t>(chunks);
 	std::iota(std::begin(this->Cidx), std::end(this->Cidx), 0);
 
-    rotating_4(*this);
-
-    return true;
+	// Ghosts have a level and a speed too, so the per-chunk loops need no bounds
+	this->Level = std::vector<std::uint8_t>(chunks * CHUNK);
+	this->Speed = std::vector<std::uint16_t>(chunks * CHUNK);
+	this->Id.clear();
+	this->Active.reserve(chunks);
+	this->levels_assigned = false;
+	this->sort_countdown = 0;
 }
 
 
 void System::advance(float timestep) {
+	PROFILE_STEP(this->profile, this->counters, this->hw_counters);
+
+	// Between steps all bodies are synchronized, and the accelerations (and
+	// levels) the next step starts from move with their bodies
+	if (this->sort_interval > 0) {
+		// A shorter interval takes effect right away
+		this->sort_countdown = std::min(this->sort_countdown, this->sort_interval);
+		if (this->sort_countdown <= 0) sort_bodies();
+		this->sort_countdown--;
+	}
+
+	if (this->block_timesteps) {
+		advance_block(timestep);
+		return;
+	}
 
 	const float half_dt = timestep / 2;
 	update_velocities(half_dt);
-	update_positions(timestep);
+	update_positions(timestep, this->track_speed);
+	compute_forces(this->Cidx);
+	update_velocities(half_dt);
 
-#ifdef ENABLE_AVX
-	accumulate_forces_AVX();
-#else
-	accumulate_forces();
-#endif
+	this->elapsed_time += timestep;
+}
 
-	update_velocities(half_dt);
+
+// Hierarchical (block) timestepping
+// a body on level L takes steps of timestep / 2^L; the block step is divided
+// into 2^max_level ticks and a body is active at tick t when its step ends
+// there. Every tick drifts all bodies, but only the chunks holding an active
+// body have their forces recomputed and only active bodies are kicked (KDK).
+// All bodies are synchronized again when advance() returns
+void System::advance_block(float timestep) {
+
+	const int levels = std::clamp(this->max_level, 0, MAX_BLOCK_LEVEL);
+	const std::size_t ticks = std::size_t{1} << levels;
+	const float dt_min = timestep / ticks;
+	// Mean spacing of the bodies, for the levels of those at rest; the bodies
+	// hardly move within a block step
+	const BoundingCube box = bounding_cube(this->PosX.data(), this->PosY.data(),
+	                                       this->PosZ.data(), static_cast<std::size_t>(this->num_bodies));
+	const float spacing = box.extent / std::cbrt(static_cast<float>(this->num_bodies));
+
+	if (!this->levels_assigned) {
+		compute_forces(this->Cidx);
+		assign_levels(0, levels, timestep, spacing);
+		this->levels_assigned = true;
+	} else {
+		// The finest level may have been lowered since the last block step
+		std::for_each(std::execution::par_unseq, std::begin(this->Level),
+		              std::end(this->Level), [=](std::uint8_t &l) {
+			l = std::min(l, static_cast<std::uint8_t>(levels));
+		});
+	}
+
+	for (std::size_t tick = 0; tick < ticks; tick++) {
+		kick_block(tick, levels, dt_min);
+		update_positions(dt_min, this->track_speed && tick + 1 == ticks);
+		select_active(tick + 1, levels);
+		compute_forces(this->Active);
+		kick_block(tick + 1, levels, dt_min);
+		assign_levels(tick + 1, levels, timestep, spacing);
+	}
 
 	this->elapsed_time += timestep;
 }
 
 
+// Half kick of the bodies whose step begins or ends at tick
+void System::kick_block(std::size_t tick, int levels, float dt_min) {
+	PROFILE_PHASE(this->profile, StepPhase::Kick);
+
+	auto *vx = this->VelX.data();
+	auto *vy = this->VelY.data();
+	auto *vz = this->VelZ.data();
+	auto const *ax = this->AccX.data();
+	auto const *ay = this->AccY.data();
+	auto const *az = this->AccZ.data();
+	auto const *lv = this->Level.data();
+
+	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
+									std::end(this->Cidx), [=](std::size_t i) {
+		for (std::size_t j = 0; j < CHUNK; j++) {
+			const std::size_t span = std::size_t{1} << (levels - lv[i * CHUNK + j]);
+			const float dt = (tick % span == 0) ? 0.5f * span * dt_min : 0.0f;
+			vx[i].data[j] += ax[i].data[j] * dt;
+			vy[i].data[j] += ay[i].data[j] * dt;
+			vz[i].data[j] += az[i].data[j] * dt;
+		}
+	});
+}
+
+
+// Collect the chunks that hold at least one body whose step ends at tick
+void System::select_active(std::size_t tick, int levels) {
+	PROFILE_PHASE(this->profile, StepPhase::Levels);
+
+	auto const *lv = this->Level.data();
+	this->Active.resize(this->Cidx.size());
+	auto end = std::copy_if(std::execution::par_unseq, std::begin(this->Cidx),
+	                        std::end(this->Cidx), std::begin(this->Active), [=](std::size_t i) {
+		bool active = false;
+		for (std::size_t j = 0; j < CHUNK; j++) {
+			active |= (tick % (std::size_t{1} << (levels - lv[i * CHUNK + j])) == 0);
+		}
+		return active;
+	});
+	this->Active.erase(end, std::end(this->Active));
+}
+
+
+// New levels for the bodies whose step ends at tick, from dt = eta |v| / |a|
+// or, smaller for bodies fast to leave their place, dt = sqrt(2 eta d / |a|):
+// the time to fall eta spacings d from rest, which alone decides for a body
+// at rest. A body may always move to a finer level, but only to a coarser
+// one whose step boundary coincides with tick so that it stays synchronized
+void System::assign_levels(std::size_t tick, int levels, float timestep, float spacing) {
+	PROFILE_PHASE(this->profile, StepPhase::Levels);
+
+	auto const *vx = this->VelX.data();
+	auto const *vy = this->VelY.data();
+	auto const *vz = this->VelZ.data();
+	auto const *ax = this->AccX.data();
+	auto const *ay = this->AccY.data();
+	auto const *az = this->AccZ.data();
+	auto *lv = this->Level.data();
+	const float eta2 = this->step_accuracy * this->step_accuracy;
+	const float fall = 2.0f * this->step_accuracy * spacing;
+	const float dt2 = timestep * timestep;
+
+	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
+									std::end(this->Cidx), [=](std::size_t i) {
+		for (std::size_t j = 0; j < CHUNK; j++) {
+			const int old_level = lv[i * CHUNK + j];
+			if (tick % (std::size_t{1} << (levels - old_level)) != 0) continue;
+
+			const float v2 = vx[i].data[j] * vx[i].data[j] + vy[i].data[j] * vy[i].data[j]
+			               + vz[i].data[j] * vz[i].data[j];
+			const float a2 = ax[i].data[j] * ax[i].data[j] + ay[i].data[j] * ay[i].data[j]
+			               + az[i].data[j] * az[i].data[j];
+
+			// Smallest level with (timestep / 2^level)^2 <= the allowed dt^2; with
+			// no acceleration, both criteria allow any step
+			float allowed = fall / std::sqrt(a2);
+			if (v2 > 0.0f) allowed = std::min(allowed, eta2 * v2 / a2);
+			float wanted = dt2;
+			int level = 0;
+			while (level < levels && allowed < wanted) {
+				wanted *= 0.25f;
+				level++;
+			}
+			while (level < old_level && tick % (std::size_t{1} << (levels - level)) != 0) {
+				level++;
+			}
+			lv[i * CHUNK + j] = static_cast<std::uint8_t>(level);
+		}
+	});
+}
+
+
+void System::update_forces() {
+	compute_forces(this->Cidx);
+}
+
+
+// Forces on the bodies of the target chunks
+void System::compute_forces(const std::vector<std::size_t> &targets) {
+	PROFILE_PHASE(this->profile, StepPhase::Forces);
+	// Pairs evaluated by the direct-sum drivers, the tree methods count their own
+	[[maybe_unused]] const std::uint64_t direct_pairs =
+		static_cast<std::uint64_t>(targets.size()) * CHUNK * this->num_bodies;
+	switch (this->force_method) {
+	case ForceMethod::BarnesHut:
+		accumulate_forces_BH(targets);
+		break;
+	case ForceMethod::ParticleMesh:
+		accumulate_forces_PM(targets);
+		break;
+	case ForceMethod::FastMultipole:
+		accumulate_forces_FMM(targets);
+		break;
+#ifdef ENABLE_CUDA
+	case ForceMethod::DirectTiled:
+	case ForceMethod::DirectSymmetric:
+	case ForceMethod::DirectSum:
+	default:
+		accumulate_forces(targets);
+		PROFILE_INTERACTIONS(this->profile, direct_pairs, 0);
+		break;
+#else
+	case ForceMethod::DirectTiled:
+		accumulate_forces_tiled(targets);
+		PROFILE_INTERACTIONS(this->profile, direct_pairs, 0);
+		break;
+	case ForceMethod::DirectSymmetric:
+		// pairs are shared between chunks, so only a full evaluation is symmetric
+		if (targets.size() == this->Cidx.size()) {
+			accumulate_forces_symmetric(targets);
+			PROFILE_INTERACTIONS(this->profile, direct_pairs / 2, 0);
+		} else {
+			accumulate_forces_simd(targets);
+			PROFILE_INTERACTIONS(this->profile, direct_pairs, 0);
+		}
+		break;
+	case ForceMethod::DirectSum:
+	default:
+		accumulate_forces_simd(targets);
+		PROFILE_INTERACTIONS(this->profile, direct_pairs, 0);
+		break;
+#endif
+	}
+}
+
+
 void System::update_velocities(float timestep) {
+	PROFILE_PHASE(this->profile, StepPhase::Kick);
   	const float dt{timestep};
 
 	auto *vx = this->VelX.data();
@@ -98,7 +300,10 @@ void System::update_velocities(float timestep) {
 }
 
 
-void System::update_positions(float timestep) {
+// With speeds, the velocities already loaded for the drift are also packed
+// into Speed, so the display gets them without another pass over memory
+void System::update_positions(float timestep, bool speeds) {
+	PROFILE_PHASE(this->profile, StepPhase::Drift);
   	const float dt{timestep};
 
 	auto *px = this->PosX.data();
@@ -107,6 +312,20 @@ void System::update_positions(float timestep) {
 	auto const *vx = this->VelX.data();
 	auto const *vy = this->VelY.data();
 	auto const *vz = this->VelZ.data();
+	auto *sp = this->Speed.data();
+
+	if (speeds) {
+		std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
+										std::end(this->Cidx), [=](std::size_t i) {
+			for (std::size_t j = 0; j < CHUNK; j++) {
+				px[i].data[j] += vx[i].data[j] * dt;
+				py[i].data[j] += vy[i].data[j] * dt;
+				pz[i].data[j] += vz[i].data[j] * dt;
+				sp[i * CHUNK + j] = encode_speed(vx[i].data[j], vy[i].data[j], vz[i].data[j]);
+			}
+		});
+		return;
+	}
 
   	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
 									std::end(this->Cidx), [=](std::size_t i) {
@@ -119,7 +338,23 @@ void System::update_positions(float timestep) {
 }
 
 
-void System::accumulate_forces() {
+void System::update_speeds() {
+
+	auto const *vx = this->VelX.data();
+	auto const *vy = this->VelY.data();
+	auto const *vz = this->VelZ.data();
+	auto *sp = this->Speed.data();
+
+	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
+	              std::end(this->Cidx), [=](std::size_t i) {
+		for (std::size_t j = 0; j < CHUNK; j++) {
+			sp[i * CHUNK + j] = encode_speed(vx[i].data[j], vy[i].data[j], vz[i].data[j]);
+		}
+	});
+}
+
+
+void System::accumulate_forces(const std::vector<std::size_t> &targets) {
 
 	auto const *px = this->PosX.data();
 	auto const *py = this->PosY.data();
@@ -129,151 +364,215 @@ void System::accumulate_forces() {
 	auto *ay = this->AccY.data();
 	auto *az = this->AccZ.data();
 
-	std::size_t CHUNKS = this->num_bodies / CHUNK;
-	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
-									std::end(this->Cidx), [=](std::size_t i) {
-
-        for (std::size_t j = 0; j < CHUNK; j++) {
-            const float p_x = px[i].data[j];
-            const float p_y = py[i].data[j]; 
-            const float p_z = pz[i].data[j];
-            float r_x = 0.0f;
-            float r_y = 0.0f;
-            float r_z = 0.0f;
-
-            for (std::size_t ii = 0; ii < CHUNKS; ii++) {
-                for (std::size_t jj = 0; jj < CHUNK; jj++) {
-                    float dx = px[ii].data[jj] - p_x;
-                    float dy = py[ii].data[jj] - p_y;
-                    float dz = pz[ii].data[jj] - p_z;
-                    float d2 = dx * dx + dy * dy + dz * dz;
-                          d2 += softening2;
-                    float inv = inv_sqrt(d2);
-                    float imp = ms[ii].data[jj] * inv * inv * inv;
-                    r_x += dx * imp;
-                    r_y += dy * imp;
-                    r_z += dz * imp;
-                }
-            }
-            ax[i].data[j] = r_x;
-            ay[i].data[j] = r_y;
-            az[i].data[j] = r_z;
-        }
+	const std::size_t n = this->num_bodies;
+	dispatch_rsqrt_mode(this->rsqrt_mode, [&](auto mode) {
+		std::for_each(std::execution::par_unseq, std::begin(targets),
+										std::end(targets), [=](std::size_t i) {
+
+	        const std::size_t lanes = std::min(CHUNK, n - i * CHUNK);
+	        for (std::size_t j = 0; j < lanes; j++) {
+	            const float p_x = px[i].data[j];
+	            const float p_y = py[i].data[j]; 
+	            const float p_z = pz[i].data[j];
+	            float r_x = 0.0f;
+	            float r_y = 0.0f;
+	            float r_z = 0.0f;
+
+	            for (std::size_t b = 0; b < n; b++) {
+	                const std::size_t ii = b / CHUNK;
+	                const std::size_t jj = b % CHUNK;
+	                float dx = px[ii].data[jj] - p_x;
+	                float dy = py[ii].data[jj] - p_y;
+	                float dz = pz[ii].data[jj] - p_z;
+	                float d2 = dx * dx + dy * dy + dz * dz;
+	                      d2 += softening2;
+	                float inv = inv_sqrt<decltype(mode)::value>(d2);
+	                float imp = ms[ii].data[jj] * inv * inv * inv;
+	                r_x += dx * imp;
+	                r_y += dy * imp;
+	                r_z += dz * imp;
+	            }
+	            ax[i].data[j] = r_x;
+	            ay[i].data[j] = r_y;
+	            az[i].data[j] = r_z;
+	        }
+		});
 	});
 }
 
 
+ForceData System::force_data() {
+	return ForceData{this->PosX.data()->data, this->PosY.data()->data,
+	                 this->PosZ.data()->data, this->Mass.data()->data,
+	                 this->AccX.data()->data, this->AccY.data()->data,
+	                 this->AccZ.data()->data};
+}
 
-void System::accumulate_forces_AVX() {
 
-#ifdef ENABLE_AVX
+// Direct sum through the kernels of the selected instruction set
+// one task per chunk; each kernel handles CHUNK bodies in CHUNK/width vectors
+void System::accumulate_forces_simd(const std::vector<std::size_t> &targets) {
 
-	auto const *px = this->PosX.data();
-	auto const *py = this->PosY.data();
-	auto const *pz = this->PosZ.data();
-	auto const *ms = this->Mass.data();
-	auto *ax = this->AccX.data();
-	auto *ay = this->AccY.data();
-	auto *az = this->AccZ.data();
+	const ForceKernels *kernels = &get_force_kernels(this->simd_level);
+	const std::size_t mode = static_cast<std::size_t>(this->rsqrt_mode);
+	const ForceData d = force_data();
+	const std::size_t n = this->num_bodies;
 
-	std::size_t CHUNKS = this->num_bodies / CHUNK;
-	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
-									std::end(this->Cidx), [=](int i) {
-
-    	// Structured 256-bit loads (8 unique floats per __m256)
-    	const __m256 p_xi = _mm256_load_ps(&px[i].data[0]);
-    	const __m256 p_yi = _mm256_load_ps(&py[i].data[0]);
-    	const __m256 p_zi = _mm256_load_ps(&pz[i].data[0]);
-
-    	// Create 256-bit vectors for accumulating accelerations  
-    	__m256 result_x = _mm256_setzero_ps();
-    	__m256 result_y = _mm256_setzero_ps();
-    	__m256 result_z = _mm256_setzero_ps();
-
-    	// Loop through array of 256-bit vectors
-    	for (std::size_t j = 0; j < CHUNKS; j++) {
-    	    for (std::size_t k = 0; k < CHUNK; k++) {
-
-    	        // Set all 8 floats in 256-bit vector to the same value
-    	        const __m256 p_xj = _mm256_set1_ps(px[j].data[k]);
-    	        const __m256 p_yj = _mm256_set1_ps(py[j].data[k]);
-    	        const __m256 p_zj = _mm256_set1_ps(pz[j].data[k]);
-    	        const __m256 mass = _mm256_set1_ps(ms[j].data[k]);
-
-    	        // Distance between positions (p_xi contains 8 unique floats and p_xj contains 8 copies of the same value)
-    	        __m256 d_x = _mm256_sub_ps(p_xj, p_xi);
-    	        __m256 d_y = _mm256_sub_ps(p_yj, p_yi);
-    	        __m256 d_z = _mm256_sub_ps(p_zj, p_zi);
-
-    	        // Square the distance and add the squared softening length
-    	        __m256 d_sqrd = _mm256_add_ps( 
-    	                        _mm256_add_ps( 
-    	                        _mm256_mul_ps(d_x, d_x), 
-    	                        _mm256_mul_ps(d_y, d_y)), 
-    	                        _mm256_mul_ps(d_z, d_z));
-    	        d_sqrd = _mm256_add_ps(d_sqrd, _mm256_set1_ps(softening2));
-
-    	        // Calculate inv_d_cubed = 1 / d_sqrd^(3/2)
-    	        __m256 inv_d = _mm256_rsqrt_ps(d_sqrd); //rsqrt_nr_256(d_sqrd) or rsqrt_nr2_256(d_sqrd);
-    	        __m256 inv_d_cubed = _mm256_mul_ps(inv_d,_mm256_mul_ps(inv_d, inv_d ));
-
-    	        // impulse = mass_j * inv_d_cubed
-    	        __m256 impulse = _mm256_mul_ps(mass, inv_d_cubed);
-
-    	        // Get acceleration by giving the impulse a direction -- multiply it with d_x
-    	        // accel = mass_j (m_1 * r_01) / (d^2 + e^2)^(3/2)
-    	        // Accumulate accelerations into result vectors
-    	        result_x = _mm256_add_ps(result_x, _mm256_mul_ps( d_x, impulse ) );
-    	        result_y = _mm256_add_ps(result_y, _mm256_mul_ps( d_y, impulse ) );
-    	        result_z = _mm256_add_ps(result_z, _mm256_mul_ps( d_z, impulse ) );
-    	    }
-    	}
-    	_mm256_store_ps(&ax[i].data[0], result_x);
-    	_mm256_store_ps(&ay[i].data[0], result_y);
-    	_mm256_store_ps(&az[i].data[0], result_z);
+	std::for_each(std::execution::par_unseq, std::begin(targets),
+									std::end(targets), [=](std::size_t i) {
+		for (std::size_t j = 0; j < CHUNK; j++) {
+			d.ax[i * CHUNK + j] = 0.0f;
+			d.ay[i * CHUNK + j] = 0.0f;
+			d.az[i * CHUNK + j] = 0.0f;
+		}
+		kernels->accumulate[mode](d, i * CHUNK, std::min((i + 1) * CHUNK, n), 0, n);
 	});
-#endif
 }
 
-void System::write_points(int filenum) {
-  	std::ofstream outfile("velocity_magnitude." + std::to_string(filenum) + ".3D");
-  	outfile << std::setprecision(8);
-  	outfile << "x y z\n";
-  	outfile << "#coordflag xyz\n";
-  	for (std::size_t j = 0; j < this->num_bodies/CHUNK; j++) {
-    	for (std::size_t k = 0; k < CHUNK; k++) {
-  			outfile << this->PosX[j].data[k] << " " << this->PosY[j].data[k] << " "
-            << this->PosZ[j].data[k] << "\n";
-        }
-  	}
+
+namespace {
+// j-tile of 2048 bodies * 16 bytes (x, y, z, m) = 32 KB, sized for L1
+constexpr std::size_t TILE_BODIES = 2048;
+// Number of i-chunks that reuse each j-tile while it is cache resident
+constexpr std::size_t GROUP_CHUNKS = 64;
+}; // namespace
+
+
+// Cache-blocked variant of accumulate_forces_simd
+// each task owns a group of i-chunks and sweeps the j-range one L1-sized tile
+// at a time, so every tile is loaded from memory once per group instead of
+// once per i-chunk; the kernels keep several i-vectors per j broadcast
+void System::accumulate_forces_tiled(const std::vector<std::size_t> &targets) {
+
+	const ForceKernels *kernels = &get_force_kernels(this->simd_level);
+	const std::size_t mode = static_cast<std::size_t>(this->rsqrt_mode);
+	const ForceData d = force_data();
+	const std::size_t n = this->num_bodies;
+	const std::size_t *ts = targets.data();
+	const std::size_t nt = targets.size();
+
+	std::vector<std::size_t> groups((nt + GROUP_CHUNKS - 1) / GROUP_CHUNKS);
+	std::iota(std::begin(groups), std::end(groups), 0);
+
+	std::for_each(std::execution::par_unseq, std::begin(groups),
+									std::end(groups), [=](std::size_t g) {
+		const std::size_t t_begin = g * GROUP_CHUNKS;
+		const std::size_t t_end = std::min(t_begin + GROUP_CHUNKS, nt);
+
+		for (std::size_t t = t_begin; t < t_end; t++) {
+			for (std::size_t i = ts[t] * CHUNK; i < (ts[t] + 1) * CHUNK; i++) {
+				d.ax[i] = 0.0f;
+				d.ay[i] = 0.0f;
+				d.az[i] = 0.0f;
+			}
+		}
+
+		for (std::size_t j_begin = 0; j_begin < n; j_begin += TILE_BODIES) {
+			const std::size_t j_end = std::min(j_begin + TILE_BODIES, n);
+			// Runs of consecutive chunks are passed as one range so the kernels
+			// can keep several i-vectors in registers
+			for (std::size_t t = t_begin; t < t_end;) {
+				std::size_t run = t + 1;
+				while (run < t_end && ts[run] == ts[run - 1] + 1) run++;
+				kernels->accumulate[mode](d, ts[t] * CHUNK, std::min((ts[run - 1] + 1) * CHUNK, n),
+				                          j_begin, j_end);
+				t = run;
+			}
+		}
+	});
 }
 
-void System::interleave_data() {
-	auto const *px = this->PosX.data();
-	auto const *py = this->PosY.data();
-	auto const *pz = this->PosZ.data();
 
-	auto const *vx = this->VelX.data();
-	auto const *vy = this->VelY.data();
-	auto const *vz = this->VelZ.data();
+namespace {
+// Bodies per block of the symmetric kernel
+constexpr std::size_t SYM_BLOCK_BODIES = 64 * CHUNK;
+
+// Round-robin (circle method) schedule over nblocks blocks: every round is a
+// set of disjoint block pairs, so the tasks of a round never touch the same
+// accelerations; the last round holds the diagonal (I, I) blocks
+std::vector<std::vector<std::pair<std::size_t, std::size_t>>>
+pair_schedule(std::size_t nblocks) {
+	const std::size_t n = nblocks + (nblocks % 2);
+	std::vector<std::vector<std::pair<std::size_t, std::size_t>>> rounds;
+	for (std::size_t r = 0; r + 1 < n; r++) {
+		std::vector<std::pair<std::size_t, std::size_t>> round;
+		if (n - 1 < nblocks) round.emplace_back(r, n - 1);
+		for (std::size_t k = 1; k < n / 2; k++) {
+			round.emplace_back((r + k) % (n - 1), (r + n - 1 - k) % (n - 1));
+		}
+		rounds.push_back(std::move(round));
+	}
+	std::vector<std::pair<std::size_t, std::size_t>> diagonal;
+	for (std::size_t b = 0; b < nblocks; b++) diagonal.emplace_back(b, b);
+	rounds.push_back(std::move(diagonal));
+	return rounds;
+}
+}; // namespace
 
-	auto *fp = this->flatPos.data();
-	auto *fv = this->flatVel.data();
 
-	std::size_t CHUNKS = this->num_bodies / CHUNK;
-	std::for_each(std::execution::par_unseq, std::begin(this->Cidx),
-									std::end(this->Cidx), [=](int i) {
+// Direct sum that evaluates each pair once (Newton's third law)
+// blocks of chunks are paired by a round-robin schedule; all pairs within a
+// round run in parallel and write disjoint accelerations, so no atomics or
+// per-thread buffers are needed and the result is deterministic. The kernel
+// works on whole chunks: ghosts add nothing, having no mass, and the pull
+// they receive is cleared afterwards
+void System::accumulate_forces_symmetric(const std::vector<std::size_t> &targets) {
 
+	const ForceKernels *kernels = &get_force_kernels(this->simd_level);
+	const std::size_t mode = static_cast<std::size_t>(this->rsqrt_mode);
+	const ForceData d = force_data();
+	const std::size_t n = this->Cidx.size() * CHUNK;
+	const std::size_t nblocks = (n + SYM_BLOCK_BODIES - 1) / SYM_BLOCK_BODIES;
+
+	std::for_each(std::execution::par_unseq, std::begin(targets),
+									std::end(targets), [=](std::size_t i) {
 		for (std::size_t j = 0; j < CHUNK; j++) {
-			std::size_t idx = i * CHUNK + j;
-			
-			fp[3*idx + 0] = px[i].data[j];
-			fp[3*idx + 1] = py[i].data[j];
-			fp[3*idx + 2] = pz[i].data[j];
-
-			fv[3*idx + 0] = vx[i].data[j];
-			fv[3*idx + 1] = vy[i].data[j];
-			fv[3*idx + 2] = vz[i].data[j];
+			d.ax[i * CHUNK + j] = 0.0f;
+			d.ay[i * CHUNK + j] = 0.0f;
+			d.az[i * CHUNK + j] = 0.0f;
 		}
 	});
-}
\ No newline at end of file
+
+	for (const auto &round : pair_schedule(nblocks)) {
+		std::for_each(std::execution::par_unseq, std::begin(round), std::end(round),
+		              [=](const std::pair<std::size_t, std::size_t> &blocks) {
+			const std::size_t i_begin = blocks.first * SYM_BLOCK_BODIES;
+			const std::size_t j_begin = blocks.second * SYM_BLOCK_BODIES;
+			kernels->symmetric[mode](d, i_begin, std::min(i_begin + SYM_BLOCK_BODIES, n),
+			                   j_begin, std::min(j_begin + SYM_BLOCK_BODIES, n));
+		});
+	}
+	for (std::size_t b = this->num_bodies; b < n; b++) {
+		d.ax[b] = 0.0f;
+		d.ay[b] = 0.0f;
+		d.az[b] = 0.0f;
+	}
+}
+
+
+// Every per-body array follows the new order; ghosts stay in the last chunk
+void System::sort_bodies() {
+	PROFILE_PHASE(this->profile, StepPhase::Sort);
+
+	const std::size_t n = static_cast<std::size_t>(this->num_bodies);
+	if (this->track_ids && this->Id.empty()) {
+		this->Id.resize(this->Level.size());
+		std::iota(std::begin(this->Id), std::end(this->Id), 0);
+	}
+	this->sorter.sort(this->PosX.data(), this->PosY.data(), this->PosZ.data(), n);
+	std::vector<SIMDVec> *arrays[] = {
+		&this->PosX, &this->PosY, &this->PosZ, &this->VelX, &this->VelY,
+		&this->VelZ, &this->AccX, &this->AccY, &this->AccZ, &this->Mass};
+	for (std::vector<SIMDVec> *a : arrays) this->sorter.permute(a->data());
+	this->sorter.permute(this->Level.data());
+	this->sorter.permute(this->Speed.data());
+	if (!this->Id.empty()) this->sorter.permute(this->Id.data());
+	this->sort_countdown = this->sort_interval;
+}
+
+
+void System::write_points(int filenum) {
+  	std::ofstream outfile("velocity_magnitude." + std::to_string(filenum) + ".3D");
+  	write_text_points(outfile, this->PosX.data()->data, this->PosY.data()->data,
+  	                  this->PosZ.data()->data, this->num_bodies);
+}
@@ -2,15 +2,66 @@
 #pragma once
 
 #include <vector>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <string>
 
 #include "simd_vec.hh"
+#include "octree.hh"
+#include "particle_mesh.hh"
+#include "fmm.hh"
+#include "spatial_sort.hh"
+#include "profile.hh"
+#include "force_kernels.hh"
+#include "scenario.hh"
+
+struct Checkpoint;
+
+// Fewest bodies of the default scenario, one for each galaxy of rotating_4
+constexpr int MIN_BODIES = 4;
+constexpr std::uint64_t DEFAULT_SEED = 1;
+// Finest max_level; deeper would overflow the substep counter of a block step
+constexpr int MAX_BLOCK_LEVEL = 20;
+
+// Speed of a body packed in 16 bits for display: the float |v|^2 without its
+// (always clear) sign bit and its low 15 bits, an 8-bit exponent and 8
+// mantissa bits. It grows monotonically with the speed and spans any speed at
+// about 0.1 % resolution, without a transcendental or a scale known in
+// advance; decode_speed() shifts it back into the float
+inline std::uint16_t encode_speed(float vx, float vy, float vz) {
+	return static_cast<std::uint16_t>(std::bit_cast<std::uint32_t>(vx * vx + vy * vy + vz * vz) >> 15);
+}
+inline float decode_speed(std::uint16_t code) {
+	return std::sqrt(std::bit_cast<float>(std::uint32_t{code} << 15));
+}
+
+// Force evaluation methods selectable at runtime
+enum class ForceMethod {
+	DirectSum, // O(N^2) all-pairs sum
+	DirectTiled, // O(N^2) all-pairs sum, cache and register blocked
+	DirectSymmetric, // O(N^2/2) pair sum using Newton's third law
+	BarnesHut, // O(N log N) octree approximation
+	ParticleMesh, // O(N + G^3 log G) FFT Poisson solve on a G^3 mesh
+	FastMultipole, // O(N) Cartesian multipole and local expansions on the octree
+};
 
 class System {
 public:
 	System() = default;
-	bool setup(int nbodies);
+	bool setup(int nbodies); // Generates `scenario`; false if unknown or nbodies is too small
+	// Bodies from an external file (see scenario.hh); on false the state is
+	// unspecified and the System must be set up again
+	bool load_initial_conditions(const std::string &path);
 	void advance(float timestep);
+	void update_forces(); // Accelerations at the current positions, without a step
+	void update_speeds(); // Fills Speed from the current velocities
+	void sort_bodies(); // Reorders the bodies along a Morton curve, see sort_interval
 	void write_points(int filenum);
+	bool write_snapshot(const std::string &path) const;
+	bool read_snapshot(const std::string &path);
+	void capture(Checkpoint &ckpt) const; // Full state for a restart
+	bool restore(const Checkpoint &ckpt);
 	std::vector<SIMDVec> PosX; // Position data
 	std::vector<SIMDVec> PosY;
 	std::vector<SIMDVec> PosZ;
@@ -21,16 +72,67 @@ public:
 	std::vector<SIMDVec> AccY;
 	std::vector<SIMDVec> AccZ;
 	std::vector<SIMDVec> Mass; // Mass data
+	std::vector<std::uint16_t> Speed; // encode_speed() of each body (and ghost), see track_speed
+	std::vector<std::uint32_t> Id; // Body index before the first sort_bodies(), empty if not numbered (see track_ids)
 	std::vector<std::size_t> Cidx; // Chunk index
-	void interleave_data();
-	std::vector<float> flatPos;
-	std::vector<float> flatVel;
-	int num_bodies{0};
+	int num_bodies{0}; // Any count; the last chunk is padded with massless ghosts
+	std::string scenario{DEFAULT_SCENARIO}; // Name of the initial conditions setup() generates
+	std::uint64_t seed{DEFAULT_SEED}; // Initial condition seed, same bodies for the same seed
 	float elapsed_time{0.0};
+	ForceMethod force_method{ForceMethod::DirectSum};
+	float opening_angle{0.5f}; // Barnes-Hut opening angle (theta)
+	int leaf_size{16}; // Maximum number of bodies in an octree leaf
+	int pm_grid{64}; // Particle-mesh cells per axis (rounded up to a power of two, at most 256)
+	// FMM defaults are the fastest of a sweep at 64k-256k bodies, about BH's
+	// accuracy; even so a force evaluation costs 2.5-6 times Barnes-Hut's
+	int fmm_order{6}; // FMM expansion order (1 to FMM_MAX_ORDER)
+	int fmm_leaf_size{128}; // Maximum number of bodies in an FMM leaf
+	float fmm_theta{0.8f}; // FMM cells interact by expansions when (r_a + r_b) < theta d
+	SimdLevel simd_level{detect_simd_level()}; // Instruction set of the direct-sum kernels
+	RsqrtMode rsqrt_mode{RsqrtMode::Raw}; // Precision of 1/sqrt in all force kernels
+	bool block_timesteps{false}; // Individual power-of-two timesteps per body
+	int max_level{6}; // Finest block level, substeps of timestep / 2^max_level
+	// eta in the step criteria dt = eta |v| / |a| and dt = sqrt(2 eta d / |a|),
+	// d the mean spacing of the bodies; a body takes the smaller of the two
+	float step_accuracy{0.02f};
+	std::vector<std::uint8_t> Level; // Block level of each body (and ghost), step = timestep / 2^level
+#ifdef ENABLE_PROFILING
+	StepProfile profile; // Phase timings and counters
+	bool hw_counters{false}; // Also count cycles, instructions and cache misses (Linux)
+#endif
+	// Refresh Speed in the drift of every step, at the velocities the drift
+	// uses (half a kick behind the positions)
+	bool track_speed{false};
+	// Sort the bodies in space every sort_interval steps, from the first
+	// advance() on, so that chunks hold neighbours; 0 for never
+	int sort_interval{0};
+	int sort_countdown{0}; // Steps left until the next sort
+	bool track_ids{false}; // Number the bodies in Id before they are first sorted
 private:
+	void allocate(int nbodies);
 	void update_velocities(float timestep);
-	void update_positions(float timestep);
-	void accumulate_forces();
-	void accumulate_forces_AVX();
+	void update_positions(float timestep, bool speeds);
+	void advance_block(float timestep);
+	void kick_block(std::size_t tick, int levels, float dt_min);
+	void select_active(std::size_t tick, int levels);
+	void assign_levels(std::size_t tick, int levels, float timestep, float spacing);
+	void accumulate_forces(const std::vector<std::size_t> &targets);
+	void accumulate_forces_simd(const std::vector<std::size_t> &targets);
+	void accumulate_forces_tiled(const std::vector<std::size_t> &targets);
+	void accumulate_forces_symmetric(const std::vector<std::size_t> &targets);
+	void accumulate_forces_BH(const std::vector<std::size_t> &targets);
+	void accumulate_forces_PM(const std::vector<std::size_t> &targets);
+	void accumulate_forces_FMM(const std::vector<std::size_t> &targets);
+	void compute_forces(const std::vector<std::size_t> &targets);
+	ForceData force_data();
+	Octree octree;
+	ParticleMesh mesh;
+	Fmm fmm;
+	SpatialSort sorter;
+#ifdef ENABLE_PROFILING
+	HwCounters counters;
+#endif
+	std::vector<std::size_t> Active; // Chunks with a body at the current block boundary
+	bool levels_assigned{false};
 };
 